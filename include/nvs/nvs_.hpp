@@ -1,87 +1,783 @@
 #pragma once
 
 #include "nvs_enums.hpp"
+#include "nvs_traits.hpp"
 #include "sdkconfig.h" // Configuration variables
 #include "system_.hpp"
 
 #include <stddef.h> // Standard libraries
 #include <stdbool.h>
+#include <string.h>
+#include <atomic>
 #include <sstream>
+#include <span>
+#include <string>
+#include <tuple>
+#include <vector>
 
 #include <esp_log.h>
 #include <esp_err.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
 #include "nvs.h"
 #include "nvs_flash.h"
 
 class System;
+class NVS;
+class NVS_BlobSink;
+class NVS_BlobSource;
+struct NVS_IMPORT_REPORT;
 
-extern "C"
+/* NVS_Shadow */
+constexpr uint8_t NVS_SHADOW_MAX_NAMESPACES = 4;   // Number of namespaces which may hold a RAM shadow at the same time.
+constexpr size_t NVS_SHADOW_DEFAULT_BUDGET = 2048; // Default number of bytes a single namespace shadow may consume.
+
+struct NVS_SHADOW_ENTRY
+{
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    nvs_type_t type;  // Integers are held in value.  Strings are held in text.
+    uint64_t value;   //
+    std::string text; //
+    bool dirty;       // Entry differs from flash and must be pushed out at the next flush.
+};
+
+struct NVS_SHADOW_STATS
+{
+    uint32_t hits = 0;           // Reads answered from RAM
+    uint32_t misses = 0;         // Reads which had to go to flash
+    uint32_t skippedWrites = 0;  // Writes which matched the shadow and were dropped
+    uint32_t dirtyWrites = 0;    // Writes which only marked an entry dirty
+    uint32_t flushedWrites = 0;  // Dirty entries pushed out to flash
+    uint32_t bypassed = 0;       // Operations which went straight to flash because the budget was exhausted
+    uint32_t directorySkips = 0; // Flash lookups the key directory showed were unnecessary
+    size_t usedBytes = 0;
+    size_t budgetBytes = 0;
+};
+
+/* NVS_Policy */
+struct NVS_WRITE_POLICY // Limits on how often one key may reach flash.  A zero leaves that limit off.
+{
+    uint32_t minIntervalMs;    // Least time between two flash writes of the key
+    uint32_t settleMs;         // The value must stop changing for this long before it is written
+    uint16_t maxWritesPerHour; //
+};
+
+struct NVS_KEY_WRITE_STATS
+{
+    uint32_t flashWrites; // Times the key actually reached flash
+    uint32_t changes;     // Changed values written by callers (repeats of the same value are not counted)
+    uint32_t deferred;    // Flushes which held the key back because of its policy
+};
+
+struct NVS_KEY_POLICY
+{
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    NVS_WRITE_POLICY policy;
+    NVS_KEY_WRITE_STATS stats;
+    int64_t lastWrite;  // esp_timer time of the last flash write
+    int64_t lastChange; // esp_timer time the value last changed in RAM
+    int64_t hourStart;  // Start of the current one hour window
+    uint16_t writesThisHour;
+};
+
+/* NVS_Compress */
+constexpr size_t NVS_COMPRESS_MIN_LENGTH = 32;          // Shorter values are stored as they are without trying
+constexpr size_t NVS_COMPRESS_MAX_LENGTH = 1024;        // Longest compressed string.  Sizes the two static buffers every compressed string passes through.
+constexpr size_t NVS_COMPRESS_HASH_SIZE = 256;          // Entries in the encoder's match table.  Its 512 bytes on the stack are the codec's only state.
+constexpr uint8_t NVS_COMPRESS_MAGIC = 0x5A;            // 'Z'
+constexpr char NVS_COMPRESS_STAGE_KEY[] = "_zstage";    // Names the key whose packed value is waiting under NVS_COMPRESS_STAGE_VALUE
+constexpr char NVS_COMPRESS_STAGE_VALUE[] = "_zstagev"; // Only present while a plain string is part way through becoming a compressed one
+
+struct NVS_COMPRESSED_KEY
+{
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    bool checked; // A plain string left from before has been looked for this boot
+};
+
+struct NVS_PACKED_HEADER // Leads the blob which holds a compressed string
+{
+    uint8_t magic;
+    uint8_t codec;   // NVS_CODEC
+    uint16_t length; // String bytes, not counting the terminator
+    uint32_t crc;    // CRC32 of the string
+};
+
+struct NVS_COMPRESSION_STATS // Strings and blob chunks together.  bytesOut / bytesIn is the ratio achieved.
+{
+    uint32_t encoded;      // Stored compressed
+    uint32_t storedRaw;    // Stored as they were because compression didn't pay
+    uint32_t decoded;      //
+    uint64_t bytesIn;      // Bytes offered for compression
+    uint64_t bytesOut;     // Bytes actually stored for them
+    uint64_t encodeMicros; //
+    uint64_t decodeMicros; //
+};
+
+class NVS_Codec // LZF.  No heap and no state between calls.
+{
+public:
+    static size_t encode(const uint8_t *, size_t, uint8_t *, size_t);    // Returns 0 if the output would not fit, which means it doesn't pay
+    static esp_err_t decode(const uint8_t *, size_t, uint8_t *, size_t); // The output must come out at exactly this length
+};
+
+/* NVS_Directory */
+constexpr uint16_t NVS_DIRECTORY_LONG_VALUE = 0xFFFF; // Recorded as the length of a value too long for 16 bits.  Its length is asked of flash.
+
+struct NVS_DIRECTORY_ENTRY // 8 bytes per key
+{
+    uint32_t hash;   // FNV-1a of the key
+    uint16_t length; // Data bytes.  Strings include their terminator.
+    uint8_t type;    // nvs_type_t
+    bool erased;     // A key with this hash and type was erased.  Another may share them, so the entry stays and flash is asked.
+};
+
+struct NVS_KEY_DIRECTORY
+{
+    bool enabled;
+    bool built;                               // Cleared whenever flash may hold keys we haven't seen.  Rebuilt on the next attach.
+    std::vector<NVS_DIRECTORY_ENTRY> entries; // Sorted by hash
+};
+
+struct NVS_SHADOW
+{
+    char name_space[NVS_KEY_NAME_MAX_SIZE];
+    std::vector<NVS_SHADOW_ENTRY> entries;
+    NVS_SHADOW_STATS stats;
+    uint8_t attached;                     // Number of open handles (openNVSStorage or sessions) working inside this shadow
+    bool writeBehind;                     // Dirty entries are left for the write-behind task instead of being flushed on close
+    std::atomic<bool> flushing;           // The write-behind task is writing a copy of the dirty entries without the namespace lock
+    std::vector<NVS_KEY_POLICY> policies; // One for every key written through the shadow.  Those without a write policy only count.
+    NVS_KEY_DIRECTORY directory;
+    std::vector<NVS_COMPRESSED_KEY> compressed; // Keys whose strings are stored compressed
+    uint8_t subscribers;                        // Subscriptions on this namespace.  Changed values are posted to the notify task while this is non-zero.
+    bool forNotify;                             // Created by subscribe() alone.  Disabled again when its last subscriber leaves.
+};
+
+/* NVS_WriteBehind */
+constexpr uint32_t NVS_WRITE_BEHIND_INTERVAL_MS = 2000; // Longest a dirty entry waits before the task writes it out
+constexpr uint16_t NVS_WRITE_BEHIND_THRESHOLD = 16;     // This many dirty entries in one namespace are written out straight away
+constexpr uint8_t NVS_WRITE_BEHIND_QUEUE_LENGTH = 8;
+constexpr uint32_t NVS_WRITE_BEHIND_STACK_SIZE = 4096;
+
+/* NVS_Notify */
+constexpr uint8_t NVS_NOTIFY_MAX_SUBSCRIBERS = 8;
+constexpr uint8_t NVS_NOTIFY_QUEUE_LENGTH = 16;  // Changes waiting for the notify task.  Changes beyond this are dropped and counted.
+constexpr uint32_t NVS_NOTIFY_STACK_SIZE = 4096; // Callbacks run on this stack
+constexpr size_t NVS_NOTIFY_TEXT_LENGTH = 48;    // String bytes carried in a change, terminator included
+
+struct NVS_CHANGE // Posted by value, so a queue subscriber creates its queue with sizeof(NVS_CHANGE) items
+{
+    char name_space[NVS_KEY_NAME_MAX_SIZE];
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    nvs_type_t type;
+    uint64_t value;                    // Integers as stored.  Cast back to the type written (floats and doubles are their bit pattern).
+    char text[NVS_NOTIFY_TEXT_LENGTH]; // Strings
+    bool truncated;                    // The string didn't fit in text.  Read the key for the rest of it.
+};
+
+using NVS_ChangeCallback = void (*)(const NVS_CHANGE &, void *);
+
+struct NVS_SUBSCRIPTION
+{
+    char name_space[NVS_KEY_NAME_MAX_SIZE];
+    char prefix[NVS_KEY_NAME_MAX_SIZE]; // Empty for every key in the namespace
+    NVS_ChangeCallback callback;
+    void *context;
+    QueueHandle_t queue; // Used instead of the callback when set
+    bool active;
+};
+
+/* NVS_Init */
+#ifndef NVS_DEFERRED_INIT
+#define NVS_DEFERRED_INIT 0 // Set to 1 to mount the partition on a background task.  The first access which needs flash waits for it.
+#endif
+
+constexpr uint32_t NVS_INIT_STACK_SIZE = 6144; // Sized for the recovery path: nvs_flash_erase() and two nvs_flash_init()s under recoverNVS()
+constexpr uint32_t NVS_INIT_STACK_MARGIN = 512;  // Less headroom than this after the mount is logged as a warning
+
+struct NVS_INIT_REPORT
+{
+    bool deferred;           // Mounted on the background task
+    bool recovered;          // The partition had to be erased before it would mount
+    esp_err_t firstResult;   // What the first nvs_flash_init() returned
+    uint32_t initMicros;     // Mounting, including any recovery
+    uint32_t recoveryMicros; // Erase and second mount only
+    int64_t readyAtMicros;   // esp_timer_get_time() when the partition became usable.  Roughly the time since boot.
+    uint32_t maxWaitMicros;  // Longest any caller was held up waiting for the mount
+    uint16_t waiters;        // Callers which had to wait at all
+    uint16_t keptEntries;    // Keys copied out before a recovery erase and written back after it
+    uint16_t droppedEntries; // Keys which were unreadable, over NVS_RECOVERY_BUDGET or refused on the way back
+    uint32_t stackHeadroom;  // Bytes of NVS_INIT_STACK_SIZE the mount task never touched.  0 when we mounted on the caller's stack.
+};
+
+/* NVS_Recovery */
+constexpr size_t NVS_RECOVERY_BUDGET = 16384; // Most bytes of keys and values held in RAM across a recovery erase
+
+/* NVS_Routing */
+constexpr uint8_t NVS_MAX_PARTITIONS = 4; // Partitions mounted besides the default one
+constexpr uint8_t NVS_MAX_ROUTES = 16;    // Namespaces which live somewhere other than the default partition
+
+struct NVS_ROUTE
+{
+    char name_space[NVS_KEY_NAME_MAX_SIZE];
+    char partition[NVS_PART_NAME_MAX_SIZE + 1];
+};
+
+/* NVS_Logging */
+#ifndef NVS_LOG_LEVEL
+#define NVS_LOG_LEVEL LOG_LOCAL_LEVEL // Messages above this level are removed at compile time.  Defaults to the IDF's own maximum.
+#endif
+
+constexpr size_t NVS_LOG_BUFFER_SIZE = 160; // Longer messages are truncated
+
+constexpr esp_log_level_t nvsLogLevel(LOG_TYPE type)
+{
+    return (type == LOG_TYPE::ERROR) ? ESP_LOG_ERROR : (type == LOG_TYPE::WARN) ? ESP_LOG_WARN : ESP_LOG_INFO;
+}
+
+/* Strings */
+constexpr size_t NVS_STRING_COMPARE_STACK = 128; // Stored strings up to this length (with terminator) are compared on the stack before a write.
+
+/* NVS_Session */
+constexpr uint8_t NVS_NAMESPACE_LOCKS = 8; // Namespaces hash onto this many locks.  Sessions on different locks run concurrently.
+
+//
+// A session owns a namespace lock and an nvs handle for its lifetime.  It is obtained from NVS::openSession() and commits exactly once
+// when it is closed or destroyed.  Sessions may be moved but not copied.  The lock is a FreeRTOS mutex, so a session must be released
+// by the same task which opened it.
+//
+class NVS_Session
+{
+public:
+    NVS_Session(void) = default; // An empty session which owns nothing
+    ~NVS_Session(void);
+    NVS_Session(NVS_Session &&) noexcept;
+    NVS_Session &operator=(NVS_Session &&) noexcept;
+    NVS_Session(const NVS_Session &) = delete;
+    NVS_Session &operator=(const NVS_Session &) = delete;
+
+    bool isOpen(void) const { return handle != 0; }
+    esp_err_t getStatus(void) const { return status; } // Reports why openSession() failed when isOpen() is false.
+    nvs_handle_t getHandle(void) const { return handle; }
+
+    void discardChanges(void) { commitOnClose = false; } // Close without a commit
+    esp_err_t close(void);                               // Early release.  Returns the result of the commit.
+
+    template <typename T>
+    esp_err_t read(const char *, T *); // Any integer, bool, float, double or enum
+    template <typename T>
+    esp_err_t write(const char *, T);
+
+    esp_err_t readBoolean(const char *, bool *);
+    esp_err_t writeBoolean(const char *, bool);
+
+    esp_err_t readString(const char *, std::string *);
+    esp_err_t readString(const char *, char *, size_t);
+    esp_err_t readString(const char *key, std::span<char> buffer) { return readString(key, buffer.data(), buffer.size()); }
+    esp_err_t writeString(const char *, std::string *);
+    esp_err_t writeString(const char *, const char *);
+
+    esp_err_t readU8Integer(const char *, uint8_t *);
+    esp_err_t writeU8Integer(const char *, uint8_t);
+
+    esp_err_t readI32Integer(const char *, int32_t *);
+    esp_err_t writeI32Integer(const char *, int32_t);
+
+    esp_err_t readU32Integer(const char *, uint32_t *);
+    esp_err_t writeU32Integer(const char *, uint32_t);
+
+    esp_err_t findKey(const char *, nvs_type_t * = nullptr, size_t * = nullptr); // ESP_ERR_NVS_NOT_FOUND if the key isn't stored
+
+    template <typename T>
+    esp_err_t readArray(const char *, T *, size_t); // Packed table.  A table never stored is saved from the values passed in.
+    template <typename T, size_t N>
+    esp_err_t readArray(const char *key, T (&values)[N]) { return readArray<T>(key, values, N); }
+    template <typename T>
+    esp_err_t readArray(const char *, std::vector<T> *); // Takes the stored element count
+    template <typename T>
+    esp_err_t writeArray(const char *, const T *, size_t); // Rewrites only the chunks which changed
+    template <typename T, size_t N>
+    esp_err_t writeArray(const char *key, const T (&values)[N]) { return writeArray<T>(key, values, N); }
+    template <typename T>
+    esp_err_t writeArray(const char *key, const std::vector<T> &values) { return writeArray<T>(key, values.data(), values.size()); }
+
+private:
+    friend class NVS;
+    friend class NVS_BlobWriter;
+    friend class NVS_Transaction;
+    NVS_Session(NVS *, SemaphoreHandle_t, nvs_handle_t, NVS_SHADOW *);
+    explicit NVS_Session(esp_err_t err) : status(err) {}
+
+    NVS *nvs = nullptr;
+    SemaphoreHandle_t lock = nullptr;
+    nvs_handle_t handle = 0;
+    NVS_SHADOW *shadow = nullptr;
+    const char *partition = NVS_DEFAULT_PART_NAME; // Where the namespace is routed.  Checked for free entries after the commit.
+    bool commitOnClose = true;
+    esp_err_t status = ESP_ERR_NVS_INVALID_HANDLE;
+};
+
+/* NVS_ErrorLog */
+constexpr char NVS_ERROR_LOG_NAMESPACE[] = "nvs_errlog";
+constexpr uint8_t NVS_ERROR_LOG_CAPACITY = 32; // Entries kept.  The oldest is overwritten once the log is full.
+constexpr size_t NVS_ERROR_LOG_LENGTH = 96;    // Bytes per entry including the terminator.  Longer messages are truncated.
+constexpr uint32_t NVS_ERROR_LOG_WAIT_MS = 10; // Longest an append waits on another append before the message is dropped
+
+//
+// Reads the error log oldest first without allocating.  Entries which are overwritten while we read are skipped.
+//
+//     NVS_ErrorLogReader reader;
+//     char text[NVS_ERROR_LOG_LENGTH];
+//     while (reader.next(text, sizeof(text)))
+//         upload(text);
+//
+class NVS_ErrorLogReader
+{
+public:
+    explicit NVS_ErrorLogReader(uint8_t = NVS_ERROR_LOG_CAPACITY); // Reads at most this many entries
+    bool next(char *, size_t);                                      // Returns false at the end or on an error
+
+private:
+    uint32_t index = 0;
+    uint32_t end = 0;
+};
+
+/* NVS_Diagnostics */
+constexpr uint8_t NVS_REPORT_MAX_NAMESPACES = 16; // Namespaces beyond this are counted in the totals but not listed
+
+struct NVS_ENTRY // Filled in by NVS_Iterator::next().  The strings point into the iterator and are valid until the next call.
+{
+    const char *name_space;
+    const char *key;
+    nvs_type_t type;
+    size_t size; // Data bytes.  Strings include their terminator.
+};
+
+struct NVS_NAMESPACE_USAGE
+{
+    char name_space[NVS_KEY_NAME_MAX_SIZE];
+    uint16_t keys;
+    uint16_t entries; // 32 byte flash entries, including the extra entries strings and blobs span
+    size_t bytes;
+};
+
+struct NVS_USAGE_REPORT
+{
+    nvs_stats_t stats; // used / free / available / total entries for the whole partition
+    uint8_t namespaceCount;
+    bool truncated; // More than NVS_REPORT_MAX_NAMESPACES namespaces were found
+    NVS_NAMESPACE_USAGE namespaces[NVS_REPORT_MAX_NAMESPACES];
+};
+
+//
+// Walks the entries of a partition, optionally limited to one namespace and/or one type.  The IDF iterator is allocated once when the
+// walk starts and nothing is allocated per entry.  Finding the size of a string or blob needs a handle, so one read only handle is kept
+// open on the namespace currently being walked.
+//
+//     NVS_Iterator it;
+//     NVS_ENTRY entry;
+//     while (it.next(&entry))
+//         printf("%s:%s %u bytes\n", entry.name_space, entry.key, entry.size);
+//
+class NVS_Iterator
 {
-    class NVS
+public:
+    explicit NVS_Iterator(const char * = NVS_DEFAULT_PART_NAME, const char * = nullptr, nvs_type_t = NVS_TYPE_ANY);
+    ~NVS_Iterator(void);
+    NVS_Iterator(const NVS_Iterator &) = delete;
+    NVS_Iterator &operator=(const NVS_Iterator &) = delete;
+
+    bool next(NVS_ENTRY *);                            // Returns false at the end or on an error
+    esp_err_t getStatus(void) const { return status; } // ESP_ERR_NVS_NOT_FOUND once the walk has finished normally
+
+private:
+    const char *partition;
+    nvs_iterator_t iterator = nullptr;
+    nvs_entry_info_t info = {};
+    bool started = false;
+    esp_err_t status = ESP_OK;
+
+    nvs_handle_t sizeHandle = 0;
+    char sizeNamespace[NVS_KEY_NAME_MAX_SIZE] = {};
+
+    size_t entrySize(void);
+};
+
+/* NVS_Stats */
+#ifndef NVS_INSTRUMENTATION
+#define NVS_INSTRUMENTATION 0 // Set to 1 (e.g. target_compile_definitions(${COMPONENT_LIB} PUBLIC NVS_INSTRUMENTATION=1)) to time every operation
+#endif
+
+constexpr uint32_t NVS_LATENCY_BUCKET_LIMITS[] = {50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000}; // Upper bounds in microseconds
+constexpr uint8_t NVS_LATENCY_BUCKETS = sizeof(NVS_LATENCY_BUCKET_LIMITS) / sizeof(uint32_t) + 1;              // The last bucket catches the rest
+
+struct NVS_OP_STATS
+{
+    uint32_t count;
+    uint32_t maxMicros;
+    uint64_t totalMicros;
+    uint32_t buckets[NVS_LATENCY_BUCKETS];
+};
+
+struct NVS_STATS
+{
+    NVS_OP_STATS ops[(uint8_t)NVS_OP::COUNT]; // Indexed by NVS_OP
+    uint32_t flashWrites;                     // nvs_set_* calls actually issued, including shadow flushes and blob chunks
+    uint64_t bytesWritten;                    // Data bytes handed to those calls
+};
+
+//
+// Times one operation from construction to destruction.  When NVS_INSTRUMENTATION is 0 this is an empty class whose functions are empty
+// inlines, so the calls scattered through the component compile to nothing.
+//
+#if NVS_INSTRUMENTATION
+class NVS_OpTimer
+{
+public:
+    explicit NVS_OpTimer(NVS_OP);
+    ~NVS_OpTimer(void);
+    NVS_OpTimer(const NVS_OpTimer &) = delete;
+    NVS_OpTimer &operator=(const NVS_OpTimer &) = delete;
+
+    void setOp(NVS_OP newOp) { op = newOp; } // e.g. a write which found its value already stored becomes a skipped write
+    static void countWrite(size_t);          // Records one nvs_set_* call of this many bytes
+
+private:
+    NVS_OP op;
+    int64_t start;
+};
+#else
+class NVS_OpTimer
+{
+public:
+    explicit NVS_OpTimer(NVS_OP) {}
+    void setOp(NVS_OP) {}
+    static void countWrite(size_t) {}
+};
+#endif
+
+/* NVS_Benchmark */
+#ifndef NVS_BENCHMARK
+#define NVS_BENCHMARK 0 // Set to 1 to build runBenchmark().  Meant for the IDF Linux target, where the partition is a file on the host.
+#endif
+
+constexpr uint16_t NVS_BENCH_ITERATIONS = 200;                  // Operations timed per case
+constexpr size_t NVS_BENCH_STRING_SIZES[] = {8, 64, 256, 1024}; // Bytes including the terminator
+constexpr uint8_t NVS_BENCH_FILL_LEVELS[] = {0, 50, 80};        // Percent of the partition's entries in use.  Must be ascending.
+
+/* NVS_Fault */
+#ifndef NVS_FAULT_INJECTION
+#define NVS_FAULT_INJECTION 0 // Set to 1 to build runPowerLossTest().  Needs the IDF Linux target, whose emulated flash can be told to fail.
+#endif
+
+constexpr char NVS_FAULT_PARTITION[] = "nvs_fault";          // Needs its own entry in partitions.csv.  Only this partition is remounted.
+constexpr uint32_t NVS_FAULT_CYCLES = 1000;                  // Power cuts per run, spread evenly over the fill levels
+constexpr uint8_t NVS_FAULT_FILL_LEVELS[] = {0, 50, 80, 90}; // Percent of the partition's entries in use.  Must be ascending.
+constexpr uint16_t NVS_FAULT_MAX_CUT = 64;                   // Power is cut after 1 to this many flash writes and erases
+constexpr uint8_t NVS_FAULT_OPS = 32;                        // Writes, erases and commits attempted before each cut
+
+/* NVS_Migration */
+constexpr char NVS_SCHEMA_VERSION_KEY[] = "_schema"; // u16 kept in every migrated namespace.  A namespace without it is at version 0.
+constexpr char NVS_MIGRATION_STAGE_KEY[] = "_stage";    // Names the key whose converted value is waiting under NVS_MIGRATION_STAGE_VALUE
+constexpr char NVS_MIGRATION_STAGE_VALUE[] = "_stagev"; // Only present while a convert<From, To>() is part way through
+
+class NVS_Migrator;
+
+struct NVS_MIGRATION // One step in a namespace's history
+{
+    uint16_t version;                     // The version this step brings the namespace to.  Steps are listed in ascending order from 1.
+    esp_err_t (*migrate)(NVS_Migrator &); // Anything but ESP_OK stops the pass.  The steps before it still count.
+};
+
+class NVS
+{
+public:
+    static NVS *getInstance() // Enforce use of System as a singleton object
     {
-    public:
-        static NVS *getInstance() // Enforce use of System as a singleton object
-        {
-            static NVS nvsInstance;
-            return &nvsInstance;
-        }
+        static NVS nvsInstance;
+        return &nvsInstance;
+    }
+
+    /* NVS */
+    void eraseNVSPartition(const char str[] = NVS_DEFAULT_PART_NAME);
+    void eraseNVSNamespace(char str[]);
+
+    esp_err_t openNVSStorage(const char *);
+    void closeNVStorage(bool = true);
+
+    NVS_Session openSession(const char *, TickType_t = portMAX_DELAY);
+
+    template <typename T>
+    esp_err_t read(const char *key, T *value) { return readFromNVS<T>(nvsHandle, activeShadow, key, value); } // Any integer, bool, float, double or enum
+    template <typename T>
+    esp_err_t write(const char *key, T value) { return writeToNVS<T>(nvsHandle, activeShadow, key, value); }
+
+    esp_err_t readBooleanFromNVS(const char *, bool *);
+    esp_err_t writeBooleanToNVS(const char *, bool);
+
+    esp_err_t readStringFromNVS(const char *, std::string *);  // Reads straight into the caller's string
+    esp_err_t readStringFromNVS(const char *, char *, size_t); // Reads into a fixed buffer.  The buffer holds the default on entry.
+    esp_err_t readStringFromNVS(const char *key, std::span<char> buffer) { return readStringFromNVS(key, buffer.data(), buffer.size()); }
+    esp_err_t writeStringToNVS(const char *, std::string *);
+    esp_err_t writeStringToNVS(const char *, const char *);
+
+    esp_err_t readU8IntegerFromNVS(const char *, uint8_t *);
+    esp_err_t writeU8IntegerToNVS(const char *, uint8_t);
+
+    esp_err_t readI32IntegerFromNVS(const char *, int32_t *);
+    esp_err_t writeI32IntegerToNVS(const char *, int32_t);
+
+    esp_err_t readU32IntegerFromNVS(const char *, uint32_t *);
+    esp_err_t writeU32IntegerToNVS(const char *, uint32_t);
+
+    /* NVS_Shadow */
+    esp_err_t enableShadowCache(const char *, size_t = NVS_SHADOW_DEFAULT_BUDGET);
+    esp_err_t disableShadowCache(const char *);
+    esp_err_t flushShadowCache(void);
+    esp_err_t getShadowCacheStats(const char *, NVS_SHADOW_STATS *);
 
-        /* NVS */
-        void eraseNVSPartition(const char str[] = NVS_DEFAULT_PART_NAME);
-        void eraseNVSNamespace(char str[]);
+    /* NVS_Directory */
+    esp_err_t enableKeyDirectory(const char *);                                  // Shadows the namespace with no value budget if it isn't already
+    esp_err_t findKey(const char *, nvs_type_t * = nullptr, size_t * = nullptr); // Type and data length of a key in the namespace held open
 
-        esp_err_t openNVSStorage(const char *);
-        void closeNVStorage(bool = true);
+    /* NVS_Compress */
+    esp_err_t enableCompression(const char *, const char *); // Namespace, key.  Shadows the namespace with no value budget if it isn't already.
+    esp_err_t getCompressionStats(NVS_COMPRESSION_STATS *);
+    void resetCompressionStats(void);
 
-        esp_err_t readBooleanFromNVS(const char *, bool *);
-        esp_err_t writeBooleanToNVS(const char *, bool);
+    /* NVS_Migration */
+    esp_err_t migrateNamespace(const char *, const NVS_MIGRATION *, size_t); // Runs the steps newer than the stored version in one session with one commit
+    template <size_t N>
+    esp_err_t migrateNamespace(const char *name_space, const NVS_MIGRATION (&steps)[N]) { return migrateNamespace(name_space, steps, N); }
+    esp_err_t getSchemaVersion(const char *, uint16_t *);
 
-        esp_err_t readStringFromNVS(const char *, std::string *);
-        esp_err_t writeStringToNVS(const char *, std::string *);
+    /* NVS_Notify */
+    esp_err_t subscribe(const char *, const char *, NVS_ChangeCallback, void * = nullptr, uint8_t * = nullptr); // Namespace, key prefix, callback, context, id
+    esp_err_t subscribe(const char *, const char *, QueueHandle_t, uint8_t * = nullptr);                       // Namespace, key prefix, queue of NVS_CHANGE, id
+    esp_err_t unsubscribe(uint8_t);
+    uint32_t getDroppedChanges(void) const { return droppedChanges; } // Changes lost to a full queue
 
-        esp_err_t readU8IntegerFromNVS(const char *, uint8_t *);
-        esp_err_t writeU8IntegerToNVS(const char *, uint8_t);
+    /* NVS_WriteBehind */
+    esp_err_t enableWriteBehind(const char *, size_t = NVS_SHADOW_DEFAULT_BUDGET); // Shadows the namespace and hands its flash writes to our task
+    void setWriteBehindPolicy(uint32_t, uint16_t);                                 // Interval in ms and dirty entry threshold
+    esp_err_t flush(TickType_t = portMAX_DELAY);                                   // Writes out everything pending and waits for it to finish
 
-        esp_err_t readI32IntegerFromNVS(const char *, int32_t *);
-        esp_err_t writeI32IntegerToNVS(const char *, int32_t);
+    /* NVS_Policy */
+    esp_err_t setWritePolicy(const char *, const char *, const NVS_WRITE_POLICY &); // Shadows the namespace if it isn't already
+    esp_err_t getKeyWriteStats(const char *, const char *, NVS_KEY_WRITE_STATS *);
 
-        esp_err_t readU32IntegerFromNVS(const char *, uint32_t *);
-        esp_err_t writeU32IntegerToNVS(const char *, uint32_t);
+    /* Error storage and retreival routines */
+    void enableErrorLog(bool);                        // Copies every ERROR passing through routeLogBy*() into the flash ring log
+    uint8_t getErrorCount(void);                      //
+    esp_err_t readErrorStringFromNVS(std::string *);  // Takes the oldest entry off the log
+    esp_err_t writeErrorStringToNVS(std::string *);   // Appends.  One string write, one index write and one commit.
+    esp_err_t writeErrorStringToNVS(const char *);    //
+    void clearErrorBuffer(void);
 
-        /* Error storage and retreival routines (currently not used inside this project) */
-        // uint8_t getErrorCount(void);
-        // esp_err_t readErrorStringFromNVS(std::string *strValue);
-        // esp_err_t writeErrorStringToNVS(std::string *strValue);
-        // void clearErrorBuffer(void);
+    /* NVS_Diagnostics */
+    esp_err_t getUsageReport(NVS_USAGE_REPORT *, const char * = NVS_DEFAULT_PART_NAME);
+    void printNVS(void);
 
-        /* NVS_Diagnostics */
-        void printNVS(void);
+    /* NVS_Init */
+    esp_err_t waitForInit(TickType_t = portMAX_DELAY); // Returns at once when mounted.  Callers normally never need this.
+    bool isInitialized(void) const { return initDone; }
+    esp_err_t getInitReport(NVS_INIT_REPORT *); // ESP_ERR_INVALID_STATE while the mount is still running
 
-    private:
-        NVS(void);
-        NVS(const NVS &) = delete;            // Disable copy constructor
-        void operator=(NVS const &) = delete; // Disable assignment operator
+    /* NVS_Recovery */
+    void setFreeEntryWarning(size_t); // Warns once when free entries fall below this many.  0 turns the check off.
+    bool isLowOnSpace(void) const { return lowOnSpace != 0; } // On any mounted partition
 
-        char TAG[5] = "_nvs";
+    /* NVS_Routing */
+    esp_err_t mountPartition(const char *);               // nvs_flash_init_partition() with the same recovery as the default partition
+    esp_err_t routeNamespace(const char *, const char *); // Namespace, partition.  Mounts the partition if needed.  Route before first use.
+    const char *getPartition(const char *);               // Where a namespace lives.  NVS_DEFAULT_PART_NAME unless routed.
 
-        /* Object References */
-        System *sys = nullptr;
+    /* NVS_Snapshot */
+    esp_err_t exportNamespace(const char *, NVS_BlobSink &);
+    esp_err_t exportPartition(NVS_BlobSink &, const char * = NVS_DEFAULT_PART_NAME); // Every namespace found on the partition
+    esp_err_t importImage(NVS_BlobSource &, bool = false, NVS_IMPORT_REPORT * = nullptr); // true erases each namespace before applying it
 
-        uint8_t show = 0;
-        void setFlags(void);
-        void setLogLevels(void);
-        void createSemaphores(void);
-        void restoreVariablesFromNVS(void);
-        void initializeNVS(void);
+    /* NVS_Stats */
+    esp_err_t getStats(NVS_STATS *); // ESP_ERR_NOT_SUPPORTED unless built with NVS_INSTRUMENTATION
+    void resetStats(void);
+
+    /* NVS_Benchmark */
+    esp_err_t runBenchmark(NVS_BlobSink &, uint16_t = NVS_BENCH_ITERATIONS); // One CSV line per case.  ESP_ERR_NOT_SUPPORTED unless built with NVS_BENCHMARK
+
+    /* NVS_Fault */
+    esp_err_t runPowerLossTest(NVS_BlobSink &, uint32_t = NVS_FAULT_CYCLES, uint32_t = 1); // Cycles, seed.  ESP_ERR_NOT_SUPPORTED unless built with NVS_FAULT_INJECTION
+
+private:
+    friend class NVS_Session;
+    friend class NVS_ErrorLogReader;
+    friend class NVS_BlobWriter;
+    friend class NVS_BlobReader;
+    friend class NVS_Transaction;
+    friend class NVS_Migrator;
+
+    NVS(void);
+    NVS(const NVS &) = delete;            // Disable copy constructor
+    void operator=(NVS const &) = delete; // Disable assignment operator
+
+    char TAG[5] = "_nvs";
+
+    /* Object References */
+    System *sys = nullptr;
+
+    uint8_t show = 0;
+    void setFlags(void);
+    void setLogLevels(void);
+    void createSemaphores(void);
+    void restoreVariablesFromNVS(void);
+    void initializeNVS(void);
+
+    /* NVS_Init */
+    std::atomic<bool> initDone = false;
+    NVS_INIT_REPORT initReport = {};
+
+    void startInit(void);
+    static void runInit(void *);
+    void mountNVS(void);
+
+    /* NVS_Recovery */
+    size_t freeEntryWarning = 0;
+    std::atomic<uint8_t> lowOnSpace = 0; // One bit per partition.  Bit 0 is the default one, bit n + 1 is partitions[n].
+
+    esp_err_t recoverNVS(const char * = NVS_DEFAULT_PART_NAME); // Copies out what can still be read, erases, mounts and writes it all back
+    void checkFreeEntries(const char *); // The partition just committed to
+
+    nvs_handle_t nvsHandle = 0;
+    SemaphoreHandle_t nvsLock = nullptr; // Namespace lock held between openNVSStorage() and closeNVStorage()
+    const char *nvsPartition = NVS_DEFAULT_PART_NAME;
+
+    /* NVS_Session */
+    SemaphoreHandle_t namespaceLock(const char *);
+
+    /* NVS_Routing */
+    char partitions[NVS_MAX_PARTITIONS][NVS_PART_NAME_MAX_SIZE + 1] = {};
+    NVS_ROUTE routes[NVS_MAX_ROUTES] = {};
+    std::atomic<uint8_t> partitionCount = 0; // Entries are filled in before the count moves past them and never change after,
+    std::atomic<uint8_t> routeCount = 0;     // so lookups need no lock
+
+    esp_err_t openNamespace(const char *, nvs_handle_t *);        // nvs_open_from_partition() on the routed partition
+    esp_err_t initPartition(const char *, NVS_MOUNT * = nullptr); // nvs_flash_init_partition() with recovery.  Doesn't record the partition.
+
+    /* NVS_Snapshot */
+    esp_err_t exportSection(const char *, const char *, NVS_BlobSink &); // Partition, namespace
+
+    template <typename T>
+    esp_err_t readFromNVS(nvs_handle_t, NVS_SHADOW *, const char *, T *, bool * = nullptr); // Set true when the default was saved as a new key
+    template <typename T>
+    esp_err_t writeToNVS(nvs_handle_t, NVS_SHADOW *, const char *, T);
+
+    esp_err_t readStringFromNVS(nvs_handle_t, NVS_SHADOW *, const char *, std::string *);
+    esp_err_t readStringFromNVS(nvs_handle_t, NVS_SHADOW *, const char *, char *, size_t);
+    esp_err_t writeStringToNVS(nvs_handle_t, NVS_SHADOW *, const char *, const char *);
+    esp_err_t compareStoredString(nvs_handle_t, const char *, const char *, bool *);
+
+    /* NVS_Shadow */
+    NVS_SHADOW *shadows[NVS_SHADOW_MAX_NAMESPACES] = {};
+    NVS_SHADOW *activeShadow = nullptr; // Shadow of the namespace currently held open by nvsHandle (if any).
+
+    NVS_SHADOW *findShadow(const char *);
+    NVS_SHADOW *attachShadow(const char *);
+    void detachShadow(NVS_SHADOW *);
+    NVS_SHADOW_ENTRY *shadowLookup(NVS_SHADOW *, const char *, nvs_type_t);
+    bool shadowStore(NVS_SHADOW *, const char *, nvs_type_t, uint64_t, const char *, bool);
+    void shadowClear(NVS_SHADOW *);
+    esp_err_t shadowFlush(nvs_handle_t, NVS_SHADOW *, bool = false); // true writes every dirty entry whatever its policy says
+    bool shadowDue(NVS_SHADOW *, const NVS_SHADOW_ENTRY &, bool, int64_t);
+    esp_err_t shadowWriteEntry(nvs_handle_t, NVS_SHADOW *, const NVS_SHADOW_ENTRY &);
+    void shadowMarkFlushed(NVS_SHADOW *, NVS_SHADOW_ENTRY &, int64_t);
+    void shadowAwaitFlush(NVS_SHADOW *);
+
+    /* NVS_Directory */
+    esp_err_t findKey(nvs_handle_t, NVS_SHADOW *, const char *, nvs_type_t *, size_t *);
+    void directoryBuild(NVS_SHADOW *);
+    bool directoryMayHold(NVS_SHADOW *, const char *, nvs_type_t, size_t * = nullptr); // false only when the key is certainly not stored
+    void directoryNote(NVS_SHADOW *, const char *, nvs_type_t, size_t);
+    void directoryForget(NVS_SHADOW *, const char *, nvs_type_t);
+
+    /* NVS_Compress */
+    bool isCompressed(NVS_SHADOW *, const char *);
+    esp_err_t readCompressedString(nvs_handle_t, NVS_SHADOW *, const char *, std::string *); // Leaves the string untouched unless it succeeds
+    esp_err_t writeCompressedString(nvs_handle_t, NVS_SHADOW *, const char *, const char *);
+    bool compressStaged(nvs_handle_t, NVS_SHADOW *, const char *); // The stage holds this key's packed value
+    esp_err_t resumeCompressStage(nvs_handle_t, NVS_SHADOW *);
+    void dropCompressStage(nvs_handle_t, NVS_SHADOW *);
+    esp_err_t storeString(nvs_handle_t, NVS_SHADOW *, const char *, const char *); // nvs_set_str() or the compressed form, whichever the key uses
+
+    /* NVS_Array */
+    esp_err_t readArrayFromNVS(nvs_handle_t, NVS_SHADOW *, const char *, nvs_type_t, std::vector<uint8_t> *); // Packed elements.  Untouched on failure.
+    esp_err_t writeArrayToNVS(nvs_handle_t, NVS_SHADOW *, const char *, nvs_type_t, const std::vector<uint8_t> &);
+
+    /* NVS_Notify */
+    TaskHandle_t taskHandleNotify = nullptr;
+    QueueHandle_t queueNotify = nullptr;
+    NVS_SUBSCRIPTION subscriptions[NVS_NOTIFY_MAX_SUBSCRIBERS] = {};
+    std::atomic<uint32_t> droppedChanges = 0;
+    std::atomic<uint32_t> notifyPass = 0; // Odd while runNotify() is calling subscribers
+
+    esp_err_t addSubscription(const char *, const char *, NVS_SUBSCRIPTION, uint8_t *);
+    void notifyChange(NVS_SHADOW *, const char *, nvs_type_t, uint64_t, const char *); // Called with the namespace lock held.  Never blocks.
+    static void runNotifier(void *);
+    void runNotify(void);
+
+    /* NVS_WriteBehind */
+    TaskHandle_t taskHandleWriteBehind = nullptr;
+    QueueHandle_t queueWriteBehind = nullptr;
+    uint32_t writeBehindInterval = NVS_WRITE_BEHIND_INTERVAL_MS;
+    uint16_t writeBehindThreshold = NVS_WRITE_BEHIND_THRESHOLD;
+
+    static void runMarshaller(void *);
+    void runWriteBehind(void);
+    bool writeBehindFlush(bool); // Returns true if entries were held back and are still pending
+    void writeBehindNotice(NVS_SHADOW *);
+
+    /* NVS_Policy */
+    NVS_KEY_POLICY *findPolicy(NVS_SHADOW *, const char *);
+    NVS_KEY_POLICY *keyRecord(NVS_SHADOW *, const char *); // Finds the key's record, adding one without limits if there is none
+    esp_err_t flushHeldBack(void);                         // Forces out the shadows the write-behind task doesn't look after
+    bool policyAllows(NVS_KEY_POLICY *, int64_t);
+
+    /* NVS_ErrorLog */
+    uint32_t firstIndex = 0; // Error indexes.  Sequence number of the oldest entry and of the next one to be written.  The slot is index % capacity.
+    uint32_t lastIndex = 0;  //
+    nvs_handle_t errorLogHandle = 0;
+    bool errorLogging = false;
+
+    esp_err_t errorLogOpen(TickType_t = portMAX_DELAY); // How long to wait for a deferred mount
+    esp_err_t errorLogRead(uint32_t, char *, size_t);
+
+    /* NVS_Logging */
+    std::string errMsg = "";
+    void routeLogByRef(LOG_TYPE, std::string *);
+    void routeLogByValue(LOG_TYPE, std::string);
+
+    esp_log_level_t logLevel = ESP_LOG_ERROR; // The level setLogLevels() handed to the IDF, kept here so we can skip formatting early
+
+    template <LOG_TYPE type, typename... Args>
+    void routeLogByFormat(const char *format, Args... args) // Nothing is formatted or allocated for a level which is off
+    {
+        if constexpr (nvsLogLevel(type) <= NVS_LOG_LEVEL)
+        {
+            if (nvsLogLevel(type) <= logLevel)
+                routeLogFormatted(type, format, args...);
+        }
+    }
 
-        nvs_handle_t nvsHandle = 0;
+    template <LOG_TYPE type, typename V>
+    void routeLogKeyValue(const char *, const char *, const char *, V); // Prints any stored integer with the right sign
 
-        // uint8_t firstIndex = 0; // Error indexes (used for saving Error) but not in use inside this project.
-        // uint8_t lastIndex = 0;  //
+    void routeLogFormatted(LOG_TYPE, const char *, ...) __attribute__((format(printf, 3, 4)));
+};
 
-        /* NVS_Logging */
-        std::string errMsg = "";
-        void routeLogByRef(LOG_TYPE, std::string *);
-        void routeLogByValue(LOG_TYPE, std::string);
-    };
-}
\ No newline at end of file
+#include "nvs_typed.hpp"       // Template definitions which need the complete NVS class
+#include "nvs_blob.hpp"        // Chunked blob streams
+#include "nvs_schema.hpp"      // Declarative struct binding
+#include "nvs_snapshot.hpp"    // Namespace images
+#include "nvs_transaction.hpp" // Atomic groups
+#include "nvs_array.hpp"       // Packed typed arrays
+#include "nvs_migration.hpp"   // Schema migration
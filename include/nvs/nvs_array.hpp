@@ -0,0 +1,158 @@
+#pragma once
+//
+// Packed typed arrays.  This file is included at the bottom of nvs_.hpp.
+//
+// A dimming curve or a set of per-channel calibrations is stored as one table instead of one key per element.  Every element shares
+// the type read<T>() would store it as (bool -> u8, float -> u32 bits, ...) and is packed little endian.  A table of up to
+// NVS_ARRAY_CHUNK_SIZE bytes sits inline behind its header in a single blob, so a 256 entry u8 curve loads with one flash read.
+// Larger tables are split into chunks under "<key>.<nn>", and the header keeps a CRC32 of each one.
+//
+//     Header   u8 magic  u8 version  u8 nvs_type_t  u8 chunkCount  u16 count  u16 reserved  u32 crc
+//     Inline   (chunkCount 0)  the packed elements.  crc covers them.
+//     Chunked  one u32 CRC32 per chunk.  crc covers that list.
+//
+// writeArray() compares the new chunk CRCs with the stored list and rewrites only the chunks which differ, then the header.  Changing one
+// element of a 1024 entry u32 table therefore writes one 256 byte chunk and a 76 byte header, not 4 KB.  The chunks go down before the
+// header, so a reset part way through leaves the old header, whose CRCs no longer match, and a reader gets ESP_ERR_INVALID_CRC rather
+// than a mix.  Use NVS_Transaction where a table must survive that too.
+//
+// Tables are neither shadowed nor reported to subscribers.  A key directory still learns of every blob written.
+//
+//     NVS_Session session = nvs->openSession("light");
+//     uint8_t curve[256] = {...};            // Defaults, saved the first time
+//     session.readArray("curve", curve);
+//     curve[128] = 140;
+//     session.writeArray("curve", curve);    // One blob, skipped entirely if nothing changed
+//
+constexpr uint8_t NVS_ARRAY_MAGIC = 0x41;                                            // 'A'
+constexpr uint8_t NVS_ARRAY_VERSION = 1;
+constexpr size_t NVS_ARRAY_CHUNK_SIZE = 256;                                         // Payload bytes per chunk.  Also the largest inline table.
+constexpr size_t NVS_ARRAY_MAX_CHUNKS = 64;                                          // So the CRC list fits where an inline table would
+constexpr size_t NVS_ARRAY_MAX_LENGTH = NVS_ARRAY_CHUNK_SIZE * NVS_ARRAY_MAX_CHUNKS; // 16 KB of packed elements
+constexpr size_t NVS_ARRAY_KEY_MAX_LENGTH = NVS_BLOB_KEY_MAX_LENGTH;                 // Room for the ".nn" chunk suffix
+
+struct NVS_ARRAY_HEADER
+{
+    uint8_t magic;
+    uint8_t version;
+    uint8_t type;       // nvs_type_t of every element
+    uint8_t chunkCount; // 0 when the elements are inline
+    uint16_t count;     // Elements
+    uint16_t reserved;
+    uint32_t crc;
+};
+
+constexpr size_t NVS_ARRAY_RECORD_SIZE = sizeof(NVS_ARRAY_HEADER) + NVS_ARRAY_CHUNK_SIZE; // Largest header blob, inline or chunked
+static_assert(NVS_ARRAY_MAX_CHUNKS * sizeof(uint32_t) <= NVS_ARRAY_CHUNK_SIZE, "The chunk CRC list must fit in one record");
+
+template <typename T>
+struct NVS_ArrayPacking // Little endian whatever the host is, through the same NVS_Traits as read<T>() / write<T>()
+{
+    using Traits = NVS_Traits<T>;
+    using Stored = typename Traits::Stored;
+
+    static void pack(const T *values, size_t count, std::vector<uint8_t> *packed)
+    {
+        packed->resize(count * sizeof(Stored));
+
+        for (size_t i = 0; i < count; i++)
+        {
+            uint64_t stored = (uint64_t)Traits::encode(values[i]);
+
+            for (size_t b = 0; b < sizeof(Stored); b++)
+                (*packed)[i * sizeof(Stored) + b] = (uint8_t)(stored >> (8 * b));
+        }
+    }
+
+    static bool unpack(const std::vector<uint8_t> &packed, T *values, size_t count) // Leaves values untouched if any element is invalid
+    {
+        for (size_t pass = 0; pass < 2; pass++)
+        {
+            for (size_t i = 0; i < count; i++)
+            {
+                uint64_t stored = 0;
+
+                for (size_t b = 0; b < sizeof(Stored); b++)
+                    stored |= (uint64_t)packed[i * sizeof(Stored) + b] << (8 * b);
+
+                if (pass == 0)
+                {
+                    if (!Traits::valid((Stored)stored))
+                        return false;
+                }
+                else
+                    values[i] = Traits::decode((Stored)stored);
+            }
+        }
+        return true;
+    }
+};
+
+template <typename T>
+esp_err_t NVS_Session::readArray(const char *key, T *values, size_t count)
+{
+    static_assert(NVS_Traits<T>::supported, "NVS readArray<T>(): unsupported type.  Use an integer, bool, float, double or enum.");
+
+    using Stored = typename NVS_Traits<T>::Stored;
+
+    if (nvs == nullptr)
+        return ESP_ERR_NVS_INVALID_HANDLE;
+
+    std::vector<uint8_t> packed;
+    esp_err_t ret = nvs->readArrayFromNVS(handle, shadow, key, NVS_Storage<Stored>::type, &packed);
+
+    if (ret == ESP_ERR_NVS_NOT_FOUND) // Never stored.  The values passed in are our defaults.
+        return writeArray<T>(key, values, count);
+
+    if (ret != ESP_OK)
+        return ret;
+
+    if (packed.size() != count * sizeof(Stored)) // Stored with a different element count
+        return ESP_ERR_NVS_INVALID_LENGTH;
+
+    return NVS_ArrayPacking<T>::unpack(packed, values, count) ? ESP_OK : ESP_FAIL;
+}
+
+template <typename T>
+esp_err_t NVS_Session::readArray(const char *key, std::vector<T> *values)
+{
+    static_assert(NVS_Traits<T>::supported, "NVS readArray<T>(): unsupported type.  Use an integer, bool, float, double or enum.");
+    static_assert(!std::is_same_v<T, bool>, "NVS readArray<T>(): use std::vector<uint8_t> in place of std::vector<bool>");
+
+    using Stored = typename NVS_Traits<T>::Stored;
+
+    if (nvs == nullptr)
+        return ESP_ERR_NVS_INVALID_HANDLE;
+
+    std::vector<uint8_t> packed;
+    esp_err_t ret = nvs->readArrayFromNVS(handle, shadow, key, NVS_Storage<Stored>::type, &packed);
+
+    if (ret == ESP_ERR_NVS_NOT_FOUND)
+        return writeArray<T>(key, values->data(), values->size());
+
+    if (ret != ESP_OK)
+        return ret;
+
+    std::vector<T> stored(packed.size() / sizeof(Stored)); // Takes whatever count was stored
+
+    if (!NVS_ArrayPacking<T>::unpack(packed, stored.data(), stored.size()))
+        return ESP_FAIL;
+
+    values->swap(stored);
+    return ESP_OK;
+}
+
+template <typename T>
+esp_err_t NVS_Session::writeArray(const char *key, const T *values, size_t count)
+{
+    static_assert(NVS_Traits<T>::supported, "NVS writeArray<T>(): unsupported type.  Use an integer, bool, float, double or enum.");
+
+    using Stored = typename NVS_Traits<T>::Stored;
+
+    if (nvs == nullptr)
+        return ESP_ERR_NVS_INVALID_HANDLE;
+
+    std::vector<uint8_t> packed;
+    NVS_ArrayPacking<T>::pack(values, count, &packed);
+    return nvs->writeArrayToNVS(handle, shadow, key, NVS_Storage<Stored>::type, packed);
+}
@@ -0,0 +1,97 @@
+#pragma once
+//
+// Chunked blob streams.  This file is included at the bottom of nvs_.hpp.
+//
+// A large value is stored as a small header blob under its own key plus a run of chunk blobs under "<key>.<nn>" or "<key>~<nn>".  Each
+// chunk carries a CRC32 trailer and the header carries a CRC32 of the whole payload.  Readers and writers only ever hold one chunk in RAM,
+// so a 16 KB payload never needs a 16 KB buffer, and any byte range may be read without loading the rest of the value.
+//
+// The header's generation picks which of the two runs is current.  A rewrite always goes to the other run and the header switches over
+// last, so readers see either the old value or the new one, never a mix.
+//
+constexpr size_t NVS_BLOB_CHUNK_SIZE = 512;                           // Payload bytes per chunk.  Each reader and writer holds one chunk.
+constexpr size_t NVS_BLOB_MAX_CHUNKS = 256;                           // Limited by the two hex digits of the chunk key suffix
+constexpr size_t NVS_BLOB_KEY_MAX_LENGTH = NVS_KEY_NAME_MAX_SIZE - 4; // Room for the ".nn" chunk suffix and terminator
+constexpr uint32_t NVS_BLOB_MAGIC = 0x424C4F42;                       // "BLOB"
+constexpr uint8_t NVS_BLOB_VERSION = 1;
+
+struct NVS_BLOB_HEADER
+{
+    uint32_t magic;
+    uint8_t version;
+    uint8_t generation; // 0 for chunks under "<key>.<nn>", 1 for "<key>~<nn>".  Values stored before the flip all read as 0.
+    uint16_t chunkSize;
+    uint32_t length; // Payload bytes
+    uint32_t crc;    // CRC32 of the whole payload
+    uint16_t chunkCount;
+    uint16_t reserved2;
+};
+
+class NVS_BlobSink // Anything which can accept a stream of bytes
+{
+public:
+    virtual ~NVS_BlobSink(void) = default;
+    virtual esp_err_t write(const void *, size_t) = 0;
+};
+
+class NVS_BlobSource // Anything which can hand out a stream of bytes.  bytesRead of 0 marks the end.
+{
+public:
+    virtual ~NVS_BlobSource(void) = default;
+    virtual esp_err_t read(void *, size_t, size_t *) = 0;
+};
+
+class NVS_BlobWriter : public NVS_BlobSink
+{
+public:
+    NVS_BlobWriter(NVS_Session &, const char *, bool = false); // Session, key, compress each chunk
+
+    esp_err_t write(const void *, size_t) override; // May be called any number of times
+    esp_err_t finish(void);                         // Writes the last chunk, then the header which makes them current
+
+    size_t getLength(void) const { return length; }
+    static esp_err_t erase(NVS_Session &, const char *);
+
+private:
+    nvs_handle_t handle = 0;
+    NVS_SHADOW *shadow = nullptr; // Kept so a key directory learns of every chunk we write
+    bool compress = false;
+    char key[NVS_KEY_NAME_MAX_SIZE] = {};
+    NVS_BLOB_HEADER oldHeader = {}; // The value being replaced.  Its chunkCount is 0 if there was none.
+    uint8_t generation = 0;         // The run our chunks go to, never the one oldHeader points at
+    uint8_t chunk[NVS_BLOB_CHUNK_SIZE + sizeof(uint32_t)]; // Payload plus CRC trailer
+    size_t chunkFill = 0;
+    uint16_t chunkIndex = 0;
+    size_t length = 0;
+    uint32_t crc = 0;
+    esp_err_t status = ESP_OK;
+
+    esp_err_t writeChunk(void);
+};
+
+class NVS_BlobReader : public NVS_BlobSource
+{
+public:
+    NVS_BlobReader(NVS_Session &, const char *);
+
+    esp_err_t getStatus(void) const { return status; } // ESP_ERR_NVS_NOT_FOUND if there is no blob under this key
+    size_t getLength(void) const { return header.length; }
+
+    esp_err_t read(void *, size_t, size_t *) override; // Sequential read from the current position
+    esp_err_t seek(size_t);
+    esp_err_t readRange(size_t, void *, size_t); // Loads only the chunks which cover the range
+    esp_err_t copyTo(NVS_BlobSink &);            // Streams the whole payload out one chunk at a time
+    esp_err_t verify(void);                      // Checks the whole payload against the header CRC
+
+private:
+    nvs_handle_t handle = 0;
+    char key[NVS_KEY_NAME_MAX_SIZE] = {};
+    NVS_BLOB_HEADER header = {};
+    uint8_t chunk[NVS_BLOB_CHUNK_SIZE + sizeof(uint32_t)];
+    int32_t loadedChunk = -1;
+    size_t position = 0;
+    esp_err_t status = ESP_OK;
+
+    esp_err_t loadChunk(uint16_t);
+    size_t chunkLength(uint16_t) const;
+};
@@ -1,3 +1,36 @@
 #pragma once
 
-#include <stdint.h> // Standard Libraries
\ No newline at end of file
+#include <stdint.h> // Standard Libraries
+
+enum class NVS_OP : uint8_t // Operations timed by the instrumentation in nvs_stats.cpp
+{
+    READ = 0,
+    WRITE,
+    SKIPPED_WRITE, // A write whose value was already stored
+    COMMIT,
+    OPEN,
+    CLOSE,
+    ERASE,
+    COUNT,
+};
+
+enum class NVS_WB_CMD : uint8_t // Messages to the write-behind task
+{
+    DIRTY = 0, // A write-behind namespace was closed with dirty entries.  Flush when the interval runs out.
+    THRESHOLD, // Enough entries are dirty to flush now
+    FLUSH,     // flush() is waiting on us
+};
+
+enum class NVS_CODEC : uint8_t // How a compressed string's blob holds its text
+{
+    STORED = 0, // As it is.  Compression didn't pay.
+    LZF,        // LZF back references within an 8 KB window
+};
+
+enum class NVS_MOUNT : uint8_t // Which way a partition mount went
+{
+    CLEAN = 0, // nvs_flash_init_partition() succeeded first time
+    RECOVERED, // Full.  Entries were copied out, the partition erased and the entries written back.
+    ERASED,    // Could not be mounted as it was.  Every entry was lost.
+    FAILED,
+};
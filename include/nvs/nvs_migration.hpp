@@ -0,0 +1,169 @@
+#pragma once
+//
+// Schema migration.  This file is included at the bottom of nvs_.hpp.
+//
+// When a firmware update renames a key, widens a u8 to a u32 or splits a string, the owning object lists the change once as a step
+// instead of carrying code which reads old keys and writes new ones on every boot.  migrateNamespace() reads the namespace's stored
+// version and runs only the newer steps, all inside one session with one commit.  Once a namespace is current, that version read is all
+// a boot costs.
+//
+//     static esp_err_t toVersion1(NVS_Migrator &m) { return m.rename<uint8_t>("chan", "channel"); }
+//     static esp_err_t toVersion2(NVS_Migrator &m) { return m.convert<uint8_t, uint32_t>("timeout"); }
+//
+//     static constexpr NVS_MIGRATION wifiSteps[] = {{1, toVersion1}, {2, toVersion2}};
+//     nvs->migrateNamespace("wifi", wifiSteps); // Before the first restore
+//
+// A step works through the NVS_Migrator it is handed, straight on the namespace handle, so nothing is logged, shadowed or notified key by
+// key.  Strings on keys set up with enableCompression() are still read and written in their compressed form.  Every helper is safe to run
+// twice, since a reset before the version is stored runs the interrupted steps again on the next boot.  A key the helper would move or
+// change that isn't there is simply skipped.  convert() has to erase before it writes, so it stages the converted value under
+// NVS_MIGRATION_STAGE_VALUE first and a rerun finishes from there.
+//
+class NVS_Migrator
+{
+public:
+    nvs_handle_t getHandle(void) const { return handle; }
+    uint16_t getChanges(void) const { return changes; } // Keys written or erased so far
+
+    template <typename T>
+    esp_err_t read(const char *, T *); // ESP_ERR_NVS_NOT_FOUND if missing.  Unlike read<T>() no default is saved.
+    template <typename T>
+    esp_err_t write(const char *, T);
+
+    esp_err_t readString(const char *, std::string *);
+    esp_err_t writeString(const char *, const char *);
+    esp_err_t erase(const char *); // A missing key is not an error
+
+    template <typename T>
+    esp_err_t rename(const char *, const char *); // From, to.  T may be std::string.  Written under the new key before the old one goes.
+    template <typename From, typename To>
+    esp_err_t convert(const char *); // Same key, new type.  The value is cast.  Staged under NVS_MIGRATION_STAGE_VALUE while the key is rewritten.
+    esp_err_t splitString(const char *, char, const char *const *, size_t); // Key, separator, new keys, count.  The last takes the rest.  None may be the old key.
+
+private:
+    friend class NVS;
+    NVS_Migrator(nvs_handle_t migrateHandle, NVS_SHADOW *migrateShadow) : handle(migrateHandle), shadow(migrateShadow) {}
+
+    nvs_handle_t handle = 0;
+    NVS_SHADOW *shadow = nullptr; // Only for the namespace's compressed keys.  Its cache and directory are cleared before the first step.
+    uint16_t changes = 0;
+};
+
+template <typename T>
+esp_err_t NVS_Migrator::read(const char *key, T *value)
+{
+    static_assert(NVS_Traits<T>::supported, "NVS_Migrator read<T>(): unsupported type.  Use an integer, bool, float, double or enum.");
+
+    using Traits = NVS_Traits<T>;
+    using Stored = typename Traits::Stored;
+
+    Stored stored = 0;
+    esp_err_t ret = NVS_Storage<Stored>::get(handle, key, &stored);
+
+    if (ret != ESP_OK)
+        return ret;
+
+    if (!Traits::valid(stored))
+        return ESP_FAIL;
+
+    *value = Traits::decode(stored);
+    return ESP_OK;
+}
+
+template <typename T>
+esp_err_t NVS_Migrator::write(const char *key, T value)
+{
+    static_assert(NVS_Traits<T>::supported, "NVS_Migrator write<T>(): unsupported type.  Use an integer, bool, float, double or enum.");
+
+    using Traits = NVS_Traits<T>;
+    using Stored = typename Traits::Stored;
+
+    esp_err_t ret = NVS_Storage<Stored>::set(handle, key, Traits::encode(value));
+
+    if (ret == ESP_OK)
+    {
+        NVS_OpTimer::countWrite(sizeof(Stored));
+        changes++;
+    }
+    return ret;
+}
+
+template <typename T>
+esp_err_t NVS_Migrator::rename(const char *from, const char *to)
+{
+    T value = {};
+    esp_err_t ret = ESP_OK;
+
+    if constexpr (std::is_same_v<T, std::string>)
+        ret = readString(from, &value);
+    else
+        ret = read<T>(from, &value);
+
+    if (ret == ESP_ERR_NVS_NOT_FOUND) // Never stored, or moved by an earlier attempt
+        return ESP_OK;
+
+    if (ret == ESP_OK)
+    {
+        if constexpr (std::is_same_v<T, std::string>)
+            ret = writeString(to, value.c_str());
+        else
+            ret = write<T>(to, value);
+    }
+
+    if (ret == ESP_OK)
+        ret = erase(from);
+    return ret;
+}
+
+template <typename From, typename To>
+esp_err_t NVS_Migrator::convert(const char *key)
+{
+    static_assert(NVS_Traits<To>::supported, "NVS_Migrator convert<From, To>(): unsupported type.  Use an integer, bool, float, double or enum.");
+
+    From value = {};
+    esp_err_t ret = read<From>(key, &value);
+
+    if constexpr (std::is_same_v<typename NVS_Traits<From>::Stored, typename NVS_Traits<To>::Stored>) // Stored alike (an int and an enum over it, say)
+    {
+        if ((ret == ESP_ERR_NVS_NOT_FOUND) || (ret == ESP_ERR_NVS_TYPE_MISMATCH)) // Never stored
+            return ESP_OK;
+
+        return (ret == ESP_OK) ? write<To>(key, (To)value) : ret;
+    }
+    else
+    {
+        // A key holds one item per type, so the old item has to go before the new one is written.  The converted value is staged first, and
+        // the stage names its key last, so a reset anywhere leaves the value either under the key or under a complete stage.
+        std::string staged;
+        To stagedValue = {};
+
+        if ((ret == ESP_ERR_NVS_NOT_FOUND) || (ret == ESP_ERR_NVS_TYPE_MISMATCH)) // Never stored, converted, or cut short after the erase
+        {
+            if ((readString(NVS_MIGRATION_STAGE_KEY, &staged) != ESP_OK) || (staged != key) || (read<To>(NVS_MIGRATION_STAGE_VALUE, &stagedValue) != ESP_OK))
+                return ESP_OK; // Nothing of ours waiting.  A stage of another step or type is left for it.
+
+            To current = {};
+            ret = (read<To>(key, &current) == ESP_ERR_NVS_NOT_FOUND) ? write<To>(key, stagedValue) : ESP_OK; // Only the write was lost, or nothing
+        }
+        else if (ret == ESP_OK)
+        {
+            ret = write<To>(NVS_MIGRATION_STAGE_VALUE, (To)value);
+
+            if (ret == ESP_OK)
+                ret = writeString(NVS_MIGRATION_STAGE_KEY, key);
+
+            if (ret == ESP_OK)
+                ret = erase(key);
+
+            if (ret == ESP_OK)
+                ret = write<To>(key, (To)value);
+        }
+
+        if (ret == ESP_OK) // The value is safe under its key
+            ret = erase(NVS_MIGRATION_STAGE_KEY);
+
+        if (ret == ESP_OK)
+            ret = erase(NVS_MIGRATION_STAGE_VALUE);
+        return ret;
+    }
+}
@@ -0,0 +1,126 @@
+#pragma once
+//
+// Declarative struct binding.  This file is included at the bottom of nvs_.hpp.
+//
+// An owning object describes its persistent variables once as a schema of (key, member, default) entries instead of repeating a
+// read*FromNVS() call for each one at boot.  restore() and save() then walk the whole struct inside a single session, so the namespace
+// is locked and opened once and committed once no matter how many fields there are.
+//
+//     struct WIFI_CONFIG
+//     {
+//         uint8_t channel;
+//         bool autoConnect;
+//         std::string ssid;
+//     };
+//
+//     static constexpr auto wifiSchema = nvsSchema<WIFI_CONFIG>("wifi",
+//                                                               nvsField("channel", &WIFI_CONFIG::channel, 6),
+//                                                               nvsField("autoConnect", &WIFI_CONFIG::autoConnect, true),
+//                                                               nvsField("ssid", &WIFI_CONFIG::ssid, ""));
+//
+//     wifiSchema.restore(&wifiConfig); // Missing keys take their default and that default is saved
+//
+// Key and namespace lengths are checked during compilation.
+//
+template <typename Struct, typename Member>
+struct NVS_Field
+{
+    static_assert(std::is_same_v<Member, std::string> || NVS_Traits<Member>::supported,
+                  "nvsField(): unsupported member type.  Use an integer, bool, float, double, enum or std::string.");
+
+    using Object = Struct;
+    using Default = std::conditional_t<std::is_same_v<Member, std::string>, const char *, Member>; // Keeps a schema constexpr
+
+    const char *key;
+    Member Struct::*member;
+    Default defaultValue;
+
+    esp_err_t restore(NVS_Session &session, Struct *object) const
+    {
+        Member &value = object->*member;
+        value = defaultValue; // Left in place if the key is missing, and saved as the first value
+
+        if constexpr (std::is_same_v<Member, std::string>)
+            return session.readString(key, &value);
+        else
+            return session.read<Member>(key, &value);
+    }
+
+    esp_err_t save(NVS_Session &session, const Struct *object) const
+    {
+        const Member &value = object->*member;
+
+        if constexpr (std::is_same_v<Member, std::string>)
+            return session.writeString(key, value.c_str());
+        else
+            return session.write<Member>(key, value);
+    }
+};
+
+template <typename Struct, typename... Fields>
+class NVS_Schema
+{
+public:
+    constexpr NVS_Schema(const char *schemaNamespace, Fields... schemaFields) : name_space(schemaNamespace), fields(schemaFields...) {}
+
+    const char *getNamespace(void) const { return name_space; }
+    static constexpr size_t size(void) { return sizeof...(Fields); }
+
+    esp_err_t restore(Struct *object) const { return withSession([&](NVS_Session &session) { return restore(session, object); }); }
+    esp_err_t save(const Struct *object) const { return withSession([&](NVS_Session &session) { return save(session, object); }); }
+
+    // These run inside a session the caller already holds, so a schema may share one commit with other work.  Every field is visited even
+    // if an earlier one fails.  The first error is returned.
+    esp_err_t restore(NVS_Session &session, Struct *object) const
+    {
+        esp_err_t ret = ESP_OK;
+        std::apply([&](const Fields &...field) { (keepFirstError(&ret, field.restore(session, object)), ...); }, fields);
+        return ret;
+    }
+
+    esp_err_t save(NVS_Session &session, const Struct *object) const
+    {
+        esp_err_t ret = ESP_OK;
+        std::apply([&](const Fields &...field) { (keepFirstError(&ret, field.save(session, object)), ...); }, fields);
+        return ret;
+    }
+
+private:
+    const char *name_space;
+    std::tuple<Fields...> fields;
+
+    static void keepFirstError(esp_err_t *ret, esp_err_t fieldRet)
+    {
+        if (*ret == ESP_OK)
+            *ret = fieldRet;
+    }
+
+    template <typename Work>
+    esp_err_t withSession(Work work) const
+    {
+        NVS_Session session = NVS::getInstance()->openSession(name_space);
+
+        if (!session.isOpen())
+            return session.getStatus();
+
+        esp_err_t ret = work(session);
+        esp_err_t commitRet = session.close(); // The one commit for the whole struct
+
+        return (ret == ESP_OK) ? commitRet : ret;
+    }
+};
+
+template <typename Struct, typename Member, size_t N>
+constexpr NVS_Field<Struct, Member> nvsField(const char (&key)[N], Member Struct::*member, typename NVS_Field<Struct, Member>::Default defaultValue)
+{
+    static_assert(N <= NVS_KEY_NAME_MAX_SIZE, "nvsField(): key is longer than the 15 characters NVS allows");
+    return NVS_Field<Struct, Member>{key, member, defaultValue};
+}
+
+template <typename Struct, size_t N, typename... Fields>
+constexpr NVS_Schema<Struct, Fields...> nvsSchema(const char (&name_space)[N], Fields... fields)
+{
+    static_assert(N <= NVS_KEY_NAME_MAX_SIZE, "nvsSchema(): namespace is longer than the 15 characters NVS allows");
+    static_assert((std::is_same_v<typename Fields::Object, Struct> && ...), "nvsSchema(): every field must belong to the schema's struct");
+    return NVS_Schema<Struct, Fields...>(name_space, fields...);
+}
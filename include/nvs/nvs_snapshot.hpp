@@ -0,0 +1,62 @@
+#pragma once
+//
+// Namespace images.  This file is included at the bottom of nvs_.hpp.
+//
+// exportNamespace() and exportPartition() stream stored entries out as one compact binary image, and importImage() writes an image back
+// with a single commit per namespace.  A unit's settings can then be captured once and applied on the production line in one pass.
+//
+// Every field is written byte by byte in little endian order, so an image built by the Linux host target applies unchanged on a device.
+//
+//     Image     magic "NVSI"  u8 version  u8[3] reserved
+//     Section   'S'  u8 nameLength  name                                   One per namespace
+//     Entry     'E'  u8 nvs_type_t  u8 keyLength  key  u32 length  data    Integers are little endian, strings keep their terminator
+//     End       'C'  u16 entryCount  u32 crc                               CRC32 from the 'S' up to here
+//     Trailer   'Z'  u16 sectionCount  u32 crc                             CRC32 of the whole image up to here
+//
+// A section is read into RAM and its CRC checked before any of it is written, so a damaged image never leaves a namespace half applied.
+//
+constexpr uint32_t NVS_IMAGE_MAGIC = 0x4953564E; // "NVSI"
+constexpr uint8_t NVS_IMAGE_VERSION = 1;
+constexpr size_t NVS_IMAGE_SECTION_BUDGET = 16384; // Most bytes of one namespace held in RAM while its CRC is checked
+
+struct NVS_IMPORT_REPORT
+{
+    uint16_t namespaces; // Sections applied
+    uint16_t entries;    // Entries written
+    uint16_t failed;     // Entries the IDF refused, e.g. for lack of space
+    uint16_t skipped;    // Sections left untouched because their shadow couldn't be flushed or their namespace erased
+};
+
+class NVS_BufferSink : public NVS_BlobSink // Collects an image in RAM
+{
+public:
+    explicit NVS_BufferSink(std::vector<uint8_t> &target) : buffer(target) {}
+
+    esp_err_t write(const void *data, size_t length) override
+    {
+        buffer.insert(buffer.end(), (const uint8_t *)data, (const uint8_t *)data + length);
+        return ESP_OK;
+    }
+
+private:
+    std::vector<uint8_t> &buffer;
+};
+
+class NVS_BufferSource : public NVS_BlobSource // Hands out an image held in RAM or in a flash mapped partition
+{
+public:
+    NVS_BufferSource(const void *data, size_t length) : bytes((const uint8_t *)data), remaining(length) {}
+
+    esp_err_t read(void *buffer, size_t bufferLength, size_t *bytesRead) override
+    {
+        *bytesRead = (bufferLength < remaining) ? bufferLength : remaining;
+        memcpy(buffer, bytes, *bytesRead);
+        bytes += *bytesRead;
+        remaining -= *bytesRead;
+        return ESP_OK;
+    }
+
+private:
+    const uint8_t *bytes;
+    size_t remaining;
+};
@@ -0,0 +1,235 @@
+#pragma once
+
+#include <stdint.h> // Standard Libraries
+#include <string.h>
+#include <type_traits>
+
+#include "nvs.h"
+//
+// Compile-time mapping of C++ types onto the IDF nvs_get_* / nvs_set_* calls.  Everything here resolves during compilation, so the
+// typed read<T>() / write<T>() calls cost no more than calling the matching IDF function by hand.
+//
+// NVS_Storage describes the eight fixed width integers the IDF can store natively.
+// NVS_Traits maps any supported type onto one of those (bool -> u8, float -> u32 bits, double -> u64 bits, enums -> their underlying type).
+//
+template <typename T>
+struct NVS_Storage; // Only the specializations below exist
+
+template <>
+struct NVS_Storage<uint8_t>
+{
+    static constexpr nvs_type_t type = NVS_TYPE_U8;
+    static esp_err_t get(nvs_handle_t handle, const char *key, uint8_t *value) { return nvs_get_u8(handle, key, value); }
+    static esp_err_t set(nvs_handle_t handle, const char *key, uint8_t value) { return nvs_set_u8(handle, key, value); }
+};
+
+template <>
+struct NVS_Storage<int8_t>
+{
+    static constexpr nvs_type_t type = NVS_TYPE_I8;
+    static esp_err_t get(nvs_handle_t handle, const char *key, int8_t *value) { return nvs_get_i8(handle, key, value); }
+    static esp_err_t set(nvs_handle_t handle, const char *key, int8_t value) { return nvs_set_i8(handle, key, value); }
+};
+
+template <>
+struct NVS_Storage<uint16_t>
+{
+    static constexpr nvs_type_t type = NVS_TYPE_U16;
+    static esp_err_t get(nvs_handle_t handle, const char *key, uint16_t *value) { return nvs_get_u16(handle, key, value); }
+    static esp_err_t set(nvs_handle_t handle, const char *key, uint16_t value) { return nvs_set_u16(handle, key, value); }
+};
+
+template <>
+struct NVS_Storage<int16_t>
+{
+    static constexpr nvs_type_t type = NVS_TYPE_I16;
+    static esp_err_t get(nvs_handle_t handle, const char *key, int16_t *value) { return nvs_get_i16(handle, key, value); }
+    static esp_err_t set(nvs_handle_t handle, const char *key, int16_t value) { return nvs_set_i16(handle, key, value); }
+};
+
+template <>
+struct NVS_Storage<uint32_t>
+{
+    static constexpr nvs_type_t type = NVS_TYPE_U32;
+    static esp_err_t get(nvs_handle_t handle, const char *key, uint32_t *value) { return nvs_get_u32(handle, key, value); }
+    static esp_err_t set(nvs_handle_t handle, const char *key, uint32_t value) { return nvs_set_u32(handle, key, value); }
+};
+
+template <>
+struct NVS_Storage<int32_t>
+{
+    static constexpr nvs_type_t type = NVS_TYPE_I32;
+    static esp_err_t get(nvs_handle_t handle, const char *key, int32_t *value) { return nvs_get_i32(handle, key, value); }
+    static esp_err_t set(nvs_handle_t handle, const char *key, int32_t value) { return nvs_set_i32(handle, key, value); }
+};
+
+template <>
+struct NVS_Storage<uint64_t>
+{
+    static constexpr nvs_type_t type = NVS_TYPE_U64;
+    static esp_err_t get(nvs_handle_t handle, const char *key, uint64_t *value) { return nvs_get_u64(handle, key, value); }
+    static esp_err_t set(nvs_handle_t handle, const char *key, uint64_t value) { return nvs_set_u64(handle, key, value); }
+};
+
+template <>
+struct NVS_Storage<int64_t>
+{
+    static constexpr nvs_type_t type = NVS_TYPE_I64;
+    static esp_err_t get(nvs_handle_t handle, const char *key, int64_t *value) { return nvs_get_i64(handle, key, value); }
+    static esp_err_t set(nvs_handle_t handle, const char *key, int64_t value) { return nvs_set_i64(handle, key, value); }
+};
+
+// Runtime counterparts of NVS_Storage for code which only learns the type from an entry (shadow flushes, images, recovery).  The value
+// travels in a uint64_t.  Signed values keep their two's complement bits in the low bytes.
+template <typename Stored>
+inline esp_err_t nvsGetAs(nvs_handle_t handle, const char *key, uint64_t *value)
+{
+    Stored stored = 0;
+    esp_err_t ret = NVS_Storage<Stored>::get(handle, key, &stored);
+    *value = (uint64_t)stored;
+    return ret;
+}
+
+inline esp_err_t nvsGetInteger(nvs_handle_t handle, const char *key, nvs_type_t type, uint64_t *value)
+{
+    switch (type)
+    {
+    case NVS_TYPE_U8:
+        return nvsGetAs<uint8_t>(handle, key, value);
+    case NVS_TYPE_I8:
+        return nvsGetAs<int8_t>(handle, key, value);
+    case NVS_TYPE_U16:
+        return nvsGetAs<uint16_t>(handle, key, value);
+    case NVS_TYPE_I16:
+        return nvsGetAs<int16_t>(handle, key, value);
+    case NVS_TYPE_U32:
+        return nvsGetAs<uint32_t>(handle, key, value);
+    case NVS_TYPE_I32:
+        return nvsGetAs<int32_t>(handle, key, value);
+    case NVS_TYPE_U64:
+        return nvsGetAs<uint64_t>(handle, key, value);
+    case NVS_TYPE_I64:
+        return nvsGetAs<int64_t>(handle, key, value);
+    default:
+        return ESP_ERR_NVS_TYPE_MISMATCH;
+    }
+}
+
+inline esp_err_t nvsSetInteger(nvs_handle_t handle, const char *key, nvs_type_t type, uint64_t value) // Only the low bytes of value are stored
+{
+    switch (type)
+    {
+    case NVS_TYPE_U8:
+        return NVS_Storage<uint8_t>::set(handle, key, (uint8_t)value);
+    case NVS_TYPE_I8:
+        return NVS_Storage<int8_t>::set(handle, key, (int8_t)value);
+    case NVS_TYPE_U16:
+        return NVS_Storage<uint16_t>::set(handle, key, (uint16_t)value);
+    case NVS_TYPE_I16:
+        return NVS_Storage<int16_t>::set(handle, key, (int16_t)value);
+    case NVS_TYPE_U32:
+        return NVS_Storage<uint32_t>::set(handle, key, (uint32_t)value);
+    case NVS_TYPE_I32:
+        return NVS_Storage<int32_t>::set(handle, key, (int32_t)value);
+    case NVS_TYPE_U64:
+        return NVS_Storage<uint64_t>::set(handle, key, value);
+    case NVS_TYPE_I64:
+        return NVS_Storage<int64_t>::set(handle, key, (int64_t)value);
+    default:
+        return ESP_ERR_NVS_TYPE_MISMATCH;
+    }
+}
+
+template <size_t Size, bool Signed>
+struct NVS_FixedWidth; // Picks the fixed width integer with the same size and signedness as a native integer type
+
+template <> struct NVS_FixedWidth<1, false> { using type = uint8_t; };
+template <> struct NVS_FixedWidth<1, true> { using type = int8_t; };
+template <> struct NVS_FixedWidth<2, false> { using type = uint16_t; };
+template <> struct NVS_FixedWidth<2, true> { using type = int16_t; };
+template <> struct NVS_FixedWidth<4, false> { using type = uint32_t; };
+template <> struct NVS_FixedWidth<4, true> { using type = int32_t; };
+template <> struct NVS_FixedWidth<8, false> { using type = uint64_t; };
+template <> struct NVS_FixedWidth<8, true> { using type = int64_t; };
+
+template <typename T, typename Enable = void>
+struct NVS_Traits
+{
+    static constexpr bool supported = false; // Anything not specialized below is rejected by a static_assert in read<T>() / write<T>()
+};
+
+template <typename T> // All integers other than bool
+struct NVS_Traits<T, std::enable_if_t<std::is_integral_v<T> && !std::is_same_v<T, bool>>>
+{
+    static constexpr bool supported = true;
+    using Stored = typename NVS_FixedWidth<sizeof(T), std::is_signed_v<T>>::type;
+    static Stored encode(T value) { return (Stored)value; }
+    static T decode(Stored stored) { return (T)stored; }
+    static bool valid(Stored) { return true; }
+};
+
+template <> // Booleans are stored as u8 holding 0 or 1 (this matches what readBooleanFromNVS() has always stored)
+struct NVS_Traits<bool>
+{
+    static constexpr bool supported = true;
+    using Stored = uint8_t;
+    static Stored encode(bool value) { return (Stored)value; }
+    static bool decode(Stored stored) { return (bool)stored; }
+    static bool valid(Stored stored) { return stored <= 1; }
+};
+
+template <> // Floats are stored as their bit pattern in a u32
+struct NVS_Traits<float>
+{
+    static_assert(sizeof(float) == sizeof(uint32_t), "float must be 32 bits");
+
+    static constexpr bool supported = true;
+    using Stored = uint32_t;
+    static Stored encode(float value)
+    {
+        Stored stored;
+        memcpy(&stored, &value, sizeof(stored));
+        return stored;
+    }
+    static float decode(Stored stored)
+    {
+        float value;
+        memcpy(&value, &stored, sizeof(value));
+        return value;
+    }
+    static bool valid(Stored) { return true; }
+};
+
+template <> // Doubles are stored as their bit pattern in a u64
+struct NVS_Traits<double>
+{
+    static_assert(sizeof(double) == sizeof(uint64_t), "double must be 64 bits");
+
+    static constexpr bool supported = true;
+    using Stored = uint64_t;
+    static Stored encode(double value)
+    {
+        Stored stored;
+        memcpy(&stored, &value, sizeof(stored));
+        return stored;
+    }
+    static double decode(Stored stored)
+    {
+        double value;
+        memcpy(&value, &stored, sizeof(value));
+        return value;
+    }
+    static bool valid(Stored) { return true; }
+};
+
+template <typename T> // Enums are stored as their underlying integer
+struct NVS_Traits<T, std::enable_if_t<std::is_enum_v<T>>>
+{
+    using Underlying = NVS_Traits<std::underlying_type_t<T>>;
+
+    static constexpr bool supported = true;
+    using Stored = typename Underlying::Stored;
+    static Stored encode(T value) { return Underlying::encode((std::underlying_type_t<T>)value); }
+    static T decode(Stored stored) { return (T)Underlying::decode(stored); }
+    static bool valid(Stored stored) { return Underlying::valid(stored); }
+};
@@ -0,0 +1,100 @@
+#pragma once
+//
+// Atomic groups.  This file is included at the bottom of nvs_.hpp.
+//
+// Values which only make sense together, such as a scene's RGBW levels and its fade time, are stored as one group record instead of one
+// key each.  An NVS_Transaction loads the group, stages any number of typed writes in RAM, and commit() makes all of them visible at once
+// with a single blob write and a single commit.
+//
+// The record is double buffered under "<group>:0" and "<group>:1".  Each copy carries a generation counter and a CRC32, and commit()
+// always writes the copy which does not hold the newest generation.  A reset part way through a commit can only damage the older copy,
+// so a reader sees either the old group or the new group, never a mix.
+//
+//     NVS_Session session = nvs->openSession("scenes");
+//     NVS_Transaction scene(session, "evening");
+//     scene.write<uint8_t>("red", 255);
+//     scene.write<uint8_t>("white", 40);
+//     scene.write<uint16_t>("fade", 1500);
+//     scene.commit();
+//
+// Every field is written byte by byte in little endian order:
+//
+//     Record   u32 magic "TXNG"  u8 version  u8 entryCount  u16 reserved  u32 generation  u32 crc   CRC32 of the entries which follow
+//     Entry    u8 nvs_type_t  u8 keyLength  key  u16 length  data                                 Strings keep their terminator
+//
+constexpr uint32_t NVS_TRANSACTION_MAGIC = 0x474E5854; // "TXNG"
+constexpr uint8_t NVS_TRANSACTION_VERSION = 1;
+constexpr size_t NVS_TRANSACTION_HEADER_SIZE = 16;
+constexpr size_t NVS_TRANSACTION_MAX_LENGTH = 1024;                          // Largest record, header included.  Each copy is one blob.
+constexpr size_t NVS_TRANSACTION_GROUP_MAX_LENGTH = NVS_KEY_NAME_MAX_SIZE - 3; // Room for the ":n" copy suffix and terminator
+
+class NVS_Transaction
+{
+public:
+    NVS_Transaction(NVS_Session &, const char *); // Loads the newest complete copy of the group
+    NVS_Transaction(const NVS_Transaction &) = delete;
+    NVS_Transaction &operator=(const NVS_Transaction &) = delete;
+
+    esp_err_t getStatus(void) const { return status; }
+    uint32_t getGeneration(void) const { return generation; } // 0 until the group has been committed once
+    bool isPending(void) const { return pending; }            // Staged writes which differ from what is stored
+
+    template <typename T>
+    esp_err_t read(const char *, T *); // ESP_ERR_NVS_NOT_FOUND leaves the caller's default in place
+    template <typename T>
+    esp_err_t write(const char *, T); // Staged in RAM.  Nothing reaches flash before commit().
+
+    esp_err_t readString(const char *, std::string *);
+    esp_err_t writeString(const char *, const char *);
+
+    esp_err_t commit(void);  // Writes the whole group to the older copy.  Does nothing if no value changed.
+    esp_err_t discard(void); // Drops the staged writes by loading the group again
+
+private:
+    nvs_handle_t handle = 0;
+    NVS_SHADOW *shadow = nullptr; // Kept so a key directory learns of the copies we write
+    char group[NVS_KEY_NAME_MAX_SIZE] = {};
+    std::vector<NVS_SHADOW_ENTRY> entries; // dirty marks a staged write
+    uint32_t generation = 0;
+    uint8_t slot = 0; // Copy holding generation
+    bool pending = false;
+    esp_err_t status = ESP_OK;
+
+    NVS_SHADOW_ENTRY *find(const char *, nvs_type_t);
+    esp_err_t stage(const char *, nvs_type_t, uint64_t, const char *);
+    esp_err_t load(void);
+};
+
+template <typename T>
+esp_err_t NVS_Transaction::read(const char *key, T *value)
+{
+    static_assert(NVS_Traits<T>::supported, "NVS_Transaction read<T>(): unsupported type.  Use an integer, bool, float, double or enum.");
+
+    using Traits = NVS_Traits<T>;
+    using Stored = typename Traits::Stored;
+
+    if (status != ESP_OK)
+        return status;
+
+    NVS_SHADOW_ENTRY *entry = find(key, NVS_Storage<Stored>::type);
+
+    if (entry == nullptr)
+        return ESP_ERR_NVS_NOT_FOUND;
+
+    if (!Traits::valid((Stored)entry->value))
+        return ESP_FAIL;
+
+    *value = Traits::decode((Stored)entry->value);
+    return ESP_OK;
+}
+
+template <typename T>
+esp_err_t NVS_Transaction::write(const char *key, T newValue)
+{
+    static_assert(NVS_Traits<T>::supported, "NVS_Transaction write<T>(): unsupported type.  Use an integer, bool, float, double or enum.");
+
+    using Traits = NVS_Traits<T>;
+    using Stored = typename Traits::Stored;
+
+    return stage(key, NVS_Storage<Stored>::type, (uint64_t)Traits::encode(newValue), nullptr);
+}
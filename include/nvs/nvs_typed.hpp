@@ -0,0 +1,169 @@
+#pragma once
+//
+// Typed read / write.  This file is included at the bottom of nvs_.hpp and is not meant to be included on its own.
+//
+// readFromNVS<T>() and writeToNVS<T>() hold the one copy of the handle check, the logging, the shadow lookup and the default-on-miss
+// logic which used to be pasted into every read*FromNVS / write*ToNVS function.  The matching nvs_get_* / nvs_set_* is chosen at compile
+// time through NVS_Traits, so there is no runtime dispatch.
+//
+template <typename T>
+esp_err_t NVS::readFromNVS(nvs_handle_t handle, NVS_SHADOW *shadow, const char *key, T *value, bool *created)
+{
+    static_assert(NVS_Traits<T>::supported, "NVS read<T>(): unsupported type.  Use an integer, bool, float, double or enum.");
+
+    using Traits = NVS_Traits<T>;
+    using Stored = typename Traits::Stored;
+
+    NVS_OpTimer timer(NVS_OP::READ);
+
+    if (handle == 0)
+    {
+        routeLogByFormat<LOG_TYPE::ERROR>("%s(): You must openNVSStorage() first!", __func__);
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    }
+
+    if (show & _showNVS)
+        routeLogByFormat<LOG_TYPE::INFO>("%s(): Passed in a key of: %s", __func__, key);
+
+    NVS_SHADOW_ENTRY *entry = shadowLookup(shadow, key, NVS_Storage<Stored>::type);
+
+    if (entry != nullptr) // Served from RAM.  Checked again, since bool and uint8_t (say) share an entry of the same nvs type.
+    {
+        if (!Traits::valid((Stored)entry->value))
+        {
+            routeLogKeyValue<LOG_TYPE::ERROR>(__func__, "Improper value stored with key of", key, (Stored)entry->value);
+            return ESP_FAIL;
+        }
+
+        *value = Traits::decode((Stored)entry->value);
+        return ESP_OK;
+    }
+
+    Stored storedValue = Traits::encode(*value); // The value passed in is our default
+    esp_err_t ret = ESP_ERR_NVS_NOT_FOUND;
+
+    if (directoryMayHold(shadow, key, NVS_Storage<Stored>::type)) // A key directory lets a first boot skip the lookup which is bound to fail
+        ret = NVS_Storage<Stored>::get(handle, key, &storedValue);
+
+    if (ret == ESP_OK)
+    {
+        if (!Traits::valid(storedValue))
+        {
+            routeLogKeyValue<LOG_TYPE::ERROR>(__func__, "Improper value stored with key of", key, storedValue);
+            return ESP_FAIL;
+        }
+
+        *value = Traits::decode(storedValue);
+        shadowStore(shadow, key, NVS_Storage<Stored>::type, (uint64_t)storedValue, nullptr, false);
+    }
+    else if (ret == ESP_ERR_NVS_NOT_FOUND)
+    {
+        // If the call to nvs_get_* fails, the default value passed in by reference is unchanged.  We use that value to save for the first time.
+        routeLogKeyValue<LOG_TYPE::INFO>(__func__, "New value stored with key of", key, storedValue);
+
+        if (!shadowStore(shadow, key, NVS_Storage<Stored>::type, (uint64_t)storedValue, nullptr, true)) // A shadowed namespace defers the first time save until the next flush.
+        {
+            ret = NVS_Storage<Stored>::set(handle, key, storedValue);
+
+            if (ret != ESP_OK)
+                return ret;
+
+            NVS_OpTimer::countWrite(sizeof(Stored));
+        }
+
+        if (created != nullptr)
+            *created = true;
+        return ESP_OK;
+    }
+    else // Unexpected Error
+        routeLogByFormat<LOG_TYPE::ERROR>("%s(): Read of key %s failed esp_err_t code = %s", __func__, key, esp_err_to_name(ret));
+
+    return ret;
+}
+
+template <typename T>
+esp_err_t NVS::writeToNVS(nvs_handle_t handle, NVS_SHADOW *shadow, const char *key, T newValue)
+{
+    static_assert(NVS_Traits<T>::supported, "NVS write<T>(): unsupported type.  Use an integer, bool, float, double or enum.");
+
+    using Traits = NVS_Traits<T>;
+    using Stored = typename Traits::Stored;
+
+    NVS_OpTimer timer(NVS_OP::WRITE);
+
+    if (handle == 0)
+    {
+        routeLogByFormat<LOG_TYPE::ERROR>("%s(): You must openNVSStorage() first!", __func__);
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    }
+
+    Stored newStored = Traits::encode(newValue);
+
+    if (show & _showNVS)
+        routeLogKeyValue<LOG_TYPE::INFO>(__func__, "Passed in key", key, newStored);
+
+    // We try to do a read first.  If entry in NVS doesn't exist, the read will create the entry for us with newValue as its starting value.
+    // If the entry already exists, we get back its current value.  If new value is different, we save it.  We don't try to resave
+    // a value that is unchanged.
+    T storedValue = newValue;
+    bool created = false;
+    esp_err_t ret = readFromNVS<T>(handle, shadow, key, &storedValue, &created);
+
+    if (ret == ESP_OK)
+    {
+        if (created) // The read saved newValue for us.  Subscribers hear of a new key just as they would of a changed one.
+            notifyChange(shadow, key, NVS_Storage<Stored>::type, (uint64_t)newStored, nullptr);
+        else if (Traits::encode(storedValue) != newStored) // Compare the stored form so floats compare bit for bit
+        {
+            if (!shadowStore(shadow, key, NVS_Storage<Stored>::type, (uint64_t)newStored, nullptr, true)) // A shadowed namespace only marks the entry dirty.
+            {
+                ret = NVS_Storage<Stored>::set(handle, key, newStored);
+
+                if (ret == ESP_OK)
+                    NVS_OpTimer::countWrite(sizeof(Stored));
+            }
+
+            if (ret == ESP_OK) // Readers see the new value from here on
+                notifyChange(shadow, key, NVS_Storage<Stored>::type, (uint64_t)newStored, nullptr);
+        }
+        else
+        {
+            timer.setOp(NVS_OP::SKIPPED_WRITE);
+
+            if (shadow != nullptr)
+                shadow->stats.skippedWrites++;
+        }
+    }
+    else
+    {
+        if (show & _showNVS) // Unexpected Error
+            routeLogByFormat<LOG_TYPE::ERROR>("%s(): Write of key %s failed esp_err_t code = %s", __func__, key, esp_err_to_name(ret));
+    }
+
+    return ret;
+}
+
+template <typename T>
+esp_err_t NVS_Session::read(const char *key, T *value)
+{
+    if (nvs == nullptr)
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    return nvs->readFromNVS<T>(handle, shadow, key, value);
+}
+
+template <typename T>
+esp_err_t NVS_Session::write(const char *key, T newValue)
+{
+    if (nvs == nullptr)
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    return nvs->writeToNVS<T>(handle, shadow, key, newValue);
+}
+
+template <LOG_TYPE type, typename V>
+void NVS::routeLogKeyValue(const char *function, const char *text, const char *key, V value)
+{
+    if constexpr (std::is_signed_v<V>)
+        routeLogByFormat<type>("%s(): %s %s = %lld", function, text, key, (long long)value);
+    else
+        routeLogByFormat<type>("%s(): %s %s = %llu", function, text, key, (unsigned long long)value);
+}
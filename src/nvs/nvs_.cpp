@@ -1,21 +1,43 @@
 #include "nvs/nvs_.hpp"
 
+#if !CONFIG_IDF_TARGET_LINUX
 #include "esp_efuse.h"
 #include "esp_efuse_table.h"
+#endif
+#include "esp_timer.h"
+
+#include <string.h>
 
 /* Local Semaphores */
-SemaphoreHandle_t semNVSEntry = NULL; // Varible lives in this translation unit.
+SemaphoreHandle_t semNVSEntry = NULL;                           // Varible lives in this translation unit.
+SemaphoreHandle_t semNVSNamespace[NVS_NAMESPACE_LOCKS] = {}; // Recursive mutexes, one per namespace hash bucket.
+SemaphoreHandle_t semNVSShadowTable = NULL;                    // Guards the shadow slot table.
+SemaphoreHandle_t semNVSFlush = NULL;                          // One flush() at a time.
+SemaphoreHandle_t semNVSFlushDone = NULL;                      // Given by the write-behind task when a flush() has finished.
+SemaphoreHandle_t semNVSErrorLog = NULL;                       // Guards the error log handle and its indexes.
+SemaphoreHandle_t semNVSInitDone = NULL;                       // Given once the partition is mounted and never taken for long after that.
+SemaphoreHandle_t semNVSRoutes = NULL;                         // Held only while a partition or namespace route is being added.
+SemaphoreHandle_t semNVSNotify = NULL;                         // Guards the subscription table.
+SemaphoreHandle_t semNVSCompress = NULL;                       // Guards the buffers compressed strings are packed and unpacked in.
 
 //
 // Previously, NVS functions were hosted within the System object, but we are increasing NVS services so now those functions are being moved away from the System.
 // This reduces the need to lock the System object during NVS activities.
 //
 // This object has no task running and therefore no FreeRTOS queue or notification mechanisms are used to gain access to it.  Again, like in the System object,
-// we use a locking semaphore to gain access to NVS for all our mid-level storage and retrieval needs.
+// we use a locking semaphore to gain access to NVS for all our mid-level storage and retrieval needs.  The one exception is the optional write-behind
+// task (nvs_writebehind.cpp) which is only started by enableWriteBehind().
+//
+// Callers may also use openSession() which hands back an NVS_Session.  A session holds only the lock of its own namespace, so work on
+// different namespaces no longer serializes behind semNVSEntry.  openNVSStorage() takes the same namespace lock so both styles can be mixed.
 //
 // Also like the System, this NVS object is a singleton object and remains instantiated for the lifetime of the application - UNLESS, the system shuts down and
 // puts the system to sleep.  In the case of a shut-down, nvs is destroyed.
 //
+// With NVS_DEFERRED_INIT the partition is mounted by a short lived task so that getInstance() returns at once.  The task holds semNVSEntry
+// until the mount is done, so callers using the semNVSEntry ritual simply wait there.  Everything else which touches flash calls
+// waitForInit() first, which costs one atomic load once the mount has finished.
+//
 // NVS Error codes can be found in nvs.h
 //
 
@@ -26,7 +48,11 @@ NVS::NVS()
     setLogLevels();            // Manually sets log levels for tasks down the call stack for development.
     createSemaphores();        // Creates any locking semaphores owned by this object.
     restoreVariablesFromNVS(); // Brings back all our persistant data.
-    initializeNVS();           // We don't have a run task, we all our initialization is done here.
+#if NVS_DEFERRED_INIT
+    startInit(); // The mount carries on in the background
+#else
+    initializeNVS(); // We don't have a run task, we all our initialization is done here.
+#endif
 }
 
 void NVS::setFlags()
@@ -44,10 +70,12 @@ void NVS::setFlags()
 
 void NVS::setLogLevels()
 {
-    if (show > 0)                             // Normally, we are interested in the variables inside our object.
-        esp_log_level_set(TAG, ESP_LOG_INFO); // If we have any flags set, we need to be sure to turn on the logging so we can see them.
+    if (show > 0)                // Normally, we are interested in the variables inside our object.
+        logLevel = ESP_LOG_INFO; // If we have any flags set, we need to be sure to turn on the logging so we can see them.
     else
-        esp_log_level_set(TAG, ESP_LOG_ERROR); // Likewise, we turn off logging if we are not looking for anything.
+        logLevel = ESP_LOG_ERROR; // Likewise, we turn off logging if we are not looking for anything.
+
+    esp_log_level_set(TAG, logLevel);
 }
 
 void NVS::createSemaphores()
@@ -55,47 +83,177 @@ void NVS::createSemaphores()
     semNVSEntry = xSemaphoreCreateBinary(); // External Entry locking
     if (semNVSEntry != NULL)
         xSemaphoreGive(semNVSEntry);
+
+    for (auto &lock : semNVSNamespace) // Namespace locking for sessions
+        lock = xSemaphoreCreateRecursiveMutex();
+
+    semNVSShadowTable = xSemaphoreCreateMutex();
+    semNVSFlush = xSemaphoreCreateMutex();
+    semNVSFlushDone = xSemaphoreCreateBinary();
+    semNVSErrorLog = xSemaphoreCreateMutex();
+    semNVSInitDone = xSemaphoreCreateBinary(); // Starts out taken
+    semNVSRoutes = xSemaphoreCreateMutex();
+    semNVSNotify = xSemaphoreCreateMutex();
+    semNVSCompress = xSemaphoreCreateMutex();
 }
 
 void NVS::restoreVariablesFromNVS()
 {
-    // NVS doens't maintain any variables at this time.
+    // NVS doens't maintain any variables at this time.  Objects which do can describe them with an NVS_Schema (nvs_schema.hpp) and
+    // call restore() once from their own restoreVariablesFromNVS() rather than one read*FromNVS() per variable.
 }
 
 void NVS::initializeNVS()
 {
     xSemaphoreTake(semNVSEntry, portMAX_DELAY);
+    mountNVS();
+    xSemaphoreGive(semNVSEntry);
+}
+
+void NVS::startInit()
+{
+    xSemaphoreTake(semNVSEntry, portMAX_DELAY); // Given back by runInit() once the mount is done
+    initReport.deferred = true;
+
+    if (xTaskCreate(runInit, "nvs_init", NVS_INIT_STACK_SIZE, this, tskIDLE_PRIORITY + 1, NULL) != pdPASS)
+    {
+        initReport.deferred = false; // No room for the task.  Mount here as we always did.
+        mountNVS();
+        xSemaphoreGive(semNVSEntry);
+    }
+}
+
+void NVS::runInit(void *arg)
+{
+    NVS *nvs = (NVS *)arg;
+    nvs->mountNVS();
+    xSemaphoreGive(semNVSEntry);
+    vTaskDelete(NULL);
+}
 
+void NVS::mountNVS()
+{
+    int64_t start = esp_timer_get_time();
     esp_err_t ret = nvs_flash_init();
+    initReport.firstResult = ret;
 
     if ((ret == ESP_ERR_NVS_NO_FREE_PAGES) || (ret == ESP_ERR_NOT_FOUND) || (ret == ESP_ERR_NVS_NEW_VERSION_FOUND))
     {
-        routeLogByValue(LOG_TYPE::WARN, std::string(__func__) + "(): ********** Erasing NVS for use. **********");
-        ESP_ERROR_CHECK(nvs_flash_erase()); // NVS partition was truncated and needs to be erased
-        ESP_ERROR_CHECK(nvs_flash_init());  // Retry nvs_flash_init
+        int64_t recoveryStart = esp_timer_get_time();
+
+        if ((ret != ESP_ERR_NVS_NO_FREE_PAGES) || (recoverNVS() != ESP_OK)) // Only a full partition still holds entries we know how to read
+        {
+            routeLogByFormat<LOG_TYPE::WARN>("%s(): ********** Erasing NVS for use. **********", __func__);
+            ESP_ERROR_CHECK(nvs_flash_erase()); // NVS partition was truncated and needs to be erased
+            ESP_ERROR_CHECK(nvs_flash_init());  // Retry nvs_flash_init
+        }
+
+        initReport.recovered = true;
+        initReport.recoveryMicros = (uint32_t)(esp_timer_get_time() - recoveryStart);
     }
 
-    xSemaphoreGive(semNVSEntry);
+    initReport.readyAtMicros = esp_timer_get_time();
+    initReport.initMicros = (uint32_t)(initReport.readyAtMicros - start);
+
+    if (initReport.deferred) // Measured here, after any recovery, since that is the deepest the mount task ever goes
+    {
+        initReport.stackHeadroom = (uint32_t)uxTaskGetStackHighWaterMark(NULL);
+
+        if (initReport.stackHeadroom < NVS_INIT_STACK_MARGIN)
+            routeLogByFormat<LOG_TYPE::WARN>("%s(): Only %lu bytes of the init stack left unused.  Raise NVS_INIT_STACK_SIZE.", __func__,
+                                             (unsigned long)initReport.stackHeadroom);
+    }
+
+    initDone = true;
+    xSemaphoreGive(semNVSInitDone);
+
+    routeLogByFormat<LOG_TYPE::INFO>("%s(): Mounted in %luus (recovery %luus)", __func__, (unsigned long)initReport.initMicros, (unsigned long)initReport.recoveryMicros);
 }
 
 /* Public Member Functions */
+esp_err_t NVS::waitForInit(TickType_t ticksToWait)
+{
+    if (initDone)
+        return ESP_OK;
+
+    int64_t start = esp_timer_get_time();
+
+    if (xSemaphoreTake(semNVSInitDone, ticksToWait) != pdTRUE)
+        return ESP_ERR_TIMEOUT;
+
+    uint32_t waited = (uint32_t)(esp_timer_get_time() - start); // Only one waiter at a time gets here, so the report needs no other lock
+    initReport.waiters++;
+
+    if (waited > initReport.maxWaitMicros)
+        initReport.maxWaitMicros = waited;
+
+    xSemaphoreGive(semNVSInitDone); // Pass it on to the next waiter
+    return ESP_OK;
+}
+
+esp_err_t NVS::getInitReport(NVS_INIT_REPORT *report)
+{
+    if (!initDone)
+        return ESP_ERR_INVALID_STATE;
+
+    xSemaphoreTake(semNVSInitDone, portMAX_DELAY); // Keeps a late waiter from updating the report while we copy it
+    *report = initReport;
+    xSemaphoreGive(semNVSInitDone);
+    return ESP_OK;
+}
+
 void NVS::eraseNVSPartition(const char str[])
 {
+    waitForInit();
+    NVS_OpTimer timer(NVS_OP::ERASE);
+
+    for (auto shadow : shadows) // A write-behind batch must not land after the erase
+        if ((shadow != nullptr) && (strcmp(getPartition(shadow->name_space), str) == 0))
+            shadowAwaitFlush(shadow);
+
     ESP_ERROR_CHECK(nvs_flash_erase_partition(str));
-    routeLogByValue(LOG_TYPE::INFO, std::string(__func__) + "(): NVS Erased partition " + std::string(str));
+
+    for (auto shadow : shadows) // Nothing we hold in RAM for this partition is valid any longer.
+        if ((shadow != nullptr) && (strcmp(getPartition(shadow->name_space), str) == 0))
+            shadowClear(shadow);
+    routeLogByFormat<LOG_TYPE::INFO>("%s(): NVS Erased partition %s", __func__, str);
 }
 
 void NVS::eraseNVSNamespace(char str[])
 {
     ESP_ERROR_CHECK(openNVSStorage(str));
-    ESP_ERROR_CHECK(nvs_erase_all(nvsHandle));
+    shadowAwaitFlush(activeShadow);
+
+    {
+        NVS_OpTimer timer(NVS_OP::ERASE);
+        ESP_ERROR_CHECK(nvs_erase_all(nvsHandle));
+    }
+
+    if (activeShadow != nullptr)
+        shadowClear(activeShadow);
     closeNVStorage();
-    routeLogByValue(LOG_TYPE::INFO, std::string(__func__) + "(): NVS Erased namespace " + std::string(str));
+    routeLogByFormat<LOG_TYPE::INFO>("%s(): NVS Erased namespace %s", __func__, str);
 }
 
 esp_err_t NVS::openNVSStorage(const char *name_space)
 {
-    ESP_RETURN_ON_ERROR(nvs_open(name_space, NVS_READWRITE, &nvsHandle), TAG, "nvs_open() failed...");
+    NVS_OpTimer timer(NVS_OP::OPEN); // Includes any wait on the namespace lock
+    waitForInit();
+    nvsLock = namespaceLock(name_space); // Sessions on this namespace must wait for us
+    xSemaphoreTakeRecursive(nvsLock, portMAX_DELAY);
+
+    nvsPartition = getPartition(name_space);
+    esp_err_t ret = openNamespace(name_space, &nvsHandle);
+
+    if (ret != ESP_OK)
+    {
+        xSemaphoreGiveRecursive(nvsLock);
+        nvsLock = nullptr;
+        nvsHandle = 0;
+        ESP_RETURN_ON_ERROR(ret, TAG, "nvs_open() failed...");
+    }
+
+    activeShadow = attachShadow(name_space); // Attach a RAM shadow if this namespace has one.
     return ESP_OK;
 }
 
@@ -103,364 +261,369 @@ void NVS::closeNVStorage(bool commitChanges)
 {
     if (nvsHandle == 0)
     {
-        routeLogByValue(LOG_TYPE::INFO, std::string(__func__) + "(): You must openNVSStorage() first!");
+        routeLogByFormat<LOG_TYPE::INFO>("%s(): You must openNVSStorage() first!", __func__);
         return;
     }
 
-    if (commitChanges)
-        ESP_ERROR_CHECK(nvs_commit(nvsHandle));
+    NVS_OpTimer timer(NVS_OP::CLOSE);
 
-    nvs_close(nvsHandle);
-}
-
-esp_err_t NVS::readBooleanFromNVS(const char *key, bool *value)
-{
-    if (nvsHandle == 0)
+    if (commitChanges)
     {
-        routeLogByValue(LOG_TYPE::ERROR, std::string(__func__) + "(): You must openNVSStorage() first!");
-        return ESP_ERR_NVS_INVALID_HANDLE;
-    }
+        NVS_OpTimer commitTimer(NVS_OP::COMMIT);
 
-    if (show & _showNVS)
-        routeLogByValue(LOG_TYPE::INFO, std::string(__func__) + "(): Passed in a key of: " + std::string(key));
+        if ((activeShadow != nullptr) && !activeShadow->writeBehind) // Dirty shadow entries go out now and share the one commit below.
+            shadowFlush(nvsHandle, activeShadow);
 
-    esp_err_t ret = ESP_OK;
-    uint8_t intValue = (int)*value; // Copy value converting boolean to integer.
+        ESP_ERROR_CHECK(nvs_commit(nvsHandle));
+        checkFreeEntries(nvsPartition);
+    }
 
-    ret = nvs_get_u8(nvsHandle, key, &intValue);
+    writeBehindNotice(activeShadow); // A write-behind namespace leaves its dirty entries for our task
 
-    if (ret == ESP_OK)
-    {
-        if (intValue > 1)
-        {
-            routeLogByValue(LOG_TYPE::ERROR, std::string(__func__) + "(): Improper value of " + std::to_string(intValue) + "stored");
-            return ESP_FAIL;
-        }
+    nvs_close(nvsHandle);
+    nvsHandle = 0;
+    detachShadow(activeShadow);
+    activeShadow = nullptr;
 
-        *value = (bool)intValue; // values of 0 and 1 should convert correctly to bool.
-    }
-    else if (ret == ESP_ERR_NVS_NOT_FOUND)
+    if (nvsLock != nullptr)
     {
-        // If the call to nvs_get_u8 fails, the default value passed in by reference is unchanged.  We use that value for a first time save.
-        routeLogByValue(LOG_TYPE::INFO, std::string(__func__) + "(): New Bool value stored as u8int with key of " + std::string(key) + " = " + std::to_string(intValue));
-        return nvs_set_u8(nvsHandle, key, intValue);
+        xSemaphoreGiveRecursive(nvsLock);
+        nvsLock = nullptr;
     }
-    else // Unexpected Error
-        routeLogByValue(LOG_TYPE::ERROR, std::string(__func__) + "(): nvs_get_u8(nvsHandle, key, &val) failed, code = " + esp_err_to_name(ret));
+}
 
-    return ret;
+/* Public Read / Write Functions */
+// These operate on the namespace held open by openNVSStorage().  NVS_Session calls the same routines with its own handle.
+// The scalar functions are kept for existing callers and are now thin wrappers around the typed read<T>() / write<T>() templates.
+esp_err_t NVS::readBooleanFromNVS(const char *key, bool *value)
+{
+    return readFromNVS<bool>(nvsHandle, activeShadow, key, value);
 }
 
 esp_err_t NVS::writeBooleanToNVS(const char *key, bool newValue)
 {
-    if (nvsHandle == 0)
-    {
-        routeLogByValue(LOG_TYPE::ERROR, std::string(__func__) + "(): You must openNVSStorage() first!");
-        return ESP_ERR_NVS_INVALID_HANDLE;
-    }
+    return writeToNVS<bool>(nvsHandle, activeShadow, key, newValue);
+}
 
-    if (show & _showNVS)
-        routeLogByValue(LOG_TYPE::INFO, std::string(__func__) + "(): Passed in key " + std::string(key) + " with value of: " + std::to_string(newValue));
+esp_err_t NVS::readStringFromNVS(const char *key, std::string *strValue)
+{
+    return readStringFromNVS(nvsHandle, activeShadow, key, strValue);
+}
 
-    uint8_t storedValue = 0;
+esp_err_t NVS::readStringFromNVS(const char *key, char *buffer, size_t bufferSize)
+{
+    return readStringFromNVS(nvsHandle, activeShadow, key, buffer, bufferSize);
+}
 
-    // We try to do a read first.  If entry in NVS doesn't exist, the read will create the entry for us with a starting value of newValue.
-    // If the entry already exists, we get back its current value.  If new value is different, we save it.  We don't try to resave
-    // a value that is unchanged.
-    esp_err_t ret = readU8IntegerFromNVS(key, &storedValue);
+esp_err_t NVS::writeStringToNVS(const char *key, std::string *newValue)
+{
+    return writeStringToNVS(nvsHandle, activeShadow, key, newValue->c_str());
+}
 
-    if (ret == ESP_OK)
-    {
-        if (newValue != storedValue) // If the value has changed or empty, then update with new value
-        {
-            if (show & _showNVS)
-                routeLogByValue(LOG_TYPE::INFO, std::string(__func__) + "(): writeU8IntegerToNVS is key " + std::string(key) + " with value of: " + std::to_string(newValue));
+esp_err_t NVS::writeStringToNVS(const char *key, const char *newValue)
+{
+    return writeStringToNVS(nvsHandle, activeShadow, key, newValue);
+}
 
-            ret = nvs_set_u8(nvsHandle, key, (uint8_t)newValue); // Casts the boolean to an integer
-        }
-    }
-    else
-    {
-        if (show & _showNVS) // Unexpected Error
-            routeLogByValue(LOG_TYPE::ERROR, std::string(__func__) + "(): writeU8IntegerToNVS failed esp_err_t code = " + esp_err_to_name(ret));
-    }
+esp_err_t NVS::readU8IntegerFromNVS(const char *key, uint8_t *intValue)
+{
+    return readFromNVS<uint8_t>(nvsHandle, activeShadow, key, intValue);
+}
 
-    if (show & _showNVS)
-    {
-        std::string trueFalse = "";
+esp_err_t NVS::writeU8IntegerToNVS(const char *key, uint8_t newValue)
+{
+    return writeToNVS<uint8_t>(nvsHandle, activeShadow, key, newValue);
+}
 
-        if (newValue)
-            trueFalse = "true";
-        else
-            trueFalse = "false";
+esp_err_t NVS::readI32IntegerFromNVS(const char *key, int32_t *intValue)
+{
+    return readFromNVS<int32_t>(nvsHandle, activeShadow, key, intValue);
+}
 
-        routeLogByValue(LOG_TYPE::INFO, std::string(__func__) + "(): saveBooleanAsString key " + std::string(key) + " with value of: " + std::to_string(newValue));
-    }
+esp_err_t NVS::writeI32IntegerToNVS(const char *key, int32_t newValue)
+{
+    return writeToNVS<int32_t>(nvsHandle, activeShadow, key, newValue);
+}
 
-    return ret;
+esp_err_t NVS::readU32IntegerFromNVS(const char *key, uint32_t *intValue)
+{
+    return readFromNVS<uint32_t>(nvsHandle, activeShadow, key, intValue);
 }
 
-esp_err_t NVS::readStringFromNVS(const char *key, std::string *strValue)
+esp_err_t NVS::writeU32IntegerToNVS(const char *key, uint32_t newValue)
 {
-    if (nvsHandle == 0)
+    return writeToNVS<uint32_t>(nvsHandle, activeShadow, key, newValue);
+}
+
+/* Private Read / Write Functions */
+esp_err_t NVS::readStringFromNVS(nvs_handle_t handle, NVS_SHADOW *shadow, const char *key, std::string *strValue)
+{
+    NVS_OpTimer timer(NVS_OP::READ);
+
+    if (handle == 0)
     {
-        routeLogByValue(LOG_TYPE::ERROR, std::string(__func__) + "(): You must openNVSStorage() first!");
+        routeLogByFormat<LOG_TYPE::ERROR>("%s(): You must openNVSStorage() first!", __func__);
         return ESP_ERR_NVS_INVALID_HANDLE;
     }
 
     if (show & _showNVS)
-        routeLogByValue(LOG_TYPE::INFO, std::string(__func__) + "(): Passed in a key of: " + std::string(key));
-
-    esp_err_t ret;
-    std::string storedValue = "";
-    size_t storedValueLength = 0;
+        routeLogByFormat<LOG_TYPE::INFO>("%s(): Passed in a key of: %s", __func__, key);
 
-    ret = nvs_get_str(nvsHandle, key, NULL, &storedValueLength); // First ask for the length of the stored string
+    NVS_SHADOW_ENTRY *entry = shadowLookup(shadow, key, NVS_TYPE_STR);
 
-    if ((storedValueLength > 0) && (storedValueLength < ESP_ERR_NVS_BASE)) // If the size is above zero and less than an error code
+    if (entry != nullptr) // Served from RAM
     {
-        // We create a temporary copy buffer here, but there may be a better way of doing this.
-        char *tempChars = (char *)malloc(storedValueLength);
-        taskYIELD();
-
-        ret = nvs_get_str(nvsHandle, key, tempChars, &storedValueLength); // Something should be there because we have a length
+        *strValue = entry->text;
+        return ESP_OK;
+    }
 
-        storedValue = std::string(tempChars);
-        free(tempChars);
+    // We read straight into the caller's string.  Whatever capacity it already has is tried first, so a string which is reused for the
+    // same key needs a single flash lookup.  Only when it is too small does nvs_get_str() tell us the length so we can resize once and retry.
+    // A key directory knows the length up front, so the string is sized once and never retried.
+    // nvs_get_str() writes nothing on failure, so the caller's default value survives a miss.
+    size_t defaultLength = strValue->length();
+    size_t storedValueLength = 0;
+    esp_err_t ret = ESP_ERR_NVS_NOT_FOUND;
 
-        if (ret == ESP_OK)
-        {
-            *strValue = storedValue;
+    if (isCompressed(shadow, key)) // Kept as a packed blob.  See nvs_compress.cpp.
+    {
+        ret = readCompressedString(handle, shadow, key, strValue);
+        storedValueLength = strValue->length() + 1;
+    }
+    else if (directoryMayHold(shadow, key, NVS_TYPE_STR, &storedValueLength))
+    {
+        strValue->resize((storedValueLength > strValue->capacity() + 1) ? storedValueLength - 1 : strValue->capacity());
+        storedValueLength = strValue->length() + 1; // std::string always has room for the terminator
 
-            if (show & _showNVS)
-                routeLogByValue(LOG_TYPE::INFO, std::string(__func__) + "(): Retrieved " + std::string(key) + " from NVS of: " + std::string(storedValue)); // Debug print statements
+        ret = nvs_get_str(handle, key, strValue->data(), &storedValueLength);
 
-            return ret;
+        if (ret == ESP_ERR_NVS_INVALID_LENGTH) // storedValueLength now holds the length we need
+        {
+            strValue->resize(storedValueLength - 1);
+            ret = nvs_get_str(handle, key, strValue->data(), &storedValueLength);
         }
     }
-    else if ((ret == ESP_ERR_NVS_NOT_FOUND) || (ret < ESP_ERR_NVS_BASE)) // Stored value doesn't exist OR stored value DOES exist is empty (no error)
-        return nvs_set_str(nvsHandle, key, strValue->c_str());           // Save the value which was passed to our function by reference.
-
-    routeLogByValue(LOG_TYPE::ERROR, std::string(__func__) + "(): readStringFromNVS() failed for some reason, code = " + esp_err_to_name(ret));
-    return ret;
-}
 
-esp_err_t NVS::writeStringToNVS(const char *key, std::string *newValue)
-{
-    if (nvsHandle == 0)
+    if (ret == ESP_OK)
     {
-        routeLogByValue(LOG_TYPE::ERROR, std::string(__func__) + "(): You must openNVSStorage() first!");
-        return ESP_ERR_NVS_INVALID_HANDLE;
-    }
+        strValue->resize(storedValueLength - 1);
+        shadowStore(shadow, key, NVS_TYPE_STR, 0, strValue->c_str(), false);
 
-    if (show & _showNVS)
-        routeLogByValue(LOG_TYPE::INFO, std::string(__func__) + "(): Passed in key " + std::string(key) + " with value of: " + *newValue);
-
-    esp_err_t ret = ESP_OK;
-    char *tempChars;
-    std::string storedValue = "";
-    size_t storedValueLength = 0;
+        if (show & _showNVS)
+            routeLogByFormat<LOG_TYPE::INFO>("%s(): Retrieved %s from NVS of: %s", __func__, key, strValue->c_str()); // Debug print statements
+        return ret;
+    }
 
-    ret = nvs_get_str(nvsHandle, key, NULL, &storedValueLength);
+    strValue->resize(defaultLength); // Back to the default value which was passed to our function by reference.
 
-    if ((storedValueLength > 0) && (storedValueLength < ESP_ERR_NVS_BASE)) // We have a previously stored value.
+    if (ret == ESP_ERR_NVS_NOT_FOUND) // Stored value doesn't exist.  Save the default.
     {
-        tempChars = (char *)malloc(storedValueLength);
-        taskYIELD();
-
-        ret = nvs_get_str(nvsHandle, key, tempChars, &storedValueLength);
-        taskYIELD();
+        if (shadowStore(shadow, key, NVS_TYPE_STR, 0, strValue->c_str(), true)) // A shadowed namespace defers the first time save until the next flush.
+            return ESP_OK;
 
-        storedValue = std::string(tempChars); // Transfer value over to string.  This simplifies our code in subsequent steps.
-        free(tempChars);                      // Don't allow a memory leak!
+        ret = storeString(handle, shadow, key, strValue->c_str());
 
-        if (storedValue == *newValue) // storedValue is equal to newValue. Do not access nvs.  We are done
-            return ESP_OK;
-        else
-            return nvs_set_str(nvsHandle, key, newValue->c_str()); // storedValue and newValue are different so we save the newValue.  We are done.
+        if (ret == ESP_OK)
+            NVS_OpTimer::countWrite(strValue->length() + 1);
+        return ret;
     }
-    else if (ret == ESP_ERR_NVS_NOT_FOUND)
-        return nvs_set_str(nvsHandle, key, newValue->c_str()); // Save the new value which was passed to our function by reference.  We are done.
 
-    routeLogByValue(LOG_TYPE::ERROR, std::string(__func__) + "(): writeStringToNVS() failed for some reason, code = " + esp_err_to_name(ret));
+    routeLogByFormat<LOG_TYPE::ERROR>("%s(): readStringFromNVS() failed for some reason, code = %s", __func__, esp_err_to_name(ret));
     return ret;
 }
 
-esp_err_t NVS::readU8IntegerFromNVS(const char *key, uint8_t *intValue)
+esp_err_t NVS::readStringFromNVS(nvs_handle_t handle, NVS_SHADOW *shadow, const char *key, char *buffer, size_t bufferSize)
 {
-    if (nvsHandle == 0)
+    NVS_OpTimer timer(NVS_OP::READ);
+
+    if (handle == 0)
     {
-        routeLogByValue(LOG_TYPE::ERROR, std::string(__func__) + "(): You must openNVSStorage() first!");
+        routeLogByFormat<LOG_TYPE::ERROR>("%s(): You must openNVSStorage() first!", __func__);
         return ESP_ERR_NVS_INVALID_HANDLE;
     }
 
     if (show & _showNVS)
-        routeLogByValue(LOG_TYPE::INFO, std::string(__func__) + "(): Passed in a key of: " + std::string(key));
+        routeLogByFormat<LOG_TYPE::INFO>("%s(): Passed in a key of: %s", __func__, key);
 
-    esp_err_t ret = nvs_get_u8(nvsHandle, key, intValue);
+    NVS_SHADOW_ENTRY *entry = shadowLookup(shadow, key, NVS_TYPE_STR);
 
-    if (ret == ESP_ERR_NVS_NOT_FOUND)
+    if (entry != nullptr) // Served from RAM
     {
-        // If the call to nvs_get_u32 fails, the default value passed in by reference is unchanged.  We use that value to save for the first time.
-        routeLogByValue(LOG_TYPE::INFO, std::string(__func__) + "(): New value stored as u8int with key of " + std::string(key) + " = " + std::to_string(*intValue));
-        return nvs_set_u8(nvsHandle, key, *intValue);
-    }
-    else if (ret != ESP_OK) // Unexpected Error
-        routeLogByValue(LOG_TYPE::ERROR, std::string(__func__) + "(): read failed esp_err_t code = " + esp_err_to_name(ret));
-    return ret;
-}
+        if (entry->text.length() + 1 > bufferSize)
+            return ESP_ERR_NVS_INVALID_LENGTH;
 
-esp_err_t NVS::writeU8IntegerToNVS(const char *key, uint8_t newValue)
-{
-    if (nvsHandle == 0)
-    {
-        routeLogByValue(LOG_TYPE::ERROR, std::string(__func__) + "(): You must openNVSStorage() first!");
-        return ESP_ERR_NVS_INVALID_HANDLE;
+        memcpy(buffer, entry->text.c_str(), entry->text.length() + 1);
+        return ESP_OK;
     }
 
-    if (show & _showNVS)
-        routeLogByValue(LOG_TYPE::INFO, std::string(__func__) + "(): Passed in key " + std::string(key) + " with value of: " + std::to_string(newValue));
-
-    uint8_t storedValue = 0;
-
-    // We try to do a read first.  If entry in NVS doesn't exist, the read will create the entry for us with a starting value of newValue.
-    // If the entry already exists, we get back its current value.  If new value is different, we save it.  We don't try to resave
-    // a value that is unchanged.
-    esp_err_t ret = readU8IntegerFromNVS(key, &storedValue);
+    size_t storedValueLength = bufferSize;
+    esp_err_t ret = ESP_ERR_NVS_NOT_FOUND;
 
-    if (ret == ESP_OK)
+    if (isCompressed(shadow, key))
     {
-        if (newValue != storedValue) // If the value has changed or empty, then update with new value
+        std::string stored;
+        ret = readCompressedString(handle, shadow, key, &stored);
+
+        if (ret == ESP_OK)
         {
-            if (show & _showNVS)
-                routeLogByValue(LOG_TYPE::INFO, std::string(__func__) + "(): writeU8IntegerToNVS is key " + std::string(key) + " with value of: " + std::to_string(newValue));
+            storedValueLength = stored.length() + 1;
 
-            ret = nvs_set_u8(nvsHandle, key, newValue);
+            if (storedValueLength > bufferSize)
+                ret = ESP_ERR_NVS_INVALID_LENGTH;
+            else
+                memcpy(buffer, stored.c_str(), storedValueLength);
         }
     }
-    else
-    {
-        if (show & _showNVS) // Unexpected Error
-            routeLogByValue(LOG_TYPE::ERROR, std::string(__func__) + "(): writeU8IntegerToNVS failed esp_err_t code = " + esp_err_to_name(ret));
-    }
-    return ret;
-}
+    else if (directoryMayHold(shadow, key, NVS_TYPE_STR))
+        ret = nvs_get_str(handle, key, buffer, &storedValueLength); // On a miss the buffer still holds the caller's default
 
-esp_err_t NVS::readI32IntegerFromNVS(const char *key, int32_t *intValue)
-{
-    if (nvsHandle == 0)
+    if (ret == ESP_OK)
+        shadowStore(shadow, key, NVS_TYPE_STR, 0, buffer, false);
+    else if (ret == ESP_ERR_NVS_NOT_FOUND)
     {
-        routeLogByValue(LOG_TYPE::ERROR, std::string(__func__) + "(): You must openNVSStorage() first!");
-        return ESP_ERR_NVS_INVALID_HANDLE;
-    }
-
-    if (show & _showNVS)
-        routeLogByValue(LOG_TYPE::INFO, std::string(__func__) + "(): Passed in a key of: " + std::string(key));
+        if (shadowStore(shadow, key, NVS_TYPE_STR, 0, buffer, true)) // A shadowed namespace defers the first time save until the next flush.
+            return ESP_OK;
 
-    esp_err_t ret = nvs_get_i32(nvsHandle, key, intValue);
+        ret = storeString(handle, shadow, key, buffer);
 
-    if (ret == ESP_ERR_NVS_NOT_FOUND)
-    {
-        // If the call to nvs_get_i32 fails, the default value passed in by reference is unchanged.  We use that value to save for the first time.
-        routeLogByValue(LOG_TYPE::INFO, std::string(__func__) + "(): New value stored as i32int with key of " + std::string(key));
-        return nvs_set_i32(nvsHandle, key, *intValue);
+        if (ret == ESP_OK)
+            NVS_OpTimer::countWrite(strlen(buffer) + 1);
+        return ret;
     }
-    else if (ret != ESP_OK) // Unexpected Error
-        routeLogByValue(LOG_TYPE::ERROR, std::string(__func__) + "(): read failed esp_err_t code = " + esp_err_to_name(ret));
+    else if (ret == ESP_ERR_NVS_INVALID_LENGTH)
+        routeLogByFormat<LOG_TYPE::ERROR>("%s(): Key %s needs a buffer of %zu bytes", __func__, key, storedValueLength);
+    else
+        routeLogByFormat<LOG_TYPE::ERROR>("%s(): readStringFromNVS() failed for some reason, code = %s", __func__, esp_err_to_name(ret));
+
     return ret;
 }
 
-esp_err_t NVS::writeI32IntegerToNVS(const char *key, int32_t newValue)
+esp_err_t NVS::writeStringToNVS(nvs_handle_t handle, NVS_SHADOW *shadow, const char *key, const char *newValue)
 {
-    if (nvsHandle == 0)
+    NVS_OpTimer timer(NVS_OP::WRITE);
+
+    if (handle == 0)
     {
-        routeLogByValue(LOG_TYPE::ERROR, std::string(__func__) + "(): You must openNVSStorage() first!");
+        routeLogByFormat<LOG_TYPE::ERROR>("%s(): You must openNVSStorage() first!", __func__);
         return ESP_ERR_NVS_INVALID_HANDLE;
     }
 
     if (show & _showNVS)
-        routeLogByValue(LOG_TYPE::INFO, std::string(__func__) + "(): Passed in key " + std::string(key) + " with value of: " + std::to_string(newValue));
+        routeLogByFormat<LOG_TYPE::INFO>("%s(): Passed in key %s with value of: %s", __func__, key, newValue);
 
-    int32_t storedValue = 0;
+    if (isCompressed(shadow, key) && (strlen(newValue) > NVS_COMPRESS_MAX_LENGTH)) // Refused now rather than at every flush
+    {
+        routeLogByFormat<LOG_TYPE::ERROR>("%s(): Compressed key %s is limited to %u bytes", __func__, key, (unsigned)NVS_COMPRESS_MAX_LENGTH);
+        return ESP_ERR_NVS_VALUE_TOO_LONG;
+    }
 
-    // We try to do a read first.  If entry in NVS doesn't exist, the read will create the entry for us with a starting value of 0.
-    // If the entry already exists, we get back its current value.  If new value is different, we save it.  We don't try to resave a value that is unchanged
-    esp_err_t ret = readI32IntegerFromNVS(key, &storedValue);
+    NVS_SHADOW_ENTRY *entry = shadowLookup(shadow, key, NVS_TYPE_STR);
 
-    if (ret == ESP_OK)
+    if (entry != nullptr) // Compare in RAM
     {
-        if (newValue != storedValue) // If the value has changed or empty, then update with new value
+        if (entry->text == newValue)
         {
-            if (show & _showNVS)
-                routeLogByValue(LOG_TYPE::INFO, std::string(__func__) + "(): writeI32IntegerToNVS is key " + std::string(key) + " with value of: " + std::to_string(newValue));
+            timer.setOp(NVS_OP::SKIPPED_WRITE);
+            shadow->stats.skippedWrites++;
+            return ESP_OK;
+        }
 
-            ret = nvs_set_i32(nvsHandle, key, newValue);
+        if (shadowStore(shadow, key, NVS_TYPE_STR, 0, newValue, true))
+        {
+            notifyChange(shadow, key, NVS_TYPE_STR, 0, newValue);
+            return ESP_OK;
         }
     }
 
-    if (ret != ESP_OK)
+    bool equal = false;
+    size_t storedValueLength = 0;
+    esp_err_t ret = ESP_ERR_NVS_NOT_FOUND; // Stays so when a key directory shows the key was never stored
+
+    if (isCompressed(shadow, key)) // Only the unpacked text can be compared
     {
-        if (show & _showNVS) // Unexpected Error
-            routeLogByValue(LOG_TYPE::ERROR, std::string(__func__) + "(): writeI32IntegerToNVS failed esp_err_t code = " + esp_err_to_name(ret));
-    }
-    return ret;
-}
+        std::string stored;
+        ret = readCompressedString(handle, shadow, key, &stored);
+        equal = (ret == ESP_OK) && (stored == newValue);
 
-esp_err_t NVS::readU32IntegerFromNVS(const char *key, uint32_t *intValue)
-{
-    if (nvsHandle == 0)
+        if ((ret == ESP_ERR_INVALID_CRC) || (ret == ESP_ERR_INVALID_SIZE) || (ret == ESP_ERR_INVALID_VERSION)) // A damaged value is simply replaced
+            ret = ESP_OK;
+    }
+    else if (directoryMayHold(shadow, key, NVS_TYPE_STR, &storedValueLength))
     {
-        routeLogByValue(LOG_TYPE::ERROR, std::string(__func__) + "(): You must openNVSStorage() first!");
-        return ESP_ERR_NVS_INVALID_HANDLE;
+        if ((storedValueLength != 0) && (storedValueLength != strlen(newValue) + 1)) // A different length means it has changed
+            ret = ESP_OK;
+        else
+            ret = compareStoredString(handle, key, newValue, &equal);
     }
 
-    if (show & _showNVS)
-        routeLogByValue(LOG_TYPE::INFO, std::string(__func__) + "(): Passed in a key of: " + std::string(key));
+    if ((ret == ESP_OK) && equal) // storedValue is equal to newValue. Do not access nvs.  We are done
+    {
+        timer.setOp(NVS_OP::SKIPPED_WRITE);
 
-    esp_err_t ret = nvs_get_u32(nvsHandle, key, intValue);
+        if (shadow != nullptr)
+        {
+            shadowStore(shadow, key, NVS_TYPE_STR, 0, newValue, false);
+            shadow->stats.skippedWrites++;
+        }
+        return ESP_OK;
+    }
 
-    if (ret == ESP_ERR_NVS_NOT_FOUND)
+    if ((ret == ESP_OK) || (ret == ESP_ERR_NVS_NOT_FOUND)) // Changed or never stored
     {
-        // If the call to nvs_get_u32 fails, the default value passed in by reference is unchanged.  We use that value to save for the first time.
-        routeLogByValue(LOG_TYPE::WARN, std::string(__func__) + "(): New value stored as u32int with key of " + std::string(key));
-        return nvs_set_u32(nvsHandle, key, *intValue);
+        if (shadowStore(shadow, key, NVS_TYPE_STR, 0, newValue, true)) // A shadowed namespace only marks the entry dirty.
+            ret = ESP_OK;
+        else
+        {
+            ret = storeString(handle, shadow, key, newValue);
+
+            if (ret == ESP_OK)
+                NVS_OpTimer::countWrite(strlen(newValue) + 1);
+        }
+
+        if (ret == ESP_OK) // Readers see the new value from here on
+            notifyChange(shadow, key, NVS_TYPE_STR, 0, newValue);
+        return ret;
     }
-    else if (ret != ESP_OK) // Unexpected Error
-        routeLogByValue(LOG_TYPE::ERROR, std::string(__func__) + "(): Read failed esp_err_t code = " + esp_err_to_name(ret));
+
+    routeLogByFormat<LOG_TYPE::ERROR>("%s(): writeStringToNVS() failed for some reason, code = %s", __func__, esp_err_to_name(ret));
     return ret;
 }
 
-esp_err_t NVS::writeU32IntegerToNVS(const char *key, uint32_t newValue)
+// Compares a stored string against value without building any std::string.  The stored string is read into a small stack buffer.  A stored
+// string which doesn't fit tells us its length, and a length that differs settles the question without reading the content.  The IDF can only
+// hand back a string whole, so an equal length string longer than the stack buffer is compared through one temporary buffer of exactly that size.
+esp_err_t NVS::compareStoredString(nvs_handle_t handle, const char *key, const char *value, bool *equal)
 {
-    if (nvsHandle == 0)
+    char stackChars[NVS_STRING_COMPARE_STACK];
+    size_t valueLength = strlen(value) + 1;
+    size_t storedValueLength = sizeof(stackChars);
+
+    *equal = false;
+
+    esp_err_t ret = nvs_get_str(handle, key, stackChars, &storedValueLength);
+
+    if (ret == ESP_OK)
     {
-        routeLogByValue(LOG_TYPE::ERROR, std::string(__func__) + "(): You must openNVSStorage() first!");
-        return ESP_ERR_NVS_INVALID_HANDLE;
+        *equal = (storedValueLength == valueLength) && (memcmp(stackChars, value, valueLength) == 0);
+        return ESP_OK;
     }
 
-    if (show & _showNVS)
-        routeLogByValue(LOG_TYPE::INFO, std::string(__func__) + "(): Passed in key " + std::string(key) + " with value of: " + std::to_string(newValue));
+    if (ret != ESP_ERR_NVS_INVALID_LENGTH) // Not found or a real error
+        return ret;
+
+    if (storedValueLength != valueLength) // Too long for the stack, but different in length so it has changed.
+        return ESP_OK;
 
-    uint32_t storedValue = 0;
+    char *tempChars = (char *)malloc(storedValueLength);
 
-    // We try to do a read first.  If entry in NVS doesn't exist, the read will create the entry for us with a starting value of 0.
-    // If the entry already exists, we get back its current value.  If new value is different, we save it.  We don't try to resave a value that is unchanged
-    esp_err_t ret = readU32IntegerFromNVS(key, &storedValue);
+    if (tempChars == nullptr) // Without memory we can't compare.  Report a change so the new value still gets written.
+        return ESP_OK;
+
+    ret = nvs_get_str(handle, key, tempChars, &storedValueLength);
 
     if (ret == ESP_OK)
-    {
-        if (newValue != storedValue) // If the value has changed, then update with new value
-        {
-            if (show & _showNVS)
-                routeLogByValue(LOG_TYPE::INFO, std::string(__func__) + "(): Passed in key " + std::string(key) + " with value of: " + std::to_string(newValue));
+        *equal = (memcmp(tempChars, value, valueLength) == 0);
 
-            ret = nvs_set_u32(nvsHandle, key, newValue);
-        }
-    }
-    else
-    {
-        if (show & _showNVS) // Unexpected Error
-            routeLogByValue(LOG_TYPE::ERROR, std::string(__func__) + "(): writeU32IntegerToNVS failed esp_err_t code = " + esp_err_to_name(ret));
-    }
+    free(tempChars); // Don't allow a memory leak!
     return ret;
-}
\ No newline at end of file
+}
@@ -0,0 +1,224 @@
+#include "nvs/nvs_.hpp"
+#include "system_.hpp"
+
+#include "esp_rom_crc.h"
+
+#include <stdio.h>
+#include <string.h>
+//
+// Packed typed arrays.  See nvs_array.hpp for the record layout.
+//
+// Everything a write needs to decide which chunks changed is in the header blob, so a write costs one read however large the table is.
+// Two chunks are taken as equal when their CRC32s match.  The odds of a change going unnoticed that way are one in four billion per chunk.
+//
+static void makeChunkKey(char *chunkKey, const char *key, uint8_t index)
+{
+    snprintf(chunkKey, NVS_KEY_NAME_MAX_SIZE, "%s.%02x", key, index);
+}
+
+static size_t chunkLength(size_t length, uint8_t index)
+{
+    size_t start = (size_t)index * NVS_ARRAY_CHUNK_SIZE;
+    return ((length - start) < NVS_ARRAY_CHUNK_SIZE) ? (length - start) : NVS_ARRAY_CHUNK_SIZE;
+}
+
+// Reads and checks the header blob.  A blob which isn't one of our tables reports ESP_ERR_INVALID_VERSION.
+static esp_err_t readRecord(nvs_handle_t handle, const char *key, uint8_t *record, NVS_ARRAY_HEADER *header)
+{
+    size_t length = NVS_ARRAY_RECORD_SIZE; // Always large enough, so the record is read once without asking its length first
+    esp_err_t ret = nvs_get_blob(handle, key, record, &length);
+
+    if (ret == ESP_ERR_NVS_INVALID_LENGTH)
+        return ESP_ERR_INVALID_VERSION;
+
+    if (ret != ESP_OK)
+        return ret;
+
+    if (length < sizeof(NVS_ARRAY_HEADER))
+        return ESP_ERR_INVALID_VERSION;
+
+    memcpy(header, record, sizeof(NVS_ARRAY_HEADER));
+
+    size_t width = header->type & 0x0F;
+    size_t packedLength = (size_t)header->count * width;
+    size_t tail = (header->chunkCount == 0) ? packedLength : header->chunkCount * sizeof(uint32_t);
+
+    if ((header->magic != NVS_ARRAY_MAGIC) || (header->version != NVS_ARRAY_VERSION) || ((width != 1) && (width != 2) && (width != 4) && (width != 8)) ||
+        (length != sizeof(NVS_ARRAY_HEADER) + tail) || (packedLength > NVS_ARRAY_MAX_LENGTH) ||
+        ((header->chunkCount != 0) && (header->chunkCount != (packedLength + NVS_ARRAY_CHUNK_SIZE - 1) / NVS_ARRAY_CHUNK_SIZE)))
+        return ESP_ERR_INVALID_VERSION;
+
+    if (esp_rom_crc32_le(0, &record[sizeof(NVS_ARRAY_HEADER)], tail) != header->crc)
+        return ESP_ERR_INVALID_CRC;
+
+    return ESP_OK;
+}
+
+/* Private Member Functions */
+esp_err_t NVS::readArrayFromNVS(nvs_handle_t handle, NVS_SHADOW *shadow, const char *key, nvs_type_t type, std::vector<uint8_t> *packed)
+{
+    NVS_OpTimer timer(NVS_OP::READ);
+
+    if (handle == 0)
+    {
+        routeLogByFormat<LOG_TYPE::ERROR>("%s(): You must openNVSStorage() first!", __func__);
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    }
+
+    if (show & _showNVS)
+        routeLogByFormat<LOG_TYPE::INFO>("%s(): Passed in a key of: %s", __func__, key);
+
+    if (!directoryMayHold(shadow, key, NVS_TYPE_BLOB)) // A first boot saves its defaults without a lookup
+        return ESP_ERR_NVS_NOT_FOUND;
+
+    uint8_t record[NVS_ARRAY_RECORD_SIZE];
+    NVS_ARRAY_HEADER header = {};
+    esp_err_t ret = readRecord(handle, key, record, &header);
+
+    if (ret == ESP_ERR_NVS_NOT_FOUND)
+        return ret;
+
+    if ((ret == ESP_OK) && (header.type != type))
+        ret = ESP_ERR_NVS_TYPE_MISMATCH;
+
+    if (ret != ESP_OK)
+    {
+        routeLogByFormat<LOG_TYPE::ERROR>("%s(): Table %s is unreadable, code = %s", __func__, key, esp_err_to_name(ret));
+        return ret;
+    }
+
+    size_t length = (size_t)header.count * (type & 0x0F);
+    std::vector<uint8_t> stored(length);
+
+    if (header.chunkCount == 0)
+        memcpy(stored.data(), &record[sizeof(header)], length);
+
+    for (uint8_t index = 0; index < header.chunkCount; index++) // Straight into place.  Each chunk is checked against the header's list.
+    {
+        char chunkKey[NVS_KEY_NAME_MAX_SIZE];
+        makeChunkKey(chunkKey, key, index);
+
+        size_t expected = chunkLength(length, index);
+        size_t got = expected;
+        uint32_t chunkCRC = 0;
+        memcpy(&chunkCRC, &record[sizeof(header) + index * sizeof(chunkCRC)], sizeof(chunkCRC));
+
+        ret = nvs_get_blob(handle, chunkKey, &stored[(size_t)index * NVS_ARRAY_CHUNK_SIZE], &got);
+
+        if ((ret == ESP_OK) && ((got != expected) || (chunkCRC != esp_rom_crc32_le(0, &stored[(size_t)index * NVS_ARRAY_CHUNK_SIZE], expected))))
+            ret = ESP_ERR_INVALID_CRC;
+
+        if (ret != ESP_OK)
+        {
+            routeLogByFormat<LOG_TYPE::ERROR>("%s(): Chunk %s failed, code = %s", __func__, chunkKey, esp_err_to_name(ret));
+            return (ret == ESP_ERR_NVS_NOT_FOUND) ? ESP_ERR_INVALID_CRC : ret; // The header exists, so a missing chunk is damage, not a first boot
+        }
+    }
+
+    packed->swap(stored);
+    return ESP_OK;
+}
+
+esp_err_t NVS::writeArrayToNVS(nvs_handle_t handle, NVS_SHADOW *shadow, const char *key, nvs_type_t type, const std::vector<uint8_t> &packed)
+{
+    NVS_OpTimer timer(NVS_OP::WRITE);
+
+    if (handle == 0)
+    {
+        routeLogByFormat<LOG_TYPE::ERROR>("%s(): You must openNVSStorage() first!", __func__);
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    }
+
+    if (strlen(key) > NVS_ARRAY_KEY_MAX_LENGTH)
+        return ESP_ERR_NVS_KEY_TOO_LONG;
+
+    size_t length = packed.size();
+
+    if (length > NVS_ARRAY_MAX_LENGTH)
+        return ESP_ERR_NVS_VALUE_TOO_LONG;
+
+    NVS_ARRAY_HEADER header = {};
+    header.magic = NVS_ARRAY_MAGIC;
+    header.version = NVS_ARRAY_VERSION;
+    header.type = (uint8_t)type;
+    header.chunkCount = (length <= NVS_ARRAY_CHUNK_SIZE) ? 0 : (uint8_t)((length + NVS_ARRAY_CHUNK_SIZE - 1) / NVS_ARRAY_CHUNK_SIZE);
+    header.count = (uint16_t)(length / (type & 0x0F));
+
+    uint8_t record[NVS_ARRAY_RECORD_SIZE];
+    size_t tail = (header.chunkCount == 0) ? length : header.chunkCount * sizeof(uint32_t);
+
+    if (header.chunkCount == 0)
+        memcpy(&record[sizeof(header)], packed.data(), length);
+
+    for (uint8_t index = 0; index < header.chunkCount; index++)
+    {
+        uint32_t chunkCRC = esp_rom_crc32_le(0, &packed[(size_t)index * NVS_ARRAY_CHUNK_SIZE], chunkLength(length, index));
+        memcpy(&record[sizeof(header) + index * sizeof(chunkCRC)], &chunkCRC, sizeof(chunkCRC));
+    }
+
+    header.crc = esp_rom_crc32_le(0, &record[sizeof(header)], tail);
+    memcpy(record, &header, sizeof(header));
+
+    uint8_t oldRecord[NVS_ARRAY_RECORD_SIZE];
+    NVS_ARRAY_HEADER oldHeader = {};
+    bool hasOld = directoryMayHold(shadow, key, NVS_TYPE_BLOB) && (readRecord(handle, key, oldRecord, &oldHeader) == ESP_OK);
+
+    if (hasOld && (memcmp(oldRecord, record, sizeof(header) + tail) == 0)) // Same type, count and content
+    {
+        timer.setOp(NVS_OP::SKIPPED_WRITE);
+
+        if (shadow != nullptr)
+            shadow->stats.skippedWrites++;
+        return ESP_OK;
+    }
+
+    bool sameChunks = hasOld && (oldHeader.chunkCount == header.chunkCount); // Same boundaries, so the CRC lists compare chunk for chunk
+    uint8_t rewritten = 0;
+    esp_err_t ret = ESP_OK;
+
+    for (uint8_t index = 0; (ret == ESP_OK) && (index < header.chunkCount); index++) // Chunks first.  The header makes them current.
+    {
+        size_t offset = sizeof(header) + index * sizeof(uint32_t);
+
+        if (sameChunks && (memcmp(&oldRecord[offset], &record[offset], sizeof(uint32_t)) == 0))
+            continue;
+
+        char chunkKey[NVS_KEY_NAME_MAX_SIZE];
+        makeChunkKey(chunkKey, key, index);
+
+        size_t chunkBytes = chunkLength(length, index);
+        ret = nvs_set_blob(handle, chunkKey, &packed[(size_t)index * NVS_ARRAY_CHUNK_SIZE], chunkBytes);
+
+        if (ret == ESP_OK)
+        {
+            NVS_OpTimer::countWrite(chunkBytes);
+            directoryNote(shadow, chunkKey, NVS_TYPE_BLOB, chunkBytes);
+            rewritten++;
+        }
+    }
+
+    if (ret == ESP_OK)
+        ret = nvs_set_blob(handle, key, record, sizeof(header) + tail);
+
+    if (ret != ESP_OK)
+    {
+        routeLogByFormat<LOG_TYPE::ERROR>("%s(): Write of table %s failed, code = %s", __func__, key, esp_err_to_name(ret));
+        return ret;
+    }
+
+    NVS_OpTimer::countWrite(sizeof(header) + tail);
+    directoryNote(shadow, key, NVS_TYPE_BLOB, sizeof(header) + tail);
+
+    for (uint8_t index = header.chunkCount; hasOld && (index < oldHeader.chunkCount); index++) // A shorter table leaves stale chunks behind
+    {
+        char chunkKey[NVS_KEY_NAME_MAX_SIZE];
+        makeChunkKey(chunkKey, key, index);
+
+        if (nvs_erase_key(handle, chunkKey) == ESP_OK)
+            directoryForget(shadow, chunkKey, NVS_TYPE_BLOB);
+    }
+
+    if (show & _showNVS)
+        routeLogByFormat<LOG_TYPE::INFO>("%s(): Table %s rewrote %u of %u chunks", __func__, key, rewritten, header.chunkCount);
+    return ESP_OK;
+}
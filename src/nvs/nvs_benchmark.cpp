@@ -0,0 +1,304 @@
+#include "nvs/nvs_.hpp"
+#include "system_.hpp"
+
+#include <stdio.h>
+#include <string.h>
+//
+// Benchmark suite.  Compiled only when NVS_BENCHMARK is set.  It is meant for the IDF Linux target, where the partition is a file on the
+// host, so a build server can run it on every change.  It also runs on a device, where it erases and rewrites a great deal of flash.
+// test_apps/nvs_benchmark is a host app which does nothing else and writes the CSV to stdout.
+//
+// Every case runs through a session on NVS_BENCH_NAMESPACE, exactly as an owning object would, and times each operation on its own.  One
+// CSV line is handed to the sink per case:
+//
+//     fill,type,size,op,commit,iterations,total_us,ops_per_s,p50_us,p99_us,max_us,result
+//
+// fill     Percent of the partition's entries in use while the case ran.  Filler blobs go into NVS_BENCH_FILL_NAMESPACE.
+// op       read, changed (every write stores a new value) or unchanged (every write matches what is stored)
+// commit   each (nvs_commit() after every write, timed with it), batch (one commit at the end, only in total_us) or none for reads
+// result   ESP_OK or the first error, after which the case stops early
+//
+// Both namespaces are erased before and after the run.
+//
+#if NVS_BENCHMARK
+#include "esp_timer.h"
+
+#include <algorithm>
+
+constexpr char NVS_BENCH_NAMESPACE[] = "nvs_bench";
+constexpr char NVS_BENCH_FILL_NAMESPACE[] = "nvs_bfill";
+constexpr size_t NVS_BENCH_FILL_BLOB = 480; // 16 entries of 32 bytes each, counting the blob headers
+
+enum class BENCH_OP : uint8_t
+{
+    READ = 0,
+    CHANGED,
+    UNCHANGED,
+};
+
+struct BENCH_CASE
+{
+    uint8_t fill;
+    const char *type;
+    size_t size;
+    BENCH_OP op;
+    bool commitEach;
+};
+
+class BenchRun // Holds the sample buffer for the whole run so no case allocates while it is being timed
+{
+public:
+    BenchRun(NVS_BlobSink &resultSink, uint16_t count) : sink(resultSink), iterations(count) { samples.reserve(count); }
+
+    template <typename Op>
+    esp_err_t time(NVS_Session &session, const BENCH_CASE &benchCase, Op op)
+    {
+        samples.clear();
+        esp_err_t ret = ESP_OK;
+        int64_t start = esp_timer_get_time();
+
+        for (uint16_t i = 0; (i < iterations) && (ret == ESP_OK); i++)
+        {
+            int64_t opStart = esp_timer_get_time();
+            ret = op(i);
+
+            if ((ret == ESP_OK) && (benchCase.op != BENCH_OP::READ) && benchCase.commitEach)
+                ret = nvs_commit(session.getHandle());
+
+            samples.push_back((uint32_t)(esp_timer_get_time() - opStart));
+        }
+
+        if ((ret == ESP_OK) && (benchCase.op != BENCH_OP::READ) && !benchCase.commitEach)
+            ret = nvs_commit(session.getHandle());
+
+        return report(benchCase, (uint64_t)(esp_timer_get_time() - start), ret);
+    }
+
+private:
+    NVS_BlobSink &sink;
+    uint16_t iterations;
+    std::vector<uint32_t> samples;
+
+    esp_err_t report(const BENCH_CASE &benchCase, uint64_t totalMicros, esp_err_t result)
+    {
+        static const char *opNames[] = {"read", "changed", "unchanged"};
+
+        std::sort(samples.begin(), samples.end());
+        size_t count = samples.size();
+        uint32_t p50 = (count == 0) ? 0 : samples[count / 2];
+        uint32_t p99 = (count == 0) ? 0 : samples[std::min(count - 1, count * 99 / 100)];
+        uint32_t max = (count == 0) ? 0 : samples[count - 1];
+        uint32_t opsPerSecond = (totalMicros == 0) ? 0 : (uint32_t)((uint64_t)count * 1000000 / totalMicros);
+
+        char line[160];
+        int length = snprintf(line, sizeof(line), "%u,%s,%u,%s,%s,%u,%llu,%lu,%lu,%lu,%lu,%s\n", benchCase.fill, benchCase.type, (unsigned)benchCase.size,
+                              opNames[(uint8_t)benchCase.op], (benchCase.op == BENCH_OP::READ) ? "none" : (benchCase.commitEach ? "each" : "batch"),
+                              (unsigned)count, (unsigned long long)totalMicros, (unsigned long)opsPerSecond, (unsigned long)p50, (unsigned long)p99,
+                              (unsigned long)max, esp_err_to_name(result));
+
+        return sink.write(line, std::min((size_t)length, sizeof(line) - 1));
+    }
+};
+
+static void eraseNamespace(NVS *nvs, const char *name_space)
+{
+    NVS_Session session = nvs->openSession(name_space);
+
+    if (session.isOpen())
+        nvs_erase_all(session.getHandle()); // The session commits on the way out
+}
+
+// Each case reports its own failure in its CSV line.  Only a failed seed or a sink which refuses a line stops the run, and runBenchmark()
+// logs that code.
+template <typename T>
+static esp_err_t benchScalar(NVS *nvs, BenchRun &run, uint8_t fill, const char *type)
+{
+    NVS_Session session = nvs->openSession(NVS_BENCH_NAMESPACE);
+
+    if (!session.isOpen())
+        return session.getStatus();
+
+    const char *key = type; // One key per type.  The IDF keeps a key written with two types as two items.
+    T stored = (T)1;
+    esp_err_t ret = session.write<T>(key, stored);
+
+    if (ret == ESP_OK)
+        ret = nvs_commit(session.getHandle());
+    if (ret != ESP_OK)
+        return ret;
+
+    auto readOp = [&](uint16_t) {
+        T value = (T)0;
+        return session.read<T>(key, &value);
+    };
+    auto changedOp = [&](uint16_t) {
+        stored = (T)!stored; // Flips between 0 and 1, which every supported type (bool included) can hold
+        return session.write<T>(key, stored);
+    };
+    auto unchangedOp = [&](uint16_t) { return session.write<T>(key, stored); };
+
+    ret = run.time(session, {fill, type, sizeof(T), BENCH_OP::READ, false}, readOp);
+
+    for (bool commitEach : {true, false})
+    {
+        if (ret == ESP_OK)
+            ret = run.time(session, {fill, type, sizeof(T), BENCH_OP::CHANGED, commitEach}, changedOp);
+        if (ret == ESP_OK)
+            ret = run.time(session, {fill, type, sizeof(T), BENCH_OP::UNCHANGED, commitEach}, unchangedOp);
+    }
+
+    return ret;
+}
+
+static esp_err_t benchString(NVS *nvs, BenchRun &run, uint8_t fill, size_t size)
+{
+    NVS_Session session = nvs->openSession(NVS_BENCH_NAMESPACE);
+
+    if (!session.isOpen())
+        return session.getStatus();
+
+    std::string values[2] = {std::string(size - 1, 'a'), std::string(size - 1, 'a')}; // size includes the terminator
+    values[1][0] = 'b';
+    uint8_t current = 0;
+
+    esp_err_t ret = session.writeString("string", values[current].c_str());
+
+    if (ret == ESP_OK)
+        ret = nvs_commit(session.getHandle());
+    if (ret != ESP_OK)
+        return ret;
+
+    std::string readBack;
+    readBack.reserve(size); // Reused across reads, as an owning object would
+
+    auto readOp = [&](uint16_t) { return session.readString("string", &readBack); };
+    auto changedOp = [&](uint16_t) {
+        current ^= 1;
+        return session.writeString("string", values[current].c_str());
+    };
+    auto unchangedOp = [&](uint16_t) { return session.writeString("string", values[current].c_str()); };
+
+    ret = run.time(session, {fill, "str", size, BENCH_OP::READ, false}, readOp);
+
+    for (bool commitEach : {true, false})
+    {
+        if (ret == ESP_OK)
+            ret = run.time(session, {fill, "str", size, BENCH_OP::CHANGED, commitEach}, changedOp);
+        if (ret == ESP_OK)
+            ret = run.time(session, {fill, "str", size, BENCH_OP::UNCHANGED, commitEach}, unchangedOp);
+    }
+
+    return ret;
+}
+
+// Adds filler blobs until the partition holding the benchmark namespace reaches the given fill.  Returns the fill actually reached.
+static uint8_t fillPartition(NVS *nvs, uint8_t percent, uint16_t *fillerCount)
+{
+    const char *partition = nvs->getPartition(NVS_BENCH_NAMESPACE);
+    NVS_Session session = nvs->openSession(NVS_BENCH_FILL_NAMESPACE);
+    nvs_stats_t stats = {};
+    uint8_t filler[NVS_BENCH_FILL_BLOB];
+    memset(filler, 0x5A, sizeof(filler));
+
+    while (session.isOpen() && (nvs_get_stats(partition, &stats) == ESP_OK) && (stats.total_entries > 0))
+    {
+        if (stats.used_entries * 100 / stats.total_entries >= percent)
+            break;
+
+        char key[NVS_KEY_NAME_MAX_SIZE];
+        snprintf(key, sizeof(key), "f%04x", *fillerCount);
+
+        if (nvs_set_blob(session.getHandle(), key, filler, sizeof(filler)) != ESP_OK) // Full.  Report what we reached.
+            break;
+
+        (*fillerCount)++;
+    }
+
+    session.close();
+    nvs_get_stats(partition, &stats);
+    return (stats.total_entries == 0) ? 0 : (uint8_t)(stats.used_entries * 100 / stats.total_entries);
+}
+
+/* Public Member Functions */
+esp_err_t NVS::runBenchmark(NVS_BlobSink &sink, uint16_t iterations)
+{
+    if (iterations == 0)
+        return ESP_ERR_INVALID_ARG;
+
+    esp_err_t ret = waitForInit();
+
+    if (ret != ESP_OK)
+    {
+        routeLogByFormat<LOG_TYPE::ERROR>("%s(): NVS is not mounted, code = %s", __func__, esp_err_to_name(ret));
+        return ret;
+    }
+
+    if (findShadow(NVS_BENCH_NAMESPACE) != nullptr) // Reads would be answered from RAM and measure nothing
+        return ESP_ERR_INVALID_STATE;
+
+    static const char header[] = "fill,type,size,op,commit,iterations,total_us,ops_per_s,p50_us,p99_us,max_us,result\n";
+    ret = sink.write(header, sizeof(header) - 1);
+
+    if (ret != ESP_OK)
+    {
+        routeLogByFormat<LOG_TYPE::ERROR>("%s(): Sink refused the header, code = %s", __func__, esp_err_to_name(ret));
+        return ret;
+    }
+
+    eraseNamespace(this, NVS_BENCH_NAMESPACE);
+    eraseNamespace(this, NVS_BENCH_FILL_NAMESPACE);
+
+    BenchRun run(sink, iterations);
+    uint16_t fillerCount = 0;
+    uint8_t fill = 0;
+    int64_t start = esp_timer_get_time();
+
+    for (uint8_t level : NVS_BENCH_FILL_LEVELS) // Ascending, so each level only adds to the filler already written
+    {
+        fill = fillPartition(this, level, &fillerCount);
+
+        if (fill < level)
+            routeLogByFormat<LOG_TYPE::WARN>("%s(): Asked for %u%% fill, reached %u%%", __func__, level, fill);
+
+        ret = benchScalar<bool>(this, run, fill, "bool");
+
+        if (ret == ESP_OK)
+            ret = benchScalar<uint8_t>(this, run, fill, "u8");
+        if (ret == ESP_OK)
+            ret = benchScalar<int8_t>(this, run, fill, "i8");
+        if (ret == ESP_OK)
+            ret = benchScalar<uint16_t>(this, run, fill, "u16");
+        if (ret == ESP_OK)
+            ret = benchScalar<int16_t>(this, run, fill, "i16");
+        if (ret == ESP_OK)
+            ret = benchScalar<uint32_t>(this, run, fill, "u32");
+        if (ret == ESP_OK)
+            ret = benchScalar<int32_t>(this, run, fill, "i32");
+        if (ret == ESP_OK)
+            ret = benchScalar<uint64_t>(this, run, fill, "u64");
+        if (ret == ESP_OK)
+            ret = benchScalar<int64_t>(this, run, fill, "i64");
+
+        for (size_t i = 0; (ret == ESP_OK) && (i < sizeof(NVS_BENCH_STRING_SIZES) / sizeof(NVS_BENCH_STRING_SIZES[0])); i++)
+            ret = benchString(this, run, fill, NVS_BENCH_STRING_SIZES[i]);
+
+        eraseNamespace(this, NVS_BENCH_NAMESPACE); // The next level starts from an empty namespace
+
+        if (ret != ESP_OK)
+            break;
+    }
+
+    eraseNamespace(this, NVS_BENCH_FILL_NAMESPACE);
+
+    if (ret != ESP_OK)
+        routeLogByFormat<LOG_TYPE::ERROR>("%s(): Stopped early at %u%% fill, code = %s", __func__, fill, esp_err_to_name(ret));
+    else
+        routeLogByFormat<LOG_TYPE::INFO>("%s(): Finished in %lld ms", __func__, (long long)((esp_timer_get_time() - start) / 1000));
+    return ret;
+}
+#else
+esp_err_t NVS::runBenchmark(NVS_BlobSink &, uint16_t)
+{
+    return ESP_ERR_NOT_SUPPORTED;
+}
+#endif
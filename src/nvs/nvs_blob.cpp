@@ -0,0 +1,393 @@
+#include "nvs/nvs_.hpp"
+#include "system_.hpp"
+
+#include "esp_rom_crc.h"
+
+#include <stdio.h>
+#include <string.h>
+//
+// Chunked blob streams.  See nvs_blob.hpp for the storage layout.
+//
+// Each chunk is on flash as soon as nvs_set_blob() returns, so a rewrite never touches the chunks the current header points at.  Writers
+// put every chunk down under the other generation's keys and the header last.  A reset part way through leaves the old header and its
+// untouched chunks, so readers still get the whole old value.  Only once the new header is down are the old chunks erased.
+//
+// A writer asked to compress packs each chunk with NVS_Codec when that makes it smaller.  The CRC trailer always covers the unpacked
+// payload.  An unpacked chunk is always exactly its payload plus the trailer, so readers know a packed chunk by its shorter length and
+// need no flag.  Random access still costs one chunk, since each chunk unpacks on its own.
+//
+static void makeChunkKey(char *chunkKey, const char *key, uint8_t generation, uint16_t index)
+{
+    snprintf(chunkKey, NVS_KEY_NAME_MAX_SIZE, "%s%c%02x", key, (generation == 0) ? '.' : '~', index);
+}
+
+static esp_err_t readHeader(nvs_handle_t handle, const char *key, NVS_BLOB_HEADER *header)
+{
+    size_t length = sizeof(NVS_BLOB_HEADER);
+    esp_err_t ret = nvs_get_blob(handle, key, header, &length);
+
+    if (ret != ESP_OK)
+        return ret;
+
+    if ((length != sizeof(NVS_BLOB_HEADER)) || (header->magic != NVS_BLOB_MAGIC) || (header->version != NVS_BLOB_VERSION) ||
+        (header->generation > 1) || (header->chunkSize == 0) || (header->chunkSize > NVS_BLOB_CHUNK_SIZE) ||
+        (header->chunkCount != (header->length + header->chunkSize - 1) / header->chunkSize))
+        return ESP_ERR_INVALID_VERSION;
+
+    return ESP_OK;
+}
+
+/* NVS_BlobWriter */
+NVS_BlobWriter::NVS_BlobWriter(NVS_Session &session, const char *blobKey, bool compressChunks)
+    : handle(session.getHandle()), shadow(session.shadow), compress(compressChunks)
+{
+    if (handle == 0)
+        status = ESP_ERR_NVS_INVALID_HANDLE;
+    else if (strlen(blobKey) > NVS_BLOB_KEY_MAX_LENGTH)
+        status = ESP_ERR_NVS_KEY_TOO_LONG;
+    else
+    {
+        strncpy(key, blobKey, sizeof(key) - 1);
+
+        if (readHeader(handle, key, &oldHeader) != ESP_OK)
+            oldHeader = {};
+        else
+            generation = oldHeader.generation ^ 1;
+    }
+}
+
+esp_err_t NVS_BlobWriter::write(const void *data, size_t dataLength)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+
+    while ((status == ESP_OK) && (dataLength > 0))
+    {
+        size_t count = NVS_BLOB_CHUNK_SIZE - chunkFill;
+
+        if (count > dataLength)
+            count = dataLength;
+
+        memcpy(&chunk[chunkFill], bytes, count);
+        crc = esp_rom_crc32_le(crc, bytes, count);
+        chunkFill += count;
+        length += count;
+        bytes += count;
+        dataLength -= count;
+
+        if (chunkFill == NVS_BLOB_CHUNK_SIZE)
+            status = writeChunk();
+    }
+
+    return status;
+}
+
+esp_err_t NVS_BlobWriter::finish()
+{
+    if ((status == ESP_OK) && (chunkFill > 0))
+        status = writeChunk();
+
+    if (status != ESP_OK)
+        return status;
+
+    NVS_BLOB_HEADER header = {};
+    header.magic = NVS_BLOB_MAGIC;
+    header.version = NVS_BLOB_VERSION;
+    header.generation = generation;
+    header.chunkSize = NVS_BLOB_CHUNK_SIZE;
+    header.length = length;
+    header.crc = crc;
+    header.chunkCount = chunkIndex;
+
+    NVS *nvs = NVS::getInstance();
+    status = nvs_set_blob(handle, key, &header, sizeof(header)); // The switch to the new run
+
+    if (status != ESP_OK)
+        return status;
+
+    NVS_OpTimer::countWrite(sizeof(header));
+    nvs->directoryNote(shadow, key, NVS_TYPE_BLOB, sizeof(header));
+
+    for (uint16_t index = 0; index < oldHeader.chunkCount; index++) // The old run is no longer reachable
+    {
+        char chunkKey[NVS_KEY_NAME_MAX_SIZE];
+        makeChunkKey(chunkKey, key, oldHeader.generation, index);
+
+        if (nvs_erase_key(handle, chunkKey) == ESP_OK)
+            nvs->directoryForget(shadow, chunkKey, NVS_TYPE_BLOB);
+    }
+
+    for (uint16_t index = chunkIndex; index < NVS_BLOB_MAX_CHUNKS; index++) // Chunks past our end left by a rewrite which was cut short
+    {
+        char chunkKey[NVS_KEY_NAME_MAX_SIZE];
+        makeChunkKey(chunkKey, key, generation, index);
+
+        if (nvs_erase_key(handle, chunkKey) != ESP_OK)
+            break;
+        nvs->directoryForget(shadow, chunkKey, NVS_TYPE_BLOB);
+    }
+
+    return status;
+}
+
+esp_err_t NVS_BlobWriter::erase(NVS_Session &session, const char *blobKey)
+{
+    NVS_OpTimer timer(NVS_OP::ERASE);
+    NVS *nvs = NVS::getInstance();
+    NVS_BLOB_HEADER header = {};
+    esp_err_t ret = readHeader(session.getHandle(), blobKey, &header);
+
+    if (ret != ESP_OK)
+        return ret;
+
+    for (uint16_t index = 0; index < header.chunkCount; index++)
+    {
+        char chunkKey[NVS_KEY_NAME_MAX_SIZE];
+        makeChunkKey(chunkKey, blobKey, header.generation, index);
+
+        if (nvs_erase_key(session.getHandle(), chunkKey) == ESP_OK)
+            nvs->directoryForget(session.shadow, chunkKey, NVS_TYPE_BLOB);
+    }
+
+    ret = nvs_erase_key(session.getHandle(), blobKey);
+
+    if (ret == ESP_OK)
+        nvs->directoryForget(session.shadow, blobKey, NVS_TYPE_BLOB);
+    return ret;
+}
+
+esp_err_t NVS_BlobWriter::writeChunk()
+{
+    NVS_OpTimer timer(NVS_OP::WRITE);
+
+    if (chunkIndex >= NVS_BLOB_MAX_CHUNKS)
+    {
+        NVS::getInstance()->routeLogByFormat<LOG_TYPE::ERROR>("%s(): %s exceeds %u chunks", __func__, key, (unsigned)NVS_BLOB_MAX_CHUNKS);
+        return ESP_ERR_NVS_VALUE_TOO_LONG;
+    }
+
+    uint32_t chunkCRC = esp_rom_crc32_le(0, chunk, chunkFill);
+    memcpy(&chunk[chunkFill], &chunkCRC, sizeof(chunkCRC));
+
+    char chunkKey[NVS_KEY_NAME_MAX_SIZE];
+    makeChunkKey(chunkKey, key, generation, chunkIndex);
+
+    uint8_t packed[NVS_BLOB_CHUNK_SIZE + sizeof(uint32_t)];
+    const uint8_t *stored = chunk;
+    size_t storedLength = chunkFill + sizeof(chunkCRC);
+    size_t packedLength = compress ? NVS_Codec::encode(chunk, chunkFill, packed, chunkFill - 1) : 0;
+
+    if (packedLength > 0)
+    {
+        memcpy(&packed[packedLength], &chunkCRC, sizeof(chunkCRC));
+        stored = packed;
+        storedLength = packedLength + sizeof(chunkCRC);
+    }
+
+    esp_err_t ret = nvs_set_blob(handle, chunkKey, stored, storedLength);
+
+    if (ret == ESP_OK)
+    {
+        NVS_OpTimer::countWrite(storedLength);
+        NVS::getInstance()->directoryNote(shadow, chunkKey, NVS_TYPE_BLOB, storedLength);
+        chunkIndex++;
+        chunkFill = 0;
+    }
+    return ret;
+}
+
+/* NVS_BlobReader */
+NVS_BlobReader::NVS_BlobReader(NVS_Session &session, const char *blobKey) : handle(session.getHandle())
+{
+    if (handle == 0)
+        status = ESP_ERR_NVS_INVALID_HANDLE;
+    else if (strlen(blobKey) > NVS_BLOB_KEY_MAX_LENGTH)
+        status = ESP_ERR_NVS_KEY_TOO_LONG;
+    else
+    {
+        strncpy(key, blobKey, sizeof(key) - 1);
+        status = readHeader(handle, key, &header);
+    }
+}
+
+esp_err_t NVS_BlobReader::read(void *buffer, size_t bufferLength, size_t *bytesRead)
+{
+    *bytesRead = 0;
+
+    if (status != ESP_OK)
+        return status;
+
+    size_t count = header.length - position;
+
+    if (count > bufferLength)
+        count = bufferLength;
+
+    esp_err_t ret = readRange(position, buffer, count);
+
+    if (ret == ESP_OK)
+    {
+        position += count;
+        *bytesRead = count;
+    }
+    return ret;
+}
+
+esp_err_t NVS_BlobReader::seek(size_t offset)
+{
+    if (status != ESP_OK)
+        return status;
+
+    if (offset > header.length)
+        return ESP_ERR_INVALID_ARG;
+
+    position = offset;
+    return ESP_OK;
+}
+
+esp_err_t NVS_BlobReader::readRange(size_t offset, void *buffer, size_t rangeLength)
+{
+    if (status != ESP_OK)
+        return status;
+
+    if ((offset > header.length) || (rangeLength > header.length - offset))
+        return ESP_ERR_INVALID_SIZE;
+
+    uint8_t *bytes = (uint8_t *)buffer;
+
+    while (rangeLength > 0)
+    {
+        uint16_t index = offset / header.chunkSize;
+        size_t chunkOffset = offset % header.chunkSize;
+        size_t count = chunkLength(index) - chunkOffset;
+
+        if (count > rangeLength)
+            count = rangeLength;
+
+        esp_err_t ret = loadChunk(index);
+
+        if (ret != ESP_OK)
+        {
+            NVS::getInstance()->routeLogByFormat<LOG_TYPE::ERROR>("%s(): Chunk %u of %s failed, code = %s", __func__, index, key, esp_err_to_name(ret));
+            return ret;
+        }
+
+        memcpy(bytes, &chunk[chunkOffset], count);
+        bytes += count;
+        offset += count;
+        rangeLength -= count;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t NVS_BlobReader::copyTo(NVS_BlobSink &sink)
+{
+    if (status != ESP_OK)
+        return status;
+
+    for (uint16_t index = 0; index < header.chunkCount; index++)
+    {
+        esp_err_t ret = loadChunk(index);
+
+        if (ret != ESP_OK)
+        {
+            NVS::getInstance()->routeLogByFormat<LOG_TYPE::ERROR>("%s(): Chunk %u of %s failed, code = %s", __func__, index, key, esp_err_to_name(ret));
+            return ret;
+        }
+
+        ret = sink.write(chunk, chunkLength(index));
+
+        if (ret != ESP_OK)
+        {
+            NVS::getInstance()->routeLogByFormat<LOG_TYPE::ERROR>("%s(): Sink refused chunk %u of %s, code = %s", __func__, index, key, esp_err_to_name(ret));
+            return ret;
+        }
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t NVS_BlobReader::verify()
+{
+    if (status != ESP_OK)
+        return status;
+
+    uint32_t payloadCRC = 0;
+
+    for (uint16_t index = 0; index < header.chunkCount; index++)
+    {
+        esp_err_t ret = loadChunk(index);
+
+        if (ret != ESP_OK)
+        {
+            NVS::getInstance()->routeLogByFormat<LOG_TYPE::ERROR>("%s(): Chunk %u of %s failed, code = %s", __func__, index, key, esp_err_to_name(ret));
+            return ret;
+        }
+        payloadCRC = esp_rom_crc32_le(payloadCRC, chunk, chunkLength(index));
+    }
+
+    if (payloadCRC != header.crc)
+    {
+        NVS::getInstance()->routeLogByFormat<LOG_TYPE::ERROR>("%s(): %s payload CRC mismatch", __func__, key);
+        return ESP_ERR_INVALID_CRC;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t NVS_BlobReader::loadChunk(uint16_t index)
+{
+    if (loadedChunk == index) // Sequential reads stay inside the chunk we already hold
+        return ESP_OK;
+
+    if (index >= header.chunkCount)
+        return ESP_ERR_INVALID_SIZE;
+
+    NVS_OpTimer timer(NVS_OP::READ);
+
+    char chunkKey[NVS_KEY_NAME_MAX_SIZE];
+    makeChunkKey(chunkKey, key, header.generation, index);
+    loadedChunk = -1; // The buffer is about to be overwritten
+
+    size_t expected = chunkLength(index);
+    size_t stored = sizeof(chunk);
+    esp_err_t ret = nvs_get_blob(handle, chunkKey, chunk, &stored);
+
+    if (ret != ESP_OK)
+        return ret;
+
+    uint32_t chunkCRC = 0;
+
+    if ((stored > sizeof(chunkCRC)) && (stored < expected + sizeof(chunkCRC))) // Packed by the writer
+    {
+        uint8_t packed[NVS_BLOB_CHUNK_SIZE];
+        size_t packedLength = stored - sizeof(chunkCRC);
+
+        memcpy(packed, chunk, packedLength);
+        memcpy(&chunkCRC, &chunk[packedLength], sizeof(chunkCRC));
+
+        if ((NVS_Codec::decode(packed, packedLength, chunk, expected) != ESP_OK) || (chunkCRC != esp_rom_crc32_le(0, chunk, expected)))
+            return ESP_ERR_INVALID_CRC;
+
+        loadedChunk = index;
+        return ESP_OK;
+    }
+
+    if (stored == expected + sizeof(chunkCRC))
+        memcpy(&chunkCRC, &chunk[expected], sizeof(chunkCRC));
+
+    if ((stored != expected + sizeof(chunkCRC)) || (chunkCRC != esp_rom_crc32_le(0, chunk, expected)))
+        return ESP_ERR_INVALID_CRC;
+
+    loadedChunk = index;
+    return ESP_OK;
+}
+
+size_t NVS_BlobReader::chunkLength(uint16_t index) const
+{
+    size_t start = (size_t)index * header.chunkSize;
+
+    if (start >= header.length)
+        return 0;
+
+    return ((header.length - start) < header.chunkSize) ? (header.length - start) : header.chunkSize;
+}
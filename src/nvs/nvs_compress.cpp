@@ -0,0 +1,506 @@
+#include "nvs/nvs_.hpp"
+#include "system_.hpp"
+
+#include "esp_rom_crc.h"
+#include "esp_timer.h"
+
+#include <string.h>
+//
+// Compressed strings and blob chunks.
+//
+// JSON scene definitions and schedules repeat themselves a great deal, and stored verbatim they use up entries quickly.  A key set up
+// with enableCompression() keeps its string as a blob led by an NVS_PACKED_HEADER.  The string functions check for such keys before they
+// go to flash, so callers read and write them exactly as before.  The shadow, the key directory and change notifications all keep working
+// on the plain text.
+//
+// The codec is LZF: literal runs and back references of up to 264 bytes within an 8 KB window.  The encoder's only state is a 256 entry
+// match table on the stack, and the decoder needs nothing beyond its output.  Anything the encoder can't make smaller is stored as it is,
+// as are strings shorter than NVS_COMPRESS_MIN_LENGTH, so a value never grows by more than its 8 byte header.
+//
+// A compressed string is a single blob, and nvs_get_blob() / nvs_set_blob() only move a blob whole.  So compressed strings are capped at
+// NVS_COMPRESS_MAX_LENGTH, and every one is packed and unpacked in the two static buffers below, one string at a time under
+// semNVSCompress.  Nothing is allocated beyond the caller's own std::string.  Longer values belong in an NVS_BlobWriter with compress set,
+// which packs one NVS_BLOB_CHUNK_SIZE chunk at a time in its own member buffer.
+//
+// A plain string written before its key was set to compress is still read.  The first compressed write of that key in each boot looks
+// for it and replaces it the way NVS_Migrator::convert() does: the packed value goes under NVS_COMPRESS_STAGE_VALUE and the key's name
+// under NVS_COMPRESS_STAGE_KEY, then the string is erased, the blob written and the stage dropped.  A reset part way through leaves the
+// value readable from the stage, and the next compressed write in that namespace finishes the job.
+//
+extern SemaphoreHandle_t semNVSCompress;
+
+static uint8_t packedBuffer[sizeof(NVS_PACKED_HEADER) + NVS_COMPRESS_MAX_LENGTH]; // The blob as it is stored
+static char textBuffer[NVS_COMPRESS_MAX_LENGTH];                                  // A read's text until it is known to be good
+
+static NVS_COMPRESSION_STATS compressionStats = {};
+static portMUX_TYPE compressionMux = portMUX_INITIALIZER_UNLOCKED;
+
+constexpr size_t LZF_MAX_LITERAL = 32;
+constexpr size_t LZF_MAX_OFFSET = 8192;
+constexpr size_t LZF_MAX_MATCH = 264; // 7 in the control byte, 255 in the extension byte, plus the 2 every match implies
+
+static uint16_t matchHash(const uint8_t *bytes)
+{
+    uint32_t value = ((uint32_t)bytes[0] << 16) | ((uint32_t)bytes[1] << 8) | bytes[2];
+    return (uint16_t)(((value * 2654435761u) >> 16) % NVS_COMPRESS_HASH_SIZE);
+}
+
+/* NVS_Codec */
+size_t NVS_Codec::encode(const uint8_t *in, size_t inLength, uint8_t *out, size_t outMax)
+{
+    int64_t start = esp_timer_get_time();
+    size_t op = 0;
+    bool fits = (outMax > 0);
+
+    if ((inLength >= NVS_COMPRESS_MIN_LENGTH) && (inLength <= UINT16_MAX) && fits)
+    {
+        uint16_t table[NVS_COMPRESS_HASH_SIZE] = {}; // Position + 1 of the last time each hash was seen
+        size_t ip = 0;
+        size_t literals = 0;
+        size_t control = op++; // Reserved for the literal run which follows
+
+        while (fits && (ip < inLength))
+        {
+            size_t ref = 0;
+            size_t offset = 0;
+            bool match = false;
+
+            if (ip + 2 < inLength)
+            {
+                uint16_t hash = matchHash(&in[ip]);
+                ref = table[hash];
+                table[hash] = (uint16_t)(ip + 1);
+
+                if (ref != 0)
+                {
+                    ref--;
+                    offset = ip - ref - 1;
+                    match = (offset < LZF_MAX_OFFSET) && (memcmp(&in[ref], &in[ip], 3) == 0);
+                }
+            }
+
+            if (match)
+            {
+                size_t length = 3;
+                size_t maxLength = (inLength - ip < LZF_MAX_MATCH) ? inLength - ip : LZF_MAX_MATCH;
+
+                while ((length < maxLength) && (in[ref + length] == in[ip + length]))
+                    length++;
+
+                if (literals > 0) // Close the run in front of us, or give back the control byte nobody used
+                    out[control] = (uint8_t)(literals - 1);
+                else
+                    op--;
+
+                size_t code = length - 2;
+
+                if (op + ((code < 7) ? 2 : 3) > outMax)
+                {
+                    fits = false;
+                    break;
+                }
+
+                if (code < 7)
+                    out[op++] = (uint8_t)((code << 5) | (offset >> 8));
+                else
+                {
+                    out[op++] = (uint8_t)((7 << 5) | (offset >> 8));
+                    out[op++] = (uint8_t)(code - 7);
+                }
+                out[op++] = (uint8_t)offset;
+
+                for (size_t k = 1; (k < length) && (ip + k + 2 < inLength); k++) // Later matches may start inside this one
+                    table[matchHash(&in[ip + k])] = (uint16_t)(ip + k + 1);
+
+                ip += length;
+                literals = 0;
+                control = op++;
+            }
+            else
+            {
+                if (op >= outMax)
+                {
+                    fits = false;
+                    break;
+                }
+
+                out[op++] = in[ip++];
+
+                if (++literals == LZF_MAX_LITERAL)
+                {
+                    out[control] = (uint8_t)(literals - 1);
+                    literals = 0;
+                    control = op++;
+                }
+            }
+        }
+
+        if (fits)
+        {
+            if (literals > 0)
+                out[control] = (uint8_t)(literals - 1);
+            else
+                op--;
+        }
+    }
+
+    size_t result = (fits && (inLength >= NVS_COMPRESS_MIN_LENGTH) && (inLength <= UINT16_MAX)) ? op : 0;
+    uint32_t micros = (uint32_t)(esp_timer_get_time() - start);
+
+    portENTER_CRITICAL(&compressionMux);
+    compressionStats.bytesIn += inLength;
+    compressionStats.bytesOut += (result > 0) ? result : inLength;
+    compressionStats.encodeMicros += micros;
+
+    if (result > 0)
+        compressionStats.encoded++;
+    else
+        compressionStats.storedRaw++;
+    portEXIT_CRITICAL(&compressionMux);
+
+    return result;
+}
+
+esp_err_t NVS_Codec::decode(const uint8_t *in, size_t inLength, uint8_t *out, size_t outLength)
+{
+    int64_t start = esp_timer_get_time();
+    esp_err_t ret = ESP_OK;
+    size_t ip = 0;
+    size_t op = 0;
+
+    while ((ip < inLength) && (ret == ESP_OK))
+    {
+        uint8_t control = in[ip++];
+
+        if (control < LZF_MAX_LITERAL) // A run of control + 1 literals
+        {
+            size_t count = control + 1;
+
+            if ((ip + count > inLength) || (op + count > outLength))
+                ret = ESP_ERR_INVALID_SIZE;
+            else
+            {
+                memcpy(&out[op], &in[ip], count);
+                ip += count;
+                op += count;
+            }
+            continue;
+        }
+
+        size_t length = control >> 5;
+
+        if ((length == 7) && (ip < inLength))
+            length += in[ip++];
+
+        if (ip >= inLength)
+        {
+            ret = ESP_ERR_INVALID_SIZE;
+            break;
+        }
+
+        length += 2;
+        size_t offset = ((size_t)(control & 0x1F) << 8) + in[ip++] + 1;
+
+        if ((offset > op) || (op + length > outLength))
+            ret = ESP_ERR_INVALID_SIZE;
+        else
+        {
+            for (size_t k = 0; k < length; k++, op++) // Byte by byte, since a reference may overlap what it produces
+                out[op] = out[op - offset];
+        }
+    }
+
+    if ((ret == ESP_OK) && (op != outLength))
+        ret = ESP_ERR_INVALID_SIZE;
+
+    uint32_t micros = (uint32_t)(esp_timer_get_time() - start);
+
+    portENTER_CRITICAL(&compressionMux);
+    compressionStats.decoded++;
+    compressionStats.decodeMicros += micros;
+    portEXIT_CRITICAL(&compressionMux);
+
+    return ret;
+}
+
+/* Public Member Functions */
+esp_err_t NVS::enableCompression(const char *name_space, const char *key)
+{
+    if (strlen(key) >= NVS_KEY_NAME_MAX_SIZE)
+        return ESP_ERR_NVS_KEY_TOO_LONG;
+
+    if (findShadow(name_space) == nullptr)
+        ESP_RETURN_ON_ERROR(enableShadowCache(name_space, 0), TAG, "enableShadowCache() failed..."); // No budget.  Only the key list is kept.
+
+    SemaphoreHandle_t lock = namespaceLock(name_space); // The key list is read under this lock
+    xSemaphoreTakeRecursive(lock, portMAX_DELAY);
+
+    NVS_SHADOW *shadow = findShadow(name_space);
+
+    if ((shadow != nullptr) && !isCompressed(shadow, key))
+    {
+        NVS_COMPRESSED_KEY compressedKey = {};
+        strncpy(compressedKey.key, key, NVS_KEY_NAME_MAX_SIZE - 1);
+        shadow->compressed.push_back(compressedKey);
+    }
+
+    xSemaphoreGiveRecursive(lock);
+    return (shadow == nullptr) ? ESP_ERR_NOT_FOUND : ESP_OK;
+}
+
+esp_err_t NVS::getCompressionStats(NVS_COMPRESSION_STATS *stats)
+{
+    portENTER_CRITICAL(&compressionMux);
+    *stats = compressionStats;
+    portEXIT_CRITICAL(&compressionMux);
+    return ESP_OK;
+}
+
+void NVS::resetCompressionStats()
+{
+    portENTER_CRITICAL(&compressionMux);
+    compressionStats = {};
+    portEXIT_CRITICAL(&compressionMux);
+}
+
+/* Private Member Functions */
+bool NVS::isCompressed(NVS_SHADOW *shadow, const char *key)
+{
+    if ((shadow == nullptr) || shadow->compressed.empty())
+        return false;
+
+    for (const auto &compressedKey : shadow->compressed)
+        if (strncmp(compressedKey.key, key, NVS_KEY_NAME_MAX_SIZE) == 0)
+            return true;
+    return false;
+}
+
+esp_err_t NVS::readCompressedString(nvs_handle_t handle, NVS_SHADOW *shadow, const char *key, std::string *strValue)
+{
+    size_t length = 0;
+    esp_err_t ret = ESP_ERR_NVS_NOT_FOUND;
+
+    if (directoryMayHold(shadow, key, NVS_TYPE_BLOB, &length))
+        ret = (length != 0) ? ESP_OK : nvs_get_blob(handle, key, nullptr, &length);
+
+    const char *source = key; // Where the packed value is read from
+
+    if (ret == ESP_ERR_NVS_NOT_FOUND) // Perhaps still the plain string it was before the key was set to compress
+    {
+        length = 0;
+
+        if (directoryMayHold(shadow, key, NVS_TYPE_STR, &length))
+            ret = (length != 0) ? ESP_OK : nvs_get_str(handle, key, nullptr, &length);
+
+        if (ret == ESP_OK)
+        {
+            std::string text(length - 1, 0);
+            ret = nvs_get_str(handle, key, text.data(), &length);
+
+            if (ret == ESP_OK)
+                strValue->swap(text);
+            return ret;
+        }
+
+        if ((ret != ESP_ERR_NVS_NOT_FOUND) || !compressStaged(handle, shadow, key)) // Or a conversion a reset cut short
+            return ret;
+
+        source = NVS_COMPRESS_STAGE_VALUE;
+        ret = nvs_get_blob(handle, source, nullptr, &length);
+    }
+
+    if (ret != ESP_OK)
+        return ret;
+
+    if (length < sizeof(NVS_PACKED_HEADER))
+        return ESP_ERR_INVALID_VERSION;
+
+    if (length > sizeof(packedBuffer))
+        return ESP_ERR_INVALID_SIZE;
+
+    xSemaphoreTake(semNVSCompress, portMAX_DELAY);
+    ret = nvs_get_blob(handle, source, packedBuffer, &length);
+
+    if (ret != ESP_OK)
+    {
+        xSemaphoreGive(semNVSCompress);
+        return ret;
+    }
+
+    NVS_PACKED_HEADER header;
+    memcpy(&header, packedBuffer, sizeof(header));
+
+    const uint8_t *data = &packedBuffer[sizeof(header)];
+    size_t dataLength = length - sizeof(header);
+
+    if (header.magic != NVS_COMPRESS_MAGIC)
+        ret = ESP_ERR_INVALID_VERSION;
+    else if (header.length > NVS_COMPRESS_MAX_LENGTH)
+        ret = ESP_ERR_INVALID_SIZE;
+    else if (header.codec == (uint8_t)NVS_CODEC::LZF)
+        ret = NVS_Codec::decode(data, dataLength, (uint8_t *)textBuffer, header.length);
+    else if (header.codec != (uint8_t)NVS_CODEC::STORED)
+        ret = ESP_ERR_INVALID_VERSION;
+    else if (dataLength != header.length)
+        ret = ESP_ERR_INVALID_SIZE;
+    else
+        memcpy(textBuffer, data, dataLength);
+
+    if ((ret == ESP_OK) && (esp_rom_crc32_le(0, (const uint8_t *)textBuffer, header.length) != header.crc))
+        ret = ESP_ERR_INVALID_CRC;
+
+    if (ret == ESP_OK)
+        strValue->assign(textBuffer, header.length); // Reuses whatever capacity the caller's string already has
+
+    xSemaphoreGive(semNVSCompress);
+
+    if (ret != ESP_OK)
+        routeLogByFormat<LOG_TYPE::ERROR>("%s(): Compressed string %s is unreadable, code = %s", __func__, key, esp_err_to_name(ret));
+    return ret;
+}
+
+esp_err_t NVS::writeCompressedString(nvs_handle_t handle, NVS_SHADOW *shadow, const char *key, const char *value)
+{
+    size_t length = strlen(value);
+
+    if (length > NVS_COMPRESS_MAX_LENGTH)
+        return ESP_ERR_NVS_VALUE_TOO_LONG;
+
+    esp_err_t ret = ESP_OK;
+    NVS_COMPRESSED_KEY *replacing = nullptr; // Set while a plain string left from before is still stored
+
+    for (auto &compressedKey : shadow->compressed) // Once per boot
+    {
+        if ((strncmp(compressedKey.key, key, NVS_KEY_NAME_MAX_SIZE) != 0) || compressedKey.checked)
+            continue;
+
+        size_t plainLength = 0;
+        ret = resumeCompressStage(handle, shadow); // The stage is about to be reused
+
+        if (ret != ESP_OK)
+            return ret;
+
+        if (directoryMayHold(shadow, key, NVS_TYPE_STR) && (nvs_get_str(handle, key, nullptr, &plainLength) == ESP_OK))
+            replacing = &compressedKey; // Only marked checked once the string is gone, so a failed attempt is tried again
+        else
+            compressedKey.checked = true;
+        break;
+    }
+
+    NVS_PACKED_HEADER header = {NVS_COMPRESS_MAGIC, (uint8_t)NVS_CODEC::LZF, (uint16_t)length, esp_rom_crc32_le(0, (const uint8_t *)value, length)};
+
+    xSemaphoreTake(semNVSCompress, portMAX_DELAY);
+    size_t dataLength = (length > 0) ? NVS_Codec::encode((const uint8_t *)value, length, &packedBuffer[sizeof(header)], length - 1) : 0;
+
+    if (dataLength == 0) // Doesn't pay.  The plain text is the most we ever store.
+    {
+        header.codec = (uint8_t)NVS_CODEC::STORED;
+        memcpy(&packedBuffer[sizeof(header)], value, length);
+        dataLength = length;
+    }
+
+    memcpy(packedBuffer, &header, sizeof(header));
+
+    if (replacing != nullptr) // Stage first, so a reset between the erase and the write below loses nothing
+    {
+        ret = nvs_set_blob(handle, NVS_COMPRESS_STAGE_VALUE, packedBuffer, sizeof(header) + dataLength);
+
+        if (ret == ESP_OK)
+            ret = nvs_set_str(handle, NVS_COMPRESS_STAGE_KEY, key);
+
+        if (ret != ESP_OK) // The plain string is still there and still read
+        {
+            xSemaphoreGive(semNVSCompress);
+            return ret;
+        }
+
+        directoryNote(shadow, NVS_COMPRESS_STAGE_VALUE, NVS_TYPE_BLOB, sizeof(header) + dataLength);
+        directoryNote(shadow, NVS_COMPRESS_STAGE_KEY, NVS_TYPE_STR, strlen(key) + 1);
+
+        size_t plainLength = 0;
+
+        for (uint8_t tries = 0; (tries < 2) && (nvs_get_str(handle, key, nullptr, &plainLength) == ESP_OK); tries++)
+        {
+            nvs_erase_key(handle, key); // Erases whichever type it finds first.  A blob erased by mistake is rewritten just below.
+            directoryForget(shadow, key, NVS_TYPE_STR);
+            directoryForget(shadow, key, NVS_TYPE_BLOB);
+        }
+    }
+
+    ret = nvs_set_blob(handle, key, packedBuffer, sizeof(header) + dataLength);
+    xSemaphoreGive(semNVSCompress);
+
+    if (ret == ESP_OK)
+    {
+        directoryForget(shadow, key, NVS_TYPE_STR); // shadowStore() noted the plain text
+        directoryNote(shadow, key, NVS_TYPE_BLOB, sizeof(header) + dataLength);
+    }
+
+    if ((ret == ESP_OK) && (replacing != nullptr))
+    {
+        dropCompressStage(handle, shadow);
+        replacing->checked = true;
+    }
+    return ret;
+}
+
+bool NVS::compressStaged(nvs_handle_t handle, NVS_SHADOW *shadow, const char *key)
+{
+    char name[NVS_KEY_NAME_MAX_SIZE];
+    size_t length = sizeof(name);
+
+    if (!directoryMayHold(shadow, NVS_COMPRESS_STAGE_KEY, NVS_TYPE_STR) || (nvs_get_str(handle, NVS_COMPRESS_STAGE_KEY, name, &length) != ESP_OK))
+        return false;
+    return strncmp(name, key, NVS_KEY_NAME_MAX_SIZE) == 0;
+}
+
+// Finishes a conversion a reset cut short.  Only when neither the plain string nor the blob made it is the staged value written back.
+// Otherwise the stage is stale and only dropped.
+esp_err_t NVS::resumeCompressStage(nvs_handle_t handle, NVS_SHADOW *shadow)
+{
+    char name[NVS_KEY_NAME_MAX_SIZE];
+    size_t length = sizeof(name);
+
+    if (!directoryMayHold(shadow, NVS_COMPRESS_STAGE_KEY, NVS_TYPE_STR) || (nvs_get_str(handle, NVS_COMPRESS_STAGE_KEY, name, &length) != ESP_OK))
+        return ESP_OK; // Nothing part way through
+
+    size_t plainLength = 0;
+    size_t blobLength = 0;
+    esp_err_t ret = ESP_OK;
+
+    if ((nvs_get_str(handle, name, nullptr, &plainLength) == ESP_ERR_NVS_NOT_FOUND) && (nvs_get_blob(handle, name, nullptr, &blobLength) == ESP_ERR_NVS_NOT_FOUND))
+    {
+        blobLength = sizeof(packedBuffer); // A staged value is never longer
+
+        xSemaphoreTake(semNVSCompress, portMAX_DELAY);
+        ret = nvs_get_blob(handle, NVS_COMPRESS_STAGE_VALUE, packedBuffer, &blobLength);
+
+        if (ret == ESP_OK)
+            ret = nvs_set_blob(handle, name, packedBuffer, blobLength);
+        xSemaphoreGive(semNVSCompress);
+
+        if (ret == ESP_OK)
+            directoryNote(shadow, name, NVS_TYPE_BLOB, blobLength);
+    }
+
+    if (ret == ESP_OK)
+        dropCompressStage(handle, shadow);
+    else
+        routeLogByFormat<LOG_TYPE::ERROR>("%s(): Unable to finish compressing %s, code = %s", __func__, name, esp_err_to_name(ret));
+    return ret;
+}
+
+void NVS::dropCompressStage(nvs_handle_t handle, NVS_SHADOW *shadow)
+{
+    nvs_erase_key(handle, NVS_COMPRESS_STAGE_KEY); // The name goes first, so the value is never read without it
+    nvs_erase_key(handle, NVS_COMPRESS_STAGE_VALUE);
+    directoryForget(shadow, NVS_COMPRESS_STAGE_KEY, NVS_TYPE_STR);
+    directoryForget(shadow, NVS_COMPRESS_STAGE_VALUE, NVS_TYPE_BLOB);
+}
+
+esp_err_t NVS::storeString(nvs_handle_t handle, NVS_SHADOW *shadow, const char *key, const char *value)
+{
+    if (isCompressed(shadow, key))
+        return writeCompressedString(handle, shadow, key, value);
+    return nvs_set_str(handle, key, value);
+}
@@ -1,7 +1,248 @@
 #include "nvs/nvs_.hpp"
 #include "system_.hpp"
 
+#include <stdio.h>
+#include <string.h>
+
+extern SemaphoreHandle_t semNVSShadowTable;
+
+static const char *typeName(nvs_type_t type)
+{
+    switch (type)
+    {
+    case NVS_TYPE_U8:
+        return "u8";
+    case NVS_TYPE_I8:
+        return "i8";
+    case NVS_TYPE_U16:
+        return "u16";
+    case NVS_TYPE_I16:
+        return "i16";
+    case NVS_TYPE_U32:
+        return "u32";
+    case NVS_TYPE_I32:
+        return "i32";
+    case NVS_TYPE_U64:
+        return "u64";
+    case NVS_TYPE_I64:
+        return "i64";
+    case NVS_TYPE_STR:
+        return "str";
+    case NVS_TYPE_BLOB:
+        return "blob";
+    default:
+        return "?";
+    }
+}
+
+static uint16_t entrySpan(const NVS_ENTRY &entry) // Flash entries (32 bytes each) an item occupies
+{
+    if (entry.type == NVS_TYPE_STR)
+        return 1 + (entry.size + 31) / 32;
+    if (entry.type == NVS_TYPE_BLOB) // Blob index plus one data header.  Blobs which cross a page need a header per page, so this is a floor.
+        return 2 + (entry.size + 31) / 32;
+    return 1;
+}
+
+/* NVS_Iterator */
+NVS_Iterator::NVS_Iterator(const char *partitionName, const char *name_space, nvs_type_t type) : partition(partitionName)
+{
+    NVS::getInstance()->waitForInit();
+    status = nvs_entry_find(partition, name_space, type, &iterator); // ESP_ERR_NVS_NOT_FOUND here simply means there is nothing to walk
+}
+
+NVS_Iterator::~NVS_Iterator()
+{
+    nvs_release_iterator(iterator); // Safe on nullptr
+    if (sizeHandle != 0)
+        nvs_close(sizeHandle);
+}
+
+bool NVS_Iterator::next(NVS_ENTRY *entry)
+{
+    if (started && (status == ESP_OK))
+        status = nvs_entry_next(&iterator); // Releases the iterator and sets it to nullptr at the end
+
+    started = true;
+
+    if (status != ESP_OK)
+        return false;
+
+    nvs_entry_info(iterator, &info);
+
+    entry->name_space = info.namespace_name;
+    entry->key = info.key;
+    entry->type = info.type;
+    entry->size = entrySize();
+    return true;
+}
+
+size_t NVS_Iterator::entrySize()
+{
+    if ((info.type != NVS_TYPE_STR) && (info.type != NVS_TYPE_BLOB))
+        return info.type & 0x0F; // The low nibble of an integer type is its width in bytes
+
+    if (strncmp(sizeNamespace, info.namespace_name, sizeof(sizeNamespace)) != 0) // Entries of one namespace usually arrive together
+    {
+        if (sizeHandle != 0)
+            nvs_close(sizeHandle);
+
+        sizeHandle = 0;
+        strncpy(sizeNamespace, info.namespace_name, sizeof(sizeNamespace) - 1);
+
+        if (nvs_open_from_partition(partition, sizeNamespace, NVS_READONLY, &sizeHandle) != ESP_OK)
+            sizeHandle = 0;
+    }
+
+    size_t length = 0;
+
+    if (sizeHandle != 0)
+    {
+        if (info.type == NVS_TYPE_STR)
+            nvs_get_str(sizeHandle, info.key, nullptr, &length);
+        else
+            nvs_get_blob(sizeHandle, info.key, nullptr, &length);
+    }
+    return length;
+}
+
+/* NVS Member Functions */
+esp_err_t NVS::getUsageReport(NVS_USAGE_REPORT *report, const char *partition)
+{
+    memset(report, 0, sizeof(NVS_USAGE_REPORT));
+    waitForInit();
+
+    esp_err_t ret = nvs_get_stats(partition, &report->stats);
+
+    if (ret != ESP_OK)
+        return ret;
+
+    NVS_Iterator it(partition);
+    NVS_ENTRY entry;
+
+    while (it.next(&entry))
+    {
+        NVS_NAMESPACE_USAGE *usage = nullptr;
+
+        for (uint8_t i = 0; i < report->namespaceCount; i++)
+        {
+            if (strncmp(report->namespaces[i].name_space, entry.name_space, NVS_KEY_NAME_MAX_SIZE) == 0)
+            {
+                usage = &report->namespaces[i];
+                break;
+            }
+        }
+
+        if (usage == nullptr)
+        {
+            if (report->namespaceCount == NVS_REPORT_MAX_NAMESPACES)
+            {
+                report->truncated = true;
+                continue;
+            }
+
+            usage = &report->namespaces[report->namespaceCount++];
+            strncpy(usage->name_space, entry.name_space, NVS_KEY_NAME_MAX_SIZE - 1);
+        }
+
+        usage->keys++;
+        usage->entries += entrySpan(entry);
+        usage->bytes += entry.size;
+    }
+
+    return (it.getStatus() == ESP_ERR_NVS_NOT_FOUND) ? ESP_OK : it.getStatus();
+}
+
+// The report goes straight to the console with printf().  It is only ever asked for on purpose, so it mustn't depend on our log level,
+// which stays at ESP_LOG_ERROR unless a show flag is set.
 void NVS::printNVS()
 {
-    // We intend to write a full routine that interates through all NVS storage and prints it all out.
-}
\ No newline at end of file
+    const char *labels[NVS_MAX_PARTITIONS + 1] = {NVS_DEFAULT_PART_NAME};
+    uint8_t labelCount = 1;
+
+    for (uint8_t i = 0; i < partitionCount; i++) // Every partition namespaces are routed to
+        labels[labelCount++] = partitions[i];
+
+    for (uint8_t part = 0; part < labelCount; part++)
+    {
+        NVS_USAGE_REPORT report;
+        esp_err_t ret = getUsageReport(&report, labels[part]);
+
+        if (ret != ESP_OK)
+        {
+            routeLogByFormat<LOG_TYPE::ERROR>("%s(): Usage report of %s failed, code = %s", __func__, labels[part], esp_err_to_name(ret));
+            continue;
+        }
+
+        printf("%s entries used %u free %u available %u total %u in %u namespaces\n", labels[part], (unsigned)report.stats.used_entries,
+               (unsigned)report.stats.free_entries, (unsigned)report.stats.available_entries, (unsigned)report.stats.total_entries,
+               (unsigned)report.stats.namespace_count);
+
+        for (uint8_t i = 0; i < report.namespaceCount; i++)
+            printf("  %s keys %u entries %u bytes %u\n", report.namespaces[i].name_space, report.namespaces[i].keys, report.namespaces[i].entries,
+                   (unsigned)report.namespaces[i].bytes);
+
+        if (report.truncated)
+            printf("  More than %u namespaces, the list above is incomplete\n", (unsigned)NVS_REPORT_MAX_NAMESPACES);
+    }
+
+    NVS_STATS stats;
+
+    if (getStats(&stats) == ESP_OK) // Only when built with NVS_INSTRUMENTATION
+    {
+        static const char *opNames[] = {"read", "write", "skipped", "commit", "open", "close", "erase"};
+        static_assert(sizeof(opNames) / sizeof(opNames[0]) == (uint8_t)NVS_OP::COUNT, "opNames must match NVS_OP");
+
+        printf("Flash writes %u bytes %llu\n", (unsigned)stats.flashWrites, (unsigned long long)stats.bytesWritten);
+
+        for (uint8_t op = 0; op < (uint8_t)NVS_OP::COUNT; op++)
+        {
+            const NVS_OP_STATS &opStats = stats.ops[op];
+
+            if (opStats.count == 0)
+                continue;
+
+            printf("  %s count %u avg %lluus max %uus buckets", opNames[op], (unsigned)opStats.count, (unsigned long long)(opStats.totalMicros / opStats.count),
+                   (unsigned)opStats.maxMicros);
+
+            for (uint8_t bucket = 0; bucket < NVS_LATENCY_BUCKETS; bucket++)
+                printf(" %u", (unsigned)opStats.buckets[bucket]);
+            printf("\n");
+        }
+    }
+
+    char names[NVS_SHADOW_MAX_NAMESPACES][NVS_KEY_NAME_MAX_SIZE] = {};
+    uint8_t shadowCount = 0;
+
+    xSemaphoreTake(semNVSShadowTable, portMAX_DELAY); // Copy the names.  We can't hold the table while we wait on namespace locks.
+
+    for (auto slot : shadows)
+        if (slot != nullptr)
+            memcpy(names[shadowCount++], slot->name_space, NVS_KEY_NAME_MAX_SIZE);
+
+    xSemaphoreGive(semNVSShadowTable);
+
+    for (uint8_t i = 0; i < shadowCount; i++) // Every key written through a shadow keeps its own counters
+    {
+        SemaphoreHandle_t lock = namespaceLock(names[i]);
+        xSemaphoreTakeRecursive(lock, portMAX_DELAY);
+
+        NVS_SHADOW *shadow = findShadow(names[i]); // Looked up again under the lock.  It may have been disabled since we copied its name.
+
+        if (shadow != nullptr)
+            for (const auto &policy : shadow->policies)
+                printf("%s:%s flash writes %u changes %u deferred %u\n", shadow->name_space, policy.key, (unsigned)policy.stats.flashWrites,
+                       (unsigned)policy.stats.changes, (unsigned)policy.stats.deferred);
+
+        xSemaphoreGiveRecursive(lock);
+    }
+
+    for (uint8_t part = 0; part < labelCount; part++)
+    {
+        NVS_Iterator it(labels[part]);
+        NVS_ENTRY entry;
+
+        while (it.next(&entry))
+            printf("%s/%s:%s %s %u bytes\n", labels[part], entry.name_space, entry.key, typeName(entry.type), (unsigned)entry.size);
+    }
+}
@@ -0,0 +1,256 @@
+#include "nvs/nvs_.hpp"
+#include "system_.hpp"
+
+#include <algorithm>
+#include <string.h>
+//
+// A key directory is an optional list of every key stored in a namespace, held with its shadow.  It is built with one walk of the
+// namespace when the namespace is attached, and after that our own writes keep it current.  Each key costs 8 bytes: a 32 bit hash, its
+// type and its length.
+//
+// The read-with-default functions ask the directory before they go to flash.  A key it doesn't hold is certainly not stored, so the failed
+// nvs_get_* is skipped and the default is written straight away.  A key it does hold is read from flash as before.  A hash shared by two
+// keys can only send a read to flash for nothing, never skip one which was needed.  For the same reason an erase never removes an entry,
+// since the entry may also stand for another key which is still stored.  It marks the entry instead, and a marked entry is checked
+// against flash until the next rebuild.  A stale entry costs no more than a lookup.
+//
+// Keys written through a raw handle (NVS_Session::getHandle()) bypass the directory.  Call enableKeyDirectory() only for namespaces
+// which are written through this component.
+//
+static uint32_t keyHash(const char *key)
+{
+    uint32_t hash = 2166136261; // FNV-1a
+
+    for (const char *c = key; (*c != 0) && (c < key + NVS_KEY_NAME_MAX_SIZE); c++)
+        hash = (hash ^ (uint8_t)*c) * 16777619;
+
+    return hash;
+}
+
+static bool hashLess(const NVS_DIRECTORY_ENTRY &entry, uint32_t hash)
+{
+    return entry.hash < hash;
+}
+
+/* Public Member Functions */
+esp_err_t NVS::enableKeyDirectory(const char *name_space)
+{
+    if (findShadow(name_space) == nullptr)
+        ESP_RETURN_ON_ERROR(enableShadowCache(name_space, 0), TAG, "enableShadowCache() failed..."); // No budget.  Only the directory is kept.
+
+    SemaphoreHandle_t lock = namespaceLock(name_space); // The directory is read under this lock
+    xSemaphoreTakeRecursive(lock, portMAX_DELAY);
+
+    NVS_SHADOW *shadow = findShadow(name_space);
+
+    if ((shadow != nullptr) && !shadow->directory.enabled)
+    {
+        shadow->directory.enabled = true;
+        shadow->directory.built = false; // Built on the next open
+    }
+
+    xSemaphoreGiveRecursive(lock);
+    return (shadow == nullptr) ? ESP_ERR_NOT_FOUND : ESP_OK;
+}
+
+esp_err_t NVS::findKey(const char *key, nvs_type_t *type, size_t *length)
+{
+    return findKey(nvsHandle, activeShadow, key, type, length);
+}
+
+/* Private Member Functions */
+// A type other than NVS_TYPE_ANY on entry limits the search to that type.  The type found and the length are handed back when asked for.
+esp_err_t NVS::findKey(nvs_handle_t handle, NVS_SHADOW *shadow, const char *key, nvs_type_t *type, size_t *length)
+{
+    if (handle == 0)
+    {
+        routeLogByFormat<LOG_TYPE::ERROR>("%s(): You must openNVSStorage() first!", __func__);
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    }
+
+    nvs_type_t wanted = (type == nullptr) ? NVS_TYPE_ANY : *type;
+    nvs_type_t found = NVS_TYPE_ANY;
+    size_t foundLength = NVS_DIRECTORY_LONG_VALUE;
+    bool answered = false; // By the directory alone
+
+    if ((shadow != nullptr) && shadow->directory.built)
+    {
+        auto &entries = shadow->directory.entries;
+        uint32_t hash = keyHash(key);
+        bool erased = false;
+
+        for (auto it = std::lower_bound(entries.begin(), entries.end(), hash, hashLess); (it != entries.end()) && (it->hash == hash); ++it)
+        {
+            if ((wanted == NVS_TYPE_ANY) || (it->type == wanted))
+            {
+                if (it->erased) // Gone, unless another key shares the entry.  Only flash can say.
+                {
+                    erased = true;
+                    continue;
+                }
+
+                found = (nvs_type_t)it->type;
+                foundLength = it->length;
+                break;
+            }
+        }
+
+        if ((found == NVS_TYPE_ANY) && !erased)
+        {
+            shadow->stats.directorySkips++;
+            return ESP_ERR_NVS_NOT_FOUND;
+        }
+
+        answered = (found != NVS_TYPE_ANY);
+    }
+
+    if (!answered)
+    {
+        if (shadow != nullptr) // A dirty entry may not have reached flash yet
+        {
+            for (const auto &entry : shadow->entries)
+            {
+                if ((strncmp(entry.key, key, NVS_KEY_NAME_MAX_SIZE) == 0) && ((wanted == NVS_TYPE_ANY) || (entry.type == wanted)))
+                {
+                    found = entry.type;
+                    foundLength = (entry.type == NVS_TYPE_STR) ? entry.text.length() + 1 : (entry.type & 0x0F);
+                    break;
+                }
+            }
+        }
+
+        if (found == NVS_TYPE_ANY)
+        {
+            esp_err_t ret = nvs_find_key(handle, key, &found);
+
+            if ((ret == ESP_OK) && (wanted != NVS_TYPE_ANY) && (found != wanted))
+                ret = ESP_ERR_NVS_NOT_FOUND;
+
+            if (ret != ESP_OK)
+                return ret;
+        }
+    }
+
+    if (type != nullptr)
+        *type = found;
+
+    if (length == nullptr)
+        return ESP_OK;
+
+    if ((found != NVS_TYPE_STR) && (found != NVS_TYPE_BLOB))
+        *length = found & 0x0F; // The low nibble of an integer type is its width in bytes
+    else if (foundLength != NVS_DIRECTORY_LONG_VALUE)
+        *length = foundLength;
+    else if (found == NVS_TYPE_STR)
+        return nvs_get_str(handle, key, nullptr, length);
+    else
+        return nvs_get_blob(handle, key, nullptr, length);
+
+    return ESP_OK;
+}
+
+// Called from attachShadow() with the namespace lock held.  One walk of the namespace.  A walk which fails part way leaves the directory
+// unbuilt, and every lookup goes to flash as if there were no directory.
+void NVS::directoryBuild(NVS_SHADOW *shadow)
+{
+    auto &directory = shadow->directory;
+    directory.entries.clear();
+
+    NVS_Iterator it(getPartition(shadow->name_space), shadow->name_space);
+    NVS_ENTRY entry;
+
+    while (it.next(&entry))
+        directory.entries.push_back({keyHash(entry.key), (uint16_t)std::min(entry.size, (size_t)NVS_DIRECTORY_LONG_VALUE), (uint8_t)entry.type, false});
+
+    std::sort(directory.entries.begin(), directory.entries.end(), [](const NVS_DIRECTORY_ENTRY &a, const NVS_DIRECTORY_ENTRY &b) { return a.hash < b.hash; });
+    directory.built = (it.getStatus() == ESP_ERR_NVS_NOT_FOUND);
+
+    if (!directory.built)
+    {
+        directory.entries.clear();
+        routeLogByFormat<LOG_TYPE::WARN>("%s(): Unable to walk namespace %s, code = %s", __func__, shadow->name_space, esp_err_to_name(it.getStatus()));
+        return;
+    }
+
+    for (const auto &dirty : shadow->entries) // Waiting for write-behind.  Readers already see these values.
+        if (dirty.dirty)
+            directoryNote(shadow, dirty.key, dirty.type, (dirty.type == NVS_TYPE_STR) ? dirty.text.length() + 1 : (dirty.type & 0x0F));
+
+    directory.entries.shrink_to_fit();
+
+    if (show & _showNVS)
+        routeLogByFormat<LOG_TYPE::INFO>("%s(): %zu keys in namespace %s", __func__, directory.entries.size(), shadow->name_space);
+}
+
+bool NVS::directoryMayHold(NVS_SHADOW *shadow, const char *key, nvs_type_t type, size_t *length)
+{
+    if (length != nullptr)
+        *length = 0; // Unknown
+
+    if ((shadow == nullptr) || !shadow->directory.built)
+        return true;
+
+    auto &entries = shadow->directory.entries;
+    uint32_t hash = keyHash(key);
+
+    for (auto it = std::lower_bound(entries.begin(), entries.end(), hash, hashLess); (it != entries.end()) && (it->hash == hash); ++it)
+    {
+        if (it->type == type)
+        {
+            if ((length != nullptr) && !it->erased && (it->length != NVS_DIRECTORY_LONG_VALUE)) // A marked entry's length may be another key's
+                *length = it->length;
+            return true;
+        }
+    }
+
+    shadow->stats.directorySkips++;
+    return false;
+}
+
+// Records a key which has just been written, or is about to be.  A rewrite of the same type only updates the length.
+void NVS::directoryNote(NVS_SHADOW *shadow, const char *key, nvs_type_t type, size_t length)
+{
+    if ((shadow == nullptr) || !shadow->directory.built)
+        return;
+
+    auto &entries = shadow->directory.entries;
+    uint32_t hash = keyHash(key);
+    auto it = std::lower_bound(entries.begin(), entries.end(), hash, hashLess);
+
+    for (; (it != entries.end()) && (it->hash == hash); ++it)
+    {
+        if (it->type == type)
+        {
+            it->length = (uint16_t)std::min(length, (size_t)NVS_DIRECTORY_LONG_VALUE);
+            return;
+        }
+    }
+
+    entries.insert(it, {hash, (uint16_t)std::min(length, (size_t)NVS_DIRECTORY_LONG_VALUE), (uint8_t)type, false});
+}
+
+// Marks rather than removes.  The entry may also stand for another key with the same hash and type, and dropping it would have that key
+// reported as never stored and overwritten with its default.  The mark stays until the next rebuild, even when the key is written again.
+void NVS::directoryForget(NVS_SHADOW *shadow, const char *key, nvs_type_t type)
+{
+    if ((shadow == nullptr) || !shadow->directory.built)
+        return;
+
+    auto &entries = shadow->directory.entries;
+    uint32_t hash = keyHash(key);
+
+    for (auto it = std::lower_bound(entries.begin(), entries.end(), hash, hashLess); (it != entries.end()) && (it->hash == hash); ++it)
+    {
+        if (it->type == type)
+        {
+            it->erased = true;
+            return;
+        }
+    }
+}
+
+/* NVS_Session */
+esp_err_t NVS_Session::findKey(const char *key, nvs_type_t *type, size_t *length)
+{
+    return (nvs == nullptr) ? ESP_ERR_NVS_INVALID_HANDLE : nvs->findKey(handle, shadow, key, type, length);
+}
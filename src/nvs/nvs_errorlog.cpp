@@ -0,0 +1,225 @@
+#include "nvs/nvs_.hpp"
+#include "system_.hpp"
+
+#include <stdio.h>
+#include <string.h>
+
+extern SemaphoreHandle_t semNVSErrorLog;
+//
+// A fixed size ring of error strings kept in its own namespace so they survive a reboot and can be sent to the cloud afterwards.
+//
+// Entry n lives under key "eNN" where NN is n % NVS_ERROR_LOG_CAPACITY.  firstIndex and lastIndex are sequence numbers which only ever grow,
+// and both are saved together in one u64 key, so an append is one string write, one index write and one commit no matter how full the
+// log is.  When the log is full the new entry simply lands on the oldest slot and firstIndex moves up by one.
+//
+// Appends are made from routeLogBy*(), which may be running inside any of our own functions and on any task.  Nothing in this file logs
+// through routeLogBy*(), so there is no way back in.  The log has its own handle and its own mutex rather than a namespace lock, and an
+// append waits at most NVS_ERROR_LOG_WAIT_MS for it before giving up on the message.
+//
+static const char *ERROR_LOG_INDEX_KEY = "index";
+
+static void makeErrorKey(char *errorKey, uint32_t index)
+{
+    snprintf(errorKey, NVS_KEY_NAME_MAX_SIZE, "e%02x", (unsigned)(index % NVS_ERROR_LOG_CAPACITY));
+}
+
+/* Public Member Functions */
+void NVS::enableErrorLog(bool enable)
+{
+    errorLogging = enable;
+}
+
+uint8_t NVS::getErrorCount()
+{
+    uint8_t count = 0;
+
+    if (xSemaphoreTake(semNVSErrorLog, portMAX_DELAY) == pdTRUE)
+    {
+        if (errorLogOpen() == ESP_OK)
+            count = (uint8_t)(lastIndex - firstIndex);
+        xSemaphoreGive(semNVSErrorLog);
+    }
+    return count;
+}
+
+esp_err_t NVS::readErrorStringFromNVS(std::string *strValue)
+{
+    char text[NVS_ERROR_LOG_LENGTH];
+
+    if (xSemaphoreTake(semNVSErrorLog, portMAX_DELAY) != pdTRUE)
+        return ESP_ERR_TIMEOUT;
+
+    esp_err_t ret = errorLogOpen();
+
+    if ((ret == ESP_OK) && (firstIndex == lastIndex))
+        ret = ESP_ERR_NVS_NOT_FOUND; // Empty
+
+    if (ret == ESP_OK)
+        ret = errorLogRead(firstIndex, text, sizeof(text));
+
+    if (ret == ESP_OK)
+    {
+        uint64_t indexes = ((uint64_t)(firstIndex + 1) << 32) | lastIndex; // The slot is left as it is.  It is overwritten when its turn comes.
+        ret = nvs_set_u64(errorLogHandle, ERROR_LOG_INDEX_KEY, indexes);
+
+        if (ret == ESP_OK)
+            ret = nvs_commit(errorLogHandle);
+
+        if (ret == ESP_OK)
+        {
+            firstIndex++;
+            *strValue = text;
+        }
+    }
+
+    xSemaphoreGive(semNVSErrorLog);
+    return ret;
+}
+
+esp_err_t NVS::writeErrorStringToNVS(std::string *strValue)
+{
+    return writeErrorStringToNVS(strValue->c_str());
+}
+
+esp_err_t NVS::writeErrorStringToNVS(const char *text)
+{
+    if (xSemaphoreTake(semNVSErrorLog, pdMS_TO_TICKS(NVS_ERROR_LOG_WAIT_MS)) != pdTRUE) // Never hold up the caller's error path for long
+        return ESP_ERR_TIMEOUT;
+
+    esp_err_t ret = errorLogOpen(0); // An error raised during a deferred mount can't wait for it, so that one is dropped
+
+    if (ret == ESP_OK)
+    {
+        char entry[NVS_ERROR_LOG_LENGTH];
+        char errorKey[NVS_KEY_NAME_MAX_SIZE];
+
+        strncpy(entry, text, sizeof(entry) - 1);
+        entry[sizeof(entry) - 1] = 0;
+        makeErrorKey(errorKey, lastIndex);
+
+        ret = nvs_set_str(errorLogHandle, errorKey, entry);
+
+        uint32_t newLast = lastIndex + 1;
+        uint32_t newFirst = (newLast - firstIndex > NVS_ERROR_LOG_CAPACITY) ? (newLast - NVS_ERROR_LOG_CAPACITY) : firstIndex; // Full, so the oldest is gone
+
+        if (ret == ESP_OK)
+            ret = nvs_set_u64(errorLogHandle, ERROR_LOG_INDEX_KEY, ((uint64_t)newFirst << 32) | newLast);
+
+        if (ret == ESP_OK)
+            ret = nvs_commit(errorLogHandle);
+
+        if (ret == ESP_OK)
+        {
+            firstIndex = newFirst;
+            lastIndex = newLast;
+        }
+    }
+
+    xSemaphoreGive(semNVSErrorLog);
+    return ret;
+}
+
+void NVS::clearErrorBuffer()
+{
+    xSemaphoreTake(semNVSErrorLog, portMAX_DELAY);
+
+    if (errorLogOpen() == ESP_OK)
+    {
+        nvs_erase_all(errorLogHandle);
+        nvs_commit(errorLogHandle);
+        firstIndex = 0;
+        lastIndex = 0;
+    }
+
+    xSemaphoreGive(semNVSErrorLog);
+}
+
+/* Private Member Functions */
+// Called with semNVSErrorLog held.  The handle stays open for the life of the object, so only the first call touches the index key.
+esp_err_t NVS::errorLogOpen(TickType_t ticksToWait)
+{
+    if (errorLogHandle != 0)
+        return ESP_OK;
+
+    esp_err_t ret = waitForInit(ticksToWait);
+
+    if (ret == ESP_OK)
+        ret = openNamespace(NVS_ERROR_LOG_NAMESPACE, &errorLogHandle); // May be routed like any other namespace
+
+    if (ret != ESP_OK)
+    {
+        errorLogHandle = 0;
+        return ret;
+    }
+
+    uint64_t indexes = 0;
+    ret = nvs_get_u64(errorLogHandle, ERROR_LOG_INDEX_KEY, &indexes);
+
+    if (ret == ESP_ERR_NVS_NOT_FOUND) // A new log
+        ret = ESP_OK;
+
+    firstIndex = (uint32_t)(indexes >> 32);
+    lastIndex = (uint32_t)indexes;
+
+    if ((lastIndex < firstIndex) || (lastIndex - firstIndex > NVS_ERROR_LOG_CAPACITY)) // Not ours, or the capacity was made smaller.  Keep the newest.
+        firstIndex = (lastIndex > NVS_ERROR_LOG_CAPACITY) ? (lastIndex - NVS_ERROR_LOG_CAPACITY) : 0;
+
+    return ret;
+}
+
+// Called with semNVSErrorLog held
+esp_err_t NVS::errorLogRead(uint32_t index, char *buffer, size_t bufferSize)
+{
+    char errorKey[NVS_KEY_NAME_MAX_SIZE];
+    makeErrorKey(errorKey, index);
+
+    size_t length = bufferSize;
+    esp_err_t ret = nvs_get_str(errorLogHandle, errorKey, buffer, &length);
+
+    if (ret == ESP_ERR_NVS_INVALID_LENGTH) // The caller's buffer is smaller than the entry.  Hand back what fits.
+    {
+        char entry[NVS_ERROR_LOG_LENGTH];
+        length = sizeof(entry);
+        ret = nvs_get_str(errorLogHandle, errorKey, entry, &length);
+
+        if ((ret == ESP_OK) && (bufferSize > 0))
+        {
+            strncpy(buffer, entry, bufferSize - 1);
+            buffer[bufferSize - 1] = 0;
+        }
+    }
+    return ret;
+}
+
+/* NVS_ErrorLogReader */
+NVS_ErrorLogReader::NVS_ErrorLogReader(uint8_t maxEntries)
+{
+    NVS *nvs = NVS::getInstance();
+
+    xSemaphoreTake(semNVSErrorLog, portMAX_DELAY);
+
+    if (nvs->errorLogOpen() == ESP_OK)
+    {
+        index = nvs->firstIndex;
+        end = ((nvs->lastIndex - index) > maxEntries) ? (index + maxEntries) : nvs->lastIndex;
+    }
+
+    xSemaphoreGive(semNVSErrorLog);
+}
+
+bool NVS_ErrorLogReader::next(char *buffer, size_t bufferSize)
+{
+    NVS *nvs = NVS::getInstance();
+    bool found = false;
+
+    xSemaphoreTake(semNVSErrorLog, portMAX_DELAY); // Held for one entry at a time so appends are never kept waiting for long
+
+    if (index < nvs->firstIndex) // Entries were overwritten since we started.  Carry on from the oldest one left.
+        index = nvs->firstIndex;
+
+    if ((index < end) && (index < nvs->lastIndex))
+        found = (nvs->errorLogRead(index++, buffer, bufferSize) == ESP_OK);
+
+    xSemaphoreGive(semNVSErrorLog);
+    return found;
+}
@@ -0,0 +1,390 @@
+#include "nvs/nvs_.hpp"
+#include "system_.hpp"
+
+#include <stdio.h>
+#include <string.h>
+//
+// Power loss harness.  Compiled only when NVS_FAULT_INJECTION is set, and only for the IDF Linux target, whose emulated flash can be
+// told to fail every write and erase after a given count.  That is as close to pulling the plug as a host gets.  One limit: a cut
+// operation is lost whole, so a word torn half way through its write is not covered.
+//
+// Each cycle runs a random mix of writes (u32 and strings of 1 to 200 bytes), key erases and commits on NVS_FAULT_NAMESPACE through an
+// ordinary session, with the power set to fail after 1 to NVS_FAULT_MAX_CUT flash operations.  The partition is then remounted through
+// initPartition(), the same path routed partitions take at boot, and every key is checked:
+//
+//     A key must hold whatever its last acknowledged write or erase left, or, for the one operation the cut landed in, either outcome.
+//     Anything else counts as lost.  A mount which had to erase the partition is reported as such, and every value it took is counted too.
+//
+// One CSV line is handed to the sink per cycle, so a long run can be sorted for its worst mounts afterwards:
+//
+//     cycle,fill,cut_after,ops_done,cut_op,in_flight,mount_us,mount,lost
+//
+// fill       Percent of the partition's entries in use before the cycle.  Filler blobs go into NVS_FAULT_FILL_NAMESPACE.
+// cut_op     write, erase or commit for the operation which failed, or none if the workload finished first
+// in_flight  old or new for which outcome the interrupted operation left, none if there was none
+// mount      clean, recovered (full partition copied out and back), erased (every entry lost) or failed
+//
+// The run replays exactly from its seed.  NVS_FAULT_PARTITION is erased before and after.  Nothing else should write to flash during a
+// run, since the emulator counts operations on every partition.
+//
+#if NVS_FAULT_INJECTION && CONFIG_IDF_TARGET_LINUX
+#include "esp_private/partition_linux.h"
+#include "esp_timer.h"
+#include "nvs_flash.h"
+
+#include <algorithm>
+
+constexpr char NVS_FAULT_NAMESPACE[] = "nvs_fkeys";
+constexpr char NVS_FAULT_FILL_NAMESPACE[] = "nvs_ffill";
+constexpr uint8_t FAULT_KEYS = 12;      // Keys checked after every cut
+constexpr uint8_t FAULT_U32_KEYS = 8;   // The first ones hold u32.  The rest hold strings.
+constexpr size_t FAULT_FILL_BLOB = 480; // 16 entries of 32 bytes each, counting the blob headers
+static_assert(FAULT_KEYS <= 16, "verifyKeys() reports lost keys one bit each in a uint16_t");
+
+enum class FAULT_OP : uint8_t
+{
+    WRITE = 0,
+    ERASE,
+    COMMIT,
+    NONE,
+};
+
+enum class FAULT_OUTCOME : uint8_t // What the operation the cut landed in left behind
+{
+    NONE = 0, // The cut came between operations, or in a commit
+    OLD,
+    NEW,
+};
+
+struct FAULT_KEY // What flash may hold for one key
+{
+    bool present; // As left by the last write or erase which returned ESP_OK
+    uint32_t value;
+    bool inFlight; // The cut landed in an operation on this key.  Either outcome is correct.
+    bool inFlightPresent;
+    uint32_t inFlightValue;
+};
+
+class FaultRandom // xorshift32.  The same seed replays the same run.
+{
+public:
+    explicit FaultRandom(uint32_t seed) : state((seed == 0) ? 1 : seed) {}
+
+    uint32_t next()
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    }
+
+    uint32_t below(uint32_t limit) { return next() % limit; }
+
+private:
+    uint32_t state;
+};
+
+static void makeKey(char *key, uint8_t index)
+{
+    snprintf(key, NVS_KEY_NAME_MAX_SIZE, "k%02u", index);
+}
+
+static std::string makeText(uint32_t value) // 1 to 200 bytes, so a string may span several entries
+{
+    char word[9];
+    snprintf(word, sizeof(word), "%08lx", (unsigned long)value);
+
+    std::string text;
+    size_t length = value % 200 + 1;
+
+    while (text.length() < length)
+        text.append(word);
+
+    text.resize(length);
+    return text;
+}
+
+static void powerOff(uint16_t afterOps)
+{
+    esp_partition_fail_after(afterOps, ESP_PARTITION_FAIL_AFTER_MODE_BOTH); // Writes and erases.  Reads always work.
+}
+
+static void powerOn()
+{
+    esp_partition_fail_after(SIZE_MAX, ESP_PARTITION_FAIL_AFTER_MODE_BOTH);
+}
+
+// Runs until an operation fails or NVS_FAULT_OPS are done.  Returns how many completed.
+static uint8_t runWorkload(NVS *nvs, FaultRandom &random, FAULT_KEY *keys, FAULT_OP *cutOp)
+{
+    NVS_Session session = nvs->openSession(NVS_FAULT_NAMESPACE);
+    uint8_t done = 0;
+    *cutOp = FAULT_OP::NONE;
+
+    for (; session.isOpen() && (done < NVS_FAULT_OPS); done++)
+    {
+        uint8_t index = (uint8_t)random.below(FAULT_KEYS);
+        uint32_t roll = random.below(10);
+        uint32_t value = random.next();
+        FAULT_OP op = (roll < 7) ? FAULT_OP::WRITE : ((roll < 9) ? FAULT_OP::ERASE : FAULT_OP::COMMIT);
+        FAULT_KEY &model = keys[index];
+        esp_err_t ret = ESP_OK;
+
+        char key[NVS_KEY_NAME_MAX_SIZE];
+        makeKey(key, index);
+
+        model.inFlight = (op != FAULT_OP::COMMIT);
+        model.inFlightPresent = (op == FAULT_OP::WRITE);
+        model.inFlightValue = value;
+
+        if (op == FAULT_OP::WRITE)
+            ret = (index < FAULT_U32_KEYS) ? session.write<uint32_t>(key, value) : session.writeString(key, makeText(value).c_str());
+        else if (op == FAULT_OP::ERASE)
+        {
+            ret = nvs_erase_key(session.getHandle(), key);
+
+            if (ret == ESP_ERR_NVS_NOT_FOUND)
+                ret = ESP_OK;
+        }
+        else
+            ret = nvs_commit(session.getHandle());
+
+        if (ret != ESP_OK)
+        {
+            *cutOp = op;
+            break;
+        }
+
+        if (model.inFlight) // Acknowledged, so from here on it must survive
+        {
+            model.present = model.inFlightPresent;
+            model.value = value;
+            model.inFlight = false;
+        }
+    }
+
+    session.discardChanges();
+    return done;
+}
+
+static bool holds(nvs_handle_t handle, uint8_t index, bool present, uint32_t value)
+{
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    makeKey(key, index);
+
+    if (index < FAULT_U32_KEYS)
+    {
+        uint32_t stored = 0;
+        esp_err_t ret = nvs_get_u32(handle, key, &stored);
+        return present ? ((ret == ESP_OK) && (stored == value)) : (ret == ESP_ERR_NVS_NOT_FOUND);
+    }
+
+    size_t length = 0;
+    esp_err_t ret = nvs_get_str(handle, key, nullptr, &length);
+
+    if (!present || (ret != ESP_OK))
+        return !present && (ret == ESP_ERR_NVS_NOT_FOUND);
+
+    std::string expected = makeText(value);
+
+    if (length != expected.length() + 1)
+        return false;
+
+    std::string stored(length - 1, 0);
+    return (nvs_get_str(handle, key, stored.data(), &length) == ESP_OK) && (stored == expected);
+}
+
+// Checks every key against the model and brings the model up to date.  A lost key is erased so later cycles start from a known state.
+// lostKeys gets one bit per lost key for the caller to log.
+static uint8_t verifyKeys(NVS *nvs, FAULT_KEY *keys, FAULT_OUTCOME *outcome, uint16_t *lostKeys)
+{
+    NVS_Session session = nvs->openSession(NVS_FAULT_NAMESPACE);
+    uint8_t lost = 0;
+    *lostKeys = 0;
+
+    for (uint8_t index = 0; index < FAULT_KEYS; index++)
+    {
+        FAULT_KEY &model = keys[index];
+
+        if (session.isOpen() && holds(session.getHandle(), index, model.present, model.value))
+        {
+            if (model.inFlight && ((model.present != model.inFlightPresent) || (model.value != model.inFlightValue)))
+                *outcome = FAULT_OUTCOME::OLD;
+        }
+        else if (session.isOpen() && model.inFlight && holds(session.getHandle(), index, model.inFlightPresent, model.inFlightValue))
+        {
+            model.present = model.inFlightPresent;
+            model.value = model.inFlightValue;
+            *outcome = FAULT_OUTCOME::NEW;
+        }
+        else
+        {
+            char key[NVS_KEY_NAME_MAX_SIZE];
+            makeKey(key, index);
+
+            if (session.isOpen())
+                nvs_erase_key(session.getHandle(), key);
+
+            model.present = false;
+            *lostKeys |= (uint16_t)(1 << index);
+            lost++;
+        }
+
+        model.inFlight = false;
+    }
+
+    return lost;
+}
+
+// Adds filler blobs until the partition reaches the given fill.  Returns the fill actually reached.
+static uint8_t fillPartition(NVS *nvs, uint8_t percent, uint16_t *fillerCount)
+{
+    NVS_Session session = nvs->openSession(NVS_FAULT_FILL_NAMESPACE);
+    nvs_stats_t stats = {};
+    uint8_t filler[FAULT_FILL_BLOB];
+    memset(filler, 0x5A, sizeof(filler));
+
+    while (session.isOpen() && (nvs_get_stats(NVS_FAULT_PARTITION, &stats) == ESP_OK) && (stats.total_entries > 0))
+    {
+        if (stats.used_entries * 100 / stats.total_entries >= percent)
+            break;
+
+        char key[NVS_KEY_NAME_MAX_SIZE];
+        snprintf(key, sizeof(key), "f%04x", *fillerCount);
+
+        if (nvs_set_blob(session.getHandle(), key, filler, sizeof(filler)) != ESP_OK) // Full.  Report what we reached.
+            break;
+
+        (*fillerCount)++;
+    }
+
+    session.close();
+    nvs_get_stats(NVS_FAULT_PARTITION, &stats);
+    return (stats.total_entries == 0) ? 0 : (uint8_t)(stats.used_entries * 100 / stats.total_entries);
+}
+
+/* Public Member Functions */
+esp_err_t NVS::runPowerLossTest(NVS_BlobSink &sink, uint32_t cycles, uint32_t seed)
+{
+    static const char *opNames[] = {"write", "erase", "commit", "none"};
+    static const char *outcomeNames[] = {"none", "old", "new"};
+    static const char *mountNames[] = {"clean", "recovered", "erased", "failed"};
+
+    if (cycles == 0)
+        return ESP_ERR_INVALID_ARG;
+
+    esp_err_t ret = waitForInit();
+
+    if (ret == ESP_OK)
+        ret = routeNamespace(NVS_FAULT_NAMESPACE, NVS_FAULT_PARTITION);
+
+    if (ret == ESP_OK)
+        ret = routeNamespace(NVS_FAULT_FILL_NAMESPACE, NVS_FAULT_PARTITION);
+
+    if (ret != ESP_OK)
+    {
+        routeLogByFormat<LOG_TYPE::ERROR>("%s(): No %s partition, code = %s", __func__, NVS_FAULT_PARTITION, esp_err_to_name(ret));
+        return ret;
+    }
+
+    if ((findShadow(NVS_FAULT_NAMESPACE) != nullptr) || (findShadow(NVS_FAULT_FILL_NAMESPACE) != nullptr)) // RAM would hide what flash lost
+        return ESP_ERR_INVALID_STATE;
+
+    static const char header[] = "cycle,fill,cut_after,ops_done,cut_op,in_flight,mount_us,mount,lost\n";
+    ret = sink.write(header, sizeof(header) - 1);
+
+    if (ret == ESP_OK)
+        ret = nvs_flash_erase_partition(NVS_FAULT_PARTITION);
+
+    if (ret == ESP_OK)
+        ret = initPartition(NVS_FAULT_PARTITION);
+
+    if (ret != ESP_OK)
+    {
+        routeLogByFormat<LOG_TYPE::ERROR>("%s(): Unable to start on a clean %s, code = %s", __func__, NVS_FAULT_PARTITION, esp_err_to_name(ret));
+        return ret;
+    }
+
+    constexpr uint8_t levels = sizeof(NVS_FAULT_FILL_LEVELS) / sizeof(NVS_FAULT_FILL_LEVELS[0]);
+    uint32_t perLevel = (cycles + levels - 1) / levels;
+
+    FaultRandom random(seed);
+    FAULT_KEY keys[FAULT_KEYS] = {};
+    uint16_t fillerCount = 0;
+    uint32_t totalLost = 0;
+    uint32_t erasedMounts = 0;
+    uint32_t worstMicros = 0;
+    uint32_t worstCycle = 0;
+    uint8_t fill = 0;
+
+    for (uint32_t cycle = 0; (cycle < cycles) && (ret == ESP_OK); cycle++)
+    {
+        if (cycle % perLevel == 0) // Ascending, so each level only adds to the filler already written
+            fill = fillPartition(this, NVS_FAULT_FILL_LEVELS[cycle / perLevel], &fillerCount);
+
+        uint16_t cutAfter = (uint16_t)(random.below(NVS_FAULT_MAX_CUT) + 1);
+        FAULT_OP cutOp = FAULT_OP::NONE;
+        FAULT_OUTCOME outcome = FAULT_OUTCOME::NONE;
+
+        powerOff(cutAfter);
+        uint8_t done = runWorkload(this, random, keys, &cutOp);
+        powerOn();
+
+        nvs_flash_deinit_partition(NVS_FAULT_PARTITION); // The reboot
+
+        NVS_MOUNT mount = NVS_MOUNT::FAILED;
+        int64_t start = esp_timer_get_time();
+        esp_err_t mountResult = initPartition(NVS_FAULT_PARTITION, &mount);
+        uint32_t mountMicros = (uint32_t)(esp_timer_get_time() - start);
+
+        uint16_t lostKeys = 0;
+        uint8_t lost = (mountResult == ESP_OK) ? verifyKeys(this, keys, &outcome, &lostKeys) : FAULT_KEYS;
+        totalLost += lost;
+
+        for (uint8_t index = 0; index < FAULT_KEYS; index++)
+        {
+            if (lostKeys & (1 << index))
+            {
+                char key[NVS_KEY_NAME_MAX_SIZE];
+                makeKey(key, index);
+                routeLogByFormat<LOG_TYPE::ERROR>("%s(): %s lost at cycle %lu", __func__, key, (unsigned long)cycle);
+            }
+        }
+
+        if (mount == NVS_MOUNT::ERASED)
+        {
+            erasedMounts++;
+            fillerCount = 0;
+        }
+
+        if (mountMicros > worstMicros)
+        {
+            worstMicros = mountMicros;
+            worstCycle = cycle;
+        }
+
+        char line[128];
+        int length = snprintf(line, sizeof(line), "%lu,%u,%u,%u,%s,%s,%lu,%s,%u\n", (unsigned long)cycle, fill, cutAfter, done, opNames[(uint8_t)cutOp],
+                              outcomeNames[(uint8_t)outcome], (unsigned long)mountMicros, mountNames[(uint8_t)mount], lost);
+        ret = sink.write(line, std::min((size_t)length, sizeof(line) - 1));
+
+        if ((ret == ESP_OK) && (mountResult != ESP_OK))
+            ret = mountResult;
+    }
+
+    nvs_flash_erase_partition(NVS_FAULT_PARTITION);
+    initPartition(NVS_FAULT_PARTITION);
+
+    routeLogByFormat<LOG_TYPE::INFO>("%s(): Worst mount %luus at cycle %lu.  %lu values lost, %lu mounts erased the partition.", __func__,
+                                     (unsigned long)worstMicros, (unsigned long)worstCycle, (unsigned long)totalLost, (unsigned long)erasedMounts);
+
+    if ((ret == ESP_OK) && ((totalLost > 0) || (erasedMounts > 0))) // So a build server fails the run
+        ret = ESP_FAIL;
+    return ret;
+}
+#else
+esp_err_t NVS::runPowerLossTest(NVS_BlobSink &, uint32_t, uint32_t)
+{
+    return ESP_ERR_NOT_SUPPORTED;
+}
+#endif
@@ -1,11 +1,14 @@
 #include "nvs/nvs_.hpp"
 #include "system_.hpp" // Class structure and variables
+
+#include <stdarg.h>
+#include <stdio.h>
 //
 // I bring most logging formation here (inside each object) because in a more advanced project, I route logging
 // information back to the cloud.  We could also just as easily log to a file storage location like an SD card.
 //
-// At is also at this location (in my more advanced project) that I store Error information to Flash.  This makes is possible
-// to transmit error logging to the cloud after a reboot.
+// At is also at this location that I store Error information to Flash.  This makes is possible to transmit error logging to the cloud
+// after a reboot.  See nvs_errorlog.cpp and enableErrorLog().
 //
 /* Logging */
 // Logging by reference potentially allows a better algorithm for accessing the data throught a pointer.
@@ -19,6 +22,8 @@ void NVS::routeLogByRef(LOG_TYPE _type, std::string *_msg)
     case LOG_TYPE::ERROR:
     {
         ESP_LOGE(TAG, "%s", (*msg).c_str()); // Print out our errors here so we see it in the console.
+        if (errorLogging)
+            writeErrorStringToNVS(msg);
         break;
     }
 
@@ -39,13 +44,15 @@ void NVS::routeLogByRef(LOG_TYPE _type, std::string *_msg)
 void NVS::routeLogByValue(LOG_TYPE _type, std::string _msg)
 {
     LOG_TYPE type = _type; // Copy our parameters upon entry before they are over-written by another calling task.
-    std::string msg = _msg;
+    const std::string &msg = _msg; // _msg is already our own copy.  There is no need to make another.
 
     switch (type)
     {
     case LOG_TYPE::ERROR:
     {
         ESP_LOGE(TAG, "%s", (msg).c_str()); // Print out our errors here so we see it in the console.
+        if (errorLogging)
+            writeErrorStringToNVS(msg.c_str());
         break;
     }
 
@@ -62,3 +69,38 @@ void NVS::routeLogByValue(LOG_TYPE _type, std::string _msg)
     }
     }
 }
+
+// The hot paths log through routeLogByFormat<>() which checks the level before anything is built.  Only a message that will actually be
+// printed reaches here, and it is formatted into a fixed buffer on the stack rather than into a std::string.
+void NVS::routeLogFormatted(LOG_TYPE type, const char *format, ...)
+{
+    char msg[NVS_LOG_BUFFER_SIZE];
+
+    va_list args;
+    va_start(args, format);
+    vsnprintf(msg, sizeof(msg), format, args);
+    va_end(args);
+
+    switch (type)
+    {
+    case LOG_TYPE::ERROR:
+    {
+        ESP_LOGE(TAG, "%s", msg); // Print out our errors here so we see it in the console.
+        if (errorLogging)
+            writeErrorStringToNVS(msg);
+        break;
+    }
+
+    case LOG_TYPE::WARN:
+    {
+        ESP_LOGW(TAG, "%s", msg); // Print out our warning here so we see it in the console.
+        break;
+    }
+
+    case LOG_TYPE::INFO:
+    {
+        ESP_LOGI(TAG, "%s", msg); // Print out our information here so we see it in the console.
+        break;
+    }
+    }
+}
@@ -0,0 +1,215 @@
+#include "nvs/nvs_.hpp"
+#include "system_.hpp"
+
+#include <string.h>
+//
+// Schema migration.  See nvs_migration.hpp for how steps are written.
+//
+// The whole pass runs in one session, so the namespace stays locked throughout and nvs_commit() is called once no matter how many keys
+// the steps touch.  The stored version is written last, in the same commit.  The IDF puts each item on flash as it is set, so a reset part
+// way through keeps whatever the steps had done but not the new version, and the pass runs again on the next boot.  That is why every
+// NVS_Migrator helper treats work it finds already done as success.
+//
+// Steps go straight to the handle, so the shadow is flushed and cleared before the first one.  Nothing cached can then be older than
+// flash, and the key directory is walked again the next time it is needed.  If the flush fails no step runs, since the steps would read
+// values older than the ones still waiting in RAM.
+//
+
+/* NVS_Migrator */
+esp_err_t NVS_Migrator::readString(const char *key, std::string *strValue)
+{
+    NVS *nvs = NVS::getInstance();
+
+    if (nvs->isCompressed(shadow, key))
+        return nvs->readCompressedString(handle, shadow, key, strValue);
+
+    size_t length = 0;
+    esp_err_t ret = nvs_get_str(handle, key, nullptr, &length);
+
+    if (ret != ESP_OK)
+        return ret;
+
+    std::string text(length - 1, 0);
+    ret = nvs_get_str(handle, key, text.data(), &length);
+
+    if (ret == ESP_OK)
+        strValue->swap(text);
+    return ret;
+}
+
+esp_err_t NVS_Migrator::writeString(const char *key, const char *value)
+{
+    esp_err_t ret = NVS::getInstance()->storeString(handle, shadow, key, value);
+
+    if (ret == ESP_OK)
+    {
+        NVS_OpTimer::countWrite(strlen(value) + 1);
+        changes++;
+    }
+    return ret;
+}
+
+esp_err_t NVS_Migrator::erase(const char *key)
+{
+    esp_err_t ret = nvs_erase_key(handle, key);
+
+    if (ret == ESP_ERR_NVS_NOT_FOUND)
+        return ESP_OK;
+
+    if (ret == ESP_OK)
+        changes++;
+    return ret;
+}
+
+esp_err_t NVS_Migrator::splitString(const char *key, char separator, const char *const *keys, size_t count)
+{
+    if ((keys == nullptr) || (count == 0))
+        return ESP_ERR_INVALID_ARG;
+
+    for (size_t i = 0; i < count; i++) // A second attempt would split the piece already written back under the old key
+        if (strncmp(keys[i], key, NVS_KEY_NAME_MAX_SIZE) == 0)
+            return ESP_ERR_INVALID_ARG;
+
+    std::string text;
+    esp_err_t ret = readString(key, &text);
+
+    if ((ret == ESP_ERR_NVS_NOT_FOUND) || (ret == ESP_ERR_NVS_TYPE_MISMATCH)) // Never stored, or split by an earlier attempt
+        return ESP_OK;
+
+    if (ret != ESP_OK)
+        return ret;
+
+    size_t start = 0;
+
+    for (size_t i = 0; (ret == ESP_OK) && (i < count); i++)
+    {
+        size_t end = (i == count - 1) ? std::string::npos : text.find(separator, start);
+        std::string piece = (start < text.length()) ? text.substr(start, (end == std::string::npos) ? std::string::npos : end - start) : "";
+
+        ret = writeString(keys[i], piece.c_str());
+        start = (end == std::string::npos) ? text.length() : end + 1;
+    }
+
+    if (ret == ESP_OK)
+        ret = erase(key);
+    return ret;
+}
+
+/* NVS Member Functions */
+esp_err_t NVS::migrateNamespace(const char *name_space, const NVS_MIGRATION *steps, size_t count)
+{
+    if ((steps == nullptr) || (count == 0))
+        return ESP_ERR_INVALID_ARG;
+
+    for (size_t i = 0; i < count; i++) // Catches a table edited out of order before it can skip a step on some devices
+    {
+        if ((steps[i].migrate == nullptr) || (steps[i].version == 0) || ((i > 0) && (steps[i].version <= steps[i - 1].version)))
+        {
+            routeLogByFormat<LOG_TYPE::ERROR>("%s(): Step %u of namespace %s is out of order", __func__, (unsigned)i, name_space);
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+
+    NVS_Session session = openSession(name_space);
+
+    if (!session.isOpen())
+        return session.getStatus();
+
+    uint16_t stored = 0;
+    esp_err_t ret = nvs_get_u16(session.handle, NVS_SCHEMA_VERSION_KEY, &stored);
+
+    if (ret == ESP_ERR_NVS_NOT_FOUND) // Never migrated
+        ret = ESP_OK;
+
+    if (ret != ESP_OK)
+    {
+        session.discardChanges();
+        routeLogByFormat<LOG_TYPE::ERROR>("%s(): Unable to read the schema version of %s, code = %s", __func__, name_space, esp_err_to_name(ret));
+        return ret;
+    }
+
+    uint16_t latest = steps[count - 1].version;
+
+    if (stored == latest) // Every boot after the first lands here
+    {
+        session.discardChanges();
+        return ESP_OK;
+    }
+
+    if (stored > latest)
+    {
+        session.discardChanges();
+        routeLogByFormat<LOG_TYPE::WARN>("%s(): Namespace %s is at version %u, newer than this firmware's %u", __func__, name_space, stored, latest);
+        return ESP_ERR_INVALID_VERSION;
+    }
+
+    if (session.shadow != nullptr)
+    {
+        shadowAwaitFlush(session.shadow);
+        ret = shadowFlush(session.handle, session.shadow, true); // Pending writes reach flash before any step reads them
+
+        if (ret != ESP_OK) // Clearing now would throw away values flash never got.  They stay dirty, and the pass runs next time.
+        {
+            session.discardChanges();
+            routeLogByFormat<LOG_TYPE::ERROR>("%s(): Unable to flush namespace %s before migrating, code = %s", __func__, name_space, esp_err_to_name(ret));
+            return ret;
+        }
+
+        shadowClear(session.shadow);
+    }
+
+    NVS_Migrator migrator(session.handle, session.shadow);
+    uint16_t reached = stored;
+
+    for (size_t i = 0; (ret == ESP_OK) && (i < count); i++)
+    {
+        if (steps[i].version <= stored)
+            continue;
+
+        ret = steps[i].migrate(migrator);
+
+        if (ret == ESP_OK)
+            reached = steps[i].version;
+        else
+            routeLogByFormat<LOG_TYPE::ERROR>("%s(): Step to version %u of %s failed, code = %s", __func__, steps[i].version, name_space, esp_err_to_name(ret));
+    }
+
+    esp_err_t versionRet = ESP_OK;
+
+    if (reached != stored) // Steps which finished are kept even when a later one failed
+    {
+        versionRet = nvs_set_u16(session.handle, NVS_SCHEMA_VERSION_KEY, reached);
+
+        if (versionRet == ESP_OK)
+            NVS_OpTimer::countWrite(sizeof(reached));
+    }
+
+    esp_err_t commitRet = session.close(); // The only commit of the pass
+
+    if (ret == ESP_OK)
+        ret = (versionRet != ESP_OK) ? versionRet : commitRet;
+
+    if (show & _showNVS)
+        routeLogByFormat<LOG_TYPE::INFO>("%s(): Namespace %s migrated from version %u to %u with %u key changes", __func__, name_space, stored, reached,
+                                         migrator.getChanges());
+    return ret;
+}
+
+esp_err_t NVS::getSchemaVersion(const char *name_space, uint16_t *version)
+{
+    NVS_Session session = openSession(name_space);
+
+    if (!session.isOpen())
+        return session.getStatus();
+
+    session.discardChanges();
+
+    esp_err_t ret = nvs_get_u16(session.handle, NVS_SCHEMA_VERSION_KEY, version);
+
+    if (ret == ESP_ERR_NVS_NOT_FOUND)
+    {
+        *version = 0;
+        ret = ESP_OK;
+    }
+    return ret;
+}
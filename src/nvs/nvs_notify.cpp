@@ -0,0 +1,251 @@
+#include "nvs/nvs_.hpp"
+#include "system_.hpp"
+
+#include <string.h>
+
+extern SemaphoreHandle_t semNVSNotify;
+//
+// Change notifications let an object hear about a new value instead of polling for it with read*FromNVS().
+//
+// A subscription names a namespace and a key prefix, and either a callback or a FreeRTOS queue of NVS_CHANGE items.  Subscribing shadows the
+// namespace with no value budget if it isn't shadowed already, the same way enableKeyDirectory() does.  Every write then reaches the shadow,
+// so the write path can tell at once whether anyone is listening.
+//
+// A write which changes a value posts one NVS_CHANGE to our task without waiting, while the writer still holds the namespace lock.  Writes
+// which match the stored value, and defaults saved by a read, post nothing.  The task matches each change against the subscriptions and
+// calls back or forwards it to the subscriber's queue from its own stack.  No callback therefore runs while any NVS lock is held, and a
+// callback may open the namespace itself.  A change is posted as soon as readers can see it, which can be before the writer's commit.
+//
+// Changes made by importImage(), NVS_Transaction and the blob streams are not reported.  Disabling the namespace's shadow ends its
+// notifications.
+//
+// Once unsubscribe() returns, the subscription's callback is not running and won't be called again, so its context may be freed.  Called
+// from a callback it can't wait for the dispatch it is part of, so the task checks each subscription is still there before calling it.
+// A shadow which subscribe() had to create is disabled again when its last subscriber leaves, unless something else has come to use it.
+//
+/* Public Member Functions */
+esp_err_t NVS::subscribe(const char *name_space, const char *prefix, NVS_ChangeCallback callback, void *context, uint8_t *id)
+{
+    if (callback == nullptr)
+        return ESP_ERR_INVALID_ARG;
+
+    NVS_SUBSCRIPTION subscription = {};
+    subscription.callback = callback;
+    subscription.context = context;
+    return addSubscription(name_space, prefix, subscription, id);
+}
+
+esp_err_t NVS::subscribe(const char *name_space, const char *prefix, QueueHandle_t queue, uint8_t *id)
+{
+    if (queue == nullptr)
+        return ESP_ERR_INVALID_ARG;
+
+    NVS_SUBSCRIPTION subscription = {};
+    subscription.queue = queue;
+    return addSubscription(name_space, prefix, subscription, id);
+}
+
+esp_err_t NVS::unsubscribe(uint8_t id)
+{
+    if (id >= NVS_NOTIFY_MAX_SUBSCRIBERS)
+        return ESP_ERR_INVALID_ARG;
+
+    xSemaphoreTake(semNVSNotify, portMAX_DELAY);
+    NVS_SUBSCRIPTION subscription = subscriptions[id];
+    subscriptions[id].active = false;
+    uint32_t pass = notifyPass; // A pass which starts after this can't pick the subscription up
+    xSemaphoreGive(semNVSNotify);
+
+    if (!subscription.active)
+        return ESP_ERR_NOT_FOUND;
+
+    if (xTaskGetCurrentTaskHandle() != taskHandleNotify) // Waited for before the namespace lock, which a callback may be waiting on
+        while ((pass & 1) && (notifyPass == pass))
+            vTaskDelay(1);
+
+    SemaphoreHandle_t lock = namespaceLock(subscription.name_space); // Writers read the count under this lock
+    xSemaphoreTakeRecursive(lock, portMAX_DELAY);
+
+    NVS_SHADOW *shadow = findShadow(subscription.name_space);
+
+    if ((shadow != nullptr) && (shadow->subscribers > 0))
+        shadow->subscribers--;
+
+    if ((shadow != nullptr) && (shadow->subscribers == 0) && shadow->forNotify && (shadow->attached == 0) && !shadow->writeBehind &&
+        !shadow->directory.enabled && shadow->compressed.empty())
+        disableShadowCache(subscription.name_space); // Still under our lock, so no one can subscribe again in between
+
+    xSemaphoreGiveRecursive(lock);
+    return ESP_OK;
+}
+
+/* Private Member Functions */
+esp_err_t NVS::addSubscription(const char *name_space, const char *prefix, NVS_SUBSCRIPTION subscription, uint8_t *id)
+{
+    if (prefix == nullptr)
+        prefix = "";
+
+    if ((name_space == nullptr) || (name_space[0] == 0))
+        return ESP_ERR_INVALID_ARG;
+
+    if ((strlen(name_space) >= NVS_KEY_NAME_MAX_SIZE) || (strlen(prefix) >= NVS_KEY_NAME_MAX_SIZE))
+        return ESP_ERR_NVS_KEY_TOO_LONG;
+
+    strncpy(subscription.name_space, name_space, NVS_KEY_NAME_MAX_SIZE - 1);
+    strncpy(subscription.prefix, prefix, NVS_KEY_NAME_MAX_SIZE - 1);
+
+    if (taskHandleNotify == nullptr)
+    {
+        queueNotify = xQueueCreate(NVS_NOTIFY_QUEUE_LENGTH, sizeof(NVS_CHANGE));
+
+        if (queueNotify == nullptr)
+            return ESP_ERR_NO_MEM;
+
+        if (xTaskCreate(runNotifier, "nvs_notify", NVS_NOTIFY_STACK_SIZE, this, tskIDLE_PRIORITY + 1, &taskHandleNotify) != pdPASS)
+        {
+            vQueueDelete(queueNotify);
+            queueNotify = nullptr;
+            taskHandleNotify = nullptr;
+            routeLogByFormat<LOG_TYPE::ERROR>("%s(): Unable to start the notify task", __func__);
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    bool created = (findShadow(subscription.name_space) == nullptr);
+
+    if (created)
+        ESP_RETURN_ON_ERROR(enableShadowCache(subscription.name_space, 0), TAG, "enableShadowCache() failed..."); // No budget.  Only the count is kept.
+
+    xSemaphoreTake(semNVSNotify, portMAX_DELAY);
+
+    uint8_t slot = NVS_NOTIFY_MAX_SUBSCRIBERS;
+
+    for (uint8_t i = 0; (i < NVS_NOTIFY_MAX_SUBSCRIBERS) && (slot == NVS_NOTIFY_MAX_SUBSCRIBERS); i++)
+        if (!subscriptions[i].active)
+            slot = i;
+
+    if (slot < NVS_NOTIFY_MAX_SUBSCRIBERS)
+    {
+        subscriptions[slot] = subscription;
+        subscriptions[slot].active = true;
+    }
+
+    xSemaphoreGive(semNVSNotify);
+
+    if (slot == NVS_NOTIFY_MAX_SUBSCRIBERS)
+    {
+        routeLogByFormat<LOG_TYPE::ERROR>("%s(): No free subscription for namespace %s", __func__, subscription.name_space);
+        return ESP_ERR_NO_MEM;
+    }
+
+    SemaphoreHandle_t lock = namespaceLock(subscription.name_space);
+    xSemaphoreTakeRecursive(lock, portMAX_DELAY);
+
+    NVS_SHADOW *shadow = findShadow(subscription.name_space);
+
+    if (shadow != nullptr)
+    {
+        shadow->subscribers++;
+
+        if (created)
+            shadow->forNotify = true;
+    }
+
+    xSemaphoreGiveRecursive(lock);
+
+    if (id != nullptr)
+        *id = slot;
+
+    if (show & _showNVS)
+        routeLogByFormat<LOG_TYPE::INFO>("%s(): Subscription %u on %s prefix \"%s\"", __func__, slot, subscription.name_space, subscription.prefix);
+    return (shadow != nullptr) ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+void NVS::notifyChange(NVS_SHADOW *shadow, const char *key, nvs_type_t type, uint64_t value, const char *text)
+{
+    if ((shadow == nullptr) || (shadow->subscribers == 0))
+        return;
+
+    NVS_CHANGE change = {};
+    strncpy(change.name_space, shadow->name_space, NVS_KEY_NAME_MAX_SIZE - 1);
+    strncpy(change.key, key, NVS_KEY_NAME_MAX_SIZE - 1);
+    change.type = type;
+    change.value = value;
+
+    if (text != nullptr)
+    {
+        size_t length = strlen(text);
+        change.truncated = (length >= NVS_NOTIFY_TEXT_LENGTH);
+        memcpy(change.text, text, change.truncated ? NVS_NOTIFY_TEXT_LENGTH - 1 : length);
+    }
+
+    if (xQueueSend(queueNotify, &change, 0) != pdTRUE) // The writer never waits on a slow subscriber
+        droppedChanges++;
+}
+
+void NVS::runNotifier(void *arg)
+{
+    ((NVS *)arg)->runNotify();
+    vTaskDelete(NULL);
+}
+
+void NVS::runNotify()
+{
+    NVS_CHANGE change;
+    uint32_t droppedReported = 0;
+
+    while (true)
+    {
+        if (xQueueReceive(queueNotify, &change, portMAX_DELAY) != pdTRUE)
+            continue;
+
+        if (droppedChanges != droppedReported)
+        {
+            droppedReported = droppedChanges;
+            routeLogByFormat<LOG_TYPE::WARN>("%s(): %lu changes dropped so far", __func__, (unsigned long)droppedReported);
+        }
+
+        NVS_SUBSCRIPTION matches[NVS_NOTIFY_MAX_SUBSCRIBERS];
+        uint8_t slots[NVS_NOTIFY_MAX_SUBSCRIBERS];
+        uint8_t count = 0;
+
+        xSemaphoreTake(semNVSNotify, portMAX_DELAY); // Copied out so a callback may subscribe or unsubscribe
+
+        for (uint8_t i = 0; i < NVS_NOTIFY_MAX_SUBSCRIBERS; i++)
+        {
+            const auto &subscription = subscriptions[i];
+
+            if (subscription.active && (strncmp(subscription.name_space, change.name_space, NVS_KEY_NAME_MAX_SIZE) == 0) &&
+                (strncmp(subscription.prefix, change.key, strlen(subscription.prefix)) == 0))
+            {
+                slots[count] = i;
+                matches[count++] = subscription;
+            }
+        }
+
+        notifyPass++; // Odd until every match has been called.  unsubscribe() waits on it.
+        xSemaphoreGive(semNVSNotify);
+
+        for (uint8_t i = 0; i < count; i++)
+        {
+            xSemaphoreTake(semNVSNotify, portMAX_DELAY); // An earlier callback in this pass may have unsubscribed it
+            const NVS_SUBSCRIPTION &current = subscriptions[slots[i]];
+            bool live = current.active && (current.callback == matches[i].callback) && (current.context == matches[i].context) &&
+                        (current.queue == matches[i].queue);
+            xSemaphoreGive(semNVSNotify);
+
+            if (!live)
+                continue;
+
+            if (matches[i].queue != nullptr)
+            {
+                if (xQueueSend(matches[i].queue, &change, 0) != pdTRUE)
+                    droppedChanges++;
+            }
+            else
+                matches[i].callback(change, matches[i].context);
+        }
+
+        notifyPass++;
+    }
+}
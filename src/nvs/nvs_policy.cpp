@@ -0,0 +1,169 @@
+#include "nvs/nvs_.hpp"
+#include "system_.hpp"
+
+#include <string.h>
+
+extern SemaphoreHandle_t semNVSShadowTable;
+//
+// Per-key write policies.  Keys such as a dimmer level change many times a second while a user drags a slider, and compare-before-write
+// can't help when the value really is changing.  A policy lets such a key reach flash at most so often, only once it has settled, and no
+// more than so many times an hour.
+//
+// Policies live in the namespace's shadow.  Writes always land in RAM straight away, so reads see them at once.  It is the flush which
+// consults the policy: an entry that isn't allowed out yet just stays dirty.  Held back entries go out at a later close, at the next
+// write-behind pass (enableWriteBehind() retries them every interval) or unconditionally on flush(), flushShadowCache() and
+// disableShadowCache().  Writes which bypass the shadow because its budget is full are not limited, so a policy needs a shadow with a
+// budget.  One shadowed with none, by a key directory say, is given NVS_SHADOW_DEFAULT_BUDGET.
+//
+// Every key written through a shadow gets a record in the same list, with no limits unless setWritePolicy() gives it some.  Its counters
+// show which keys wear the flash before anyone has thought to limit them.  A record costs about 70 bytes outside the shadow budget, and
+// records stay for as long as the namespace is shadowed.
+//
+/* Public Member Functions */
+esp_err_t NVS::setWritePolicy(const char *name_space, const char *key, const NVS_WRITE_POLICY &policy)
+{
+    ESP_RETURN_ON_ERROR(enableShadowCache(name_space), TAG, "enableShadowCache() failed..."); // Raises a budget of 0
+
+    SemaphoreHandle_t lock = namespaceLock(name_space); // Flushes walk the policy list under this lock
+    xSemaphoreTakeRecursive(lock, portMAX_DELAY);
+
+    esp_err_t ret = ESP_OK;
+    NVS_SHADOW *shadow = findShadow(name_space);
+
+    if (shadow == nullptr)
+        ret = ESP_ERR_NOT_FOUND;
+    else if (shadow->stats.budgetBytes == 0) // Nothing would ever be held back
+        ret = ESP_ERR_INVALID_STATE;
+    else
+        keyRecord(shadow, key)->policy = policy; // Changing the limits keeps the counters
+
+    xSemaphoreGiveRecursive(lock);
+
+    if (ret == ESP_ERR_INVALID_STATE)
+        routeLogByFormat<LOG_TYPE::ERROR>("%s(): Namespace %s has no shadow budget, so key %s can't be limited", __func__, name_space, key);
+    return ret;
+}
+
+esp_err_t NVS::getKeyWriteStats(const char *name_space, const char *key, NVS_KEY_WRITE_STATS *stats)
+{
+    SemaphoreHandle_t lock = namespaceLock(name_space);
+    xSemaphoreTakeRecursive(lock, portMAX_DELAY);
+
+    esp_err_t ret = ESP_ERR_NOT_FOUND;
+    NVS_SHADOW *shadow = findShadow(name_space);
+    NVS_KEY_POLICY *policy = (shadow != nullptr) ? findPolicy(shadow, key) : nullptr;
+
+    if (policy != nullptr)
+    {
+        *stats = policy->stats;
+        ret = ESP_OK;
+    }
+
+    xSemaphoreGiveRecursive(lock);
+    return ret;
+}
+
+/* Private Member Functions */
+NVS_KEY_POLICY *NVS::findPolicy(NVS_SHADOW *shadow, const char *key)
+{
+    for (auto &policy : shadow->policies)
+        if (strncmp(policy.key, key, NVS_KEY_NAME_MAX_SIZE) == 0)
+            return &policy;
+    return nullptr;
+}
+
+// Any pointer previously returned by findPolicy() is invalid after this call
+NVS_KEY_POLICY *NVS::keyRecord(NVS_SHADOW *shadow, const char *key)
+{
+    NVS_KEY_POLICY *record = findPolicy(shadow, key);
+
+    if (record != nullptr)
+        return record;
+
+    NVS_KEY_POLICY keyPolicy = {}; // No limits.  It only counts.
+    strncpy(keyPolicy.key, key, NVS_KEY_NAME_MAX_SIZE - 1);
+    shadow->policies.push_back(keyPolicy);
+    return &shadow->policies.back();
+}
+
+bool NVS::policyAllows(NVS_KEY_POLICY *keyPolicy, int64_t now)
+{
+    const NVS_WRITE_POLICY &policy = keyPolicy->policy;
+
+    if (now - keyPolicy->hourStart >= 3600LL * 1000000) // A fresh window each hour
+    {
+        keyPolicy->hourStart = now;
+        keyPolicy->writesThisHour = 0;
+    }
+
+    if ((policy.minIntervalMs > 0) && (keyPolicy->stats.flashWrites > 0) && (now - keyPolicy->lastWrite < (int64_t)policy.minIntervalMs * 1000))
+        return false;
+
+    if ((policy.settleMs > 0) && (now - keyPolicy->lastChange < (int64_t)policy.settleMs * 1000))
+        return false;
+
+    if ((policy.maxWritesPerHour > 0) && (keyPolicy->writesThisHour >= policy.maxWritesPerHour))
+        return false;
+
+    return true;
+}
+
+// A namespace without write-behind only flushes as it closes, so a held back entry would otherwise wait for the namespace to be opened
+// and closed again.  This runs on the caller's task and forces everything out.
+esp_err_t NVS::flushHeldBack()
+{
+    char names[NVS_SHADOW_MAX_NAMESPACES][NVS_KEY_NAME_MAX_SIZE] = {};
+    uint8_t count = 0;
+    esp_err_t firstError = ESP_OK;
+
+    xSemaphoreTake(semNVSShadowTable, portMAX_DELAY); // Copy the names.  We can't hold the table while we wait on namespace locks.
+
+    for (auto slot : shadows)
+        if ((slot != nullptr) && !slot->writeBehind)
+            memcpy(names[count++], slot->name_space, NVS_KEY_NAME_MAX_SIZE);
+
+    xSemaphoreGive(semNVSShadowTable);
+
+    for (uint8_t i = 0; i < count; i++)
+    {
+        SemaphoreHandle_t lock = namespaceLock(names[i]);
+        xSemaphoreTakeRecursive(lock, portMAX_DELAY);
+
+        NVS_SHADOW *shadow = attachShadow(names[i]);
+        bool dirty = false;
+
+        if (shadow != nullptr)
+            for (const auto &entry : shadow->entries)
+                dirty |= entry.dirty;
+
+        if (dirty)
+        {
+            NVS_OpTimer timer(NVS_OP::COMMIT);
+            nvs_handle_t handle = 0;
+            esp_err_t ret = openNamespace(names[i], &handle);
+
+            if (ret == ESP_OK)
+            {
+                ret = shadowFlush(handle, shadow, true);
+                esp_err_t commitRet = nvs_commit(handle);
+
+                if (ret == ESP_OK)
+                    ret = commitRet;
+                nvs_close(handle);
+            }
+
+            if (ret != ESP_OK) // Failed entries stay dirty
+            {
+                routeLogByFormat<LOG_TYPE::ERROR>("%s(): Flush of namespace %s failed, code = %s", __func__, names[i], esp_err_to_name(ret));
+
+                if (firstError == ESP_OK)
+                    firstError = ret;
+            }
+        }
+
+        detachShadow(shadow);
+        xSemaphoreGiveRecursive(lock);
+    }
+
+    return firstError;
+}
@@ -0,0 +1,333 @@
+#include "nvs/nvs_.hpp"
+#include "system_.hpp"
+
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+//
+// nvs_flash_init() gives ESP_ERR_NVS_NO_FREE_PAGES when every page is in use.  Nothing is wrong with the entries themselves, but the IDF
+// will not mount the partition, so we can't read them back through the API.  Rather than erase every user setting, recoverNVS() reads the
+// pages directly, keeps every entry whose CRCs check out, erases, mounts and writes them back with one commit per namespace.
+//
+// The page layout read here is the one described under "NVS internals" in the IDF documentation.  Each 4096 byte page is a 32 byte header,
+// a 32 byte table of 2 bit entry states and 126 entries of 32 bytes.  Strings and blob chunks carry their data in the entries which follow
+// their own.  Where a key appears more than once the copy on the page with the higher sequence number wins, just as it does in the IDF.
+//
+// An encrypted partition can't be read this way and a newer format shouldn't be guessed at, so those are still erased as before.
+//
+constexpr size_t PAGE_SIZE = 4096;
+constexpr size_t ENTRY_SIZE = 32;
+constexpr uint8_t ENTRY_COUNT = 126;
+constexpr size_t ENTRY_TABLE_OFFSET = 32;
+constexpr size_t ENTRIES_OFFSET = 64;
+
+constexpr uint32_t PAGE_ACTIVE = 0xFFFFFFFE;
+constexpr uint32_t PAGE_FULL = 0xFFFFFFFC;
+constexpr uint32_t PAGE_FREEING = 0xFFFFFFF8;
+constexpr uint8_t PAGE_VERSION1 = 0xFF;
+constexpr uint8_t PAGE_VERSION2 = 0xFE;
+
+constexpr uint8_t ENTRY_WRITTEN = 0x02;
+
+constexpr uint8_t ITEM_STR = 0x21;
+constexpr uint8_t ITEM_BLOB = 0x41; // Version 1 blob held whole on one page
+constexpr uint8_t ITEM_BLOB_DATA = 0x42;
+constexpr uint8_t ITEM_BLOB_IDX = 0x48;
+constexpr uint8_t NAMESPACE_INDEX = 0; // Namespace names are u8 entries in namespace 0 whose value is the index they stand for
+constexpr uint8_t NAMESPACE_ANY = 0xFF;
+
+struct RAW_ITEM // One 32 byte entry exactly as it sits in flash
+{
+    uint8_t nsIndex;
+    uint8_t type;
+    uint8_t span;
+    uint8_t chunkIndex;
+    uint32_t crc32;
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    uint8_t data[8];
+};
+static_assert(sizeof(RAW_ITEM) == ENTRY_SIZE, "RAW_ITEM must match the flash entry");
+
+struct RECOVERED_ITEM
+{
+    uint8_t nsIndex;
+    uint8_t type;
+    uint8_t chunkIndex;
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    uint8_t data[8];              // Integers, or the size fields of a blob index
+    std::vector<uint8_t> payload; // Strings and blob chunks
+};
+
+static uint32_t itemCRC(const RAW_ITEM *item)
+{
+    uint32_t crc = 0xFFFFFFFF;
+    crc = esp_rom_crc32_le(crc, (const uint8_t *)item, offsetof(RAW_ITEM, crc32));
+    crc = esp_rom_crc32_le(crc, (const uint8_t *)item->key, sizeof(item->key));
+    return esp_rom_crc32_le(crc, item->data, sizeof(item->data));
+}
+
+static bool isInteger(uint8_t type)
+{
+    return ((type & 0xE0) == 0) && ((type & 0x0F) != 0) && ((type & 0x0F) <= 8); // u8 .. i64
+}
+
+static bool sameItem(const RECOVERED_ITEM &a, const RECOVERED_ITEM &b)
+{
+    return (a.nsIndex == b.nsIndex) && (a.chunkIndex == b.chunkIndex) && ((a.type == ITEM_BLOB_DATA) == (b.type == ITEM_BLOB_DATA)) &&
+           (strncmp(a.key, b.key, NVS_KEY_NAME_MAX_SIZE) == 0);
+}
+
+static esp_err_t writeBack(nvs_handle_t handle, const RECOVERED_ITEM &item, const std::vector<RECOVERED_ITEM> &items)
+{
+    if (isInteger(item.type))
+    {
+        uint64_t value = 0; // Only the low bytes count, so the whole field can be copied whatever the width
+        memcpy(&value, item.data, sizeof(value));
+        return nvsSetInteger(handle, item.key, (nvs_type_t)item.type, value);
+    }
+
+    if (item.type == ITEM_STR)
+    {
+        if (item.payload.empty() || (item.payload.back() != 0))
+            return ESP_ERR_INVALID_SIZE;
+        return nvs_set_str(handle, item.key, (const char *)item.payload.data());
+    }
+
+    if (item.type == ITEM_BLOB)
+        return nvs_set_blob(handle, item.key, item.payload.data(), item.payload.size());
+
+    // ITEM_BLOB_IDX.  Put the chunks back together in order.  A missing chunk means the blob was being rewritten when the page filled.
+    uint32_t size = 0;
+    memcpy(&size, item.data, sizeof(size));
+    uint8_t chunkCount = item.data[4];
+    uint8_t chunkStart = item.data[5];
+
+    std::vector<uint8_t> blob;
+    blob.reserve(size);
+
+    for (uint8_t chunk = chunkStart; chunk < chunkStart + chunkCount; chunk++)
+    {
+        const RECOVERED_ITEM *found = nullptr;
+
+        for (const auto &candidate : items)
+            if ((candidate.type == ITEM_BLOB_DATA) && (candidate.nsIndex == item.nsIndex) && (candidate.chunkIndex == chunk) &&
+                (strncmp(candidate.key, item.key, NVS_KEY_NAME_MAX_SIZE) == 0))
+                found = &candidate;
+
+        if (found == nullptr)
+            return ESP_ERR_NOT_FOUND;
+
+        blob.insert(blob.end(), found->payload.begin(), found->payload.end());
+    }
+
+    if (blob.size() != size)
+        return ESP_ERR_INVALID_SIZE;
+
+    return nvs_set_blob(handle, item.key, blob.data(), blob.size());
+}
+
+/* Public Member Functions */
+void NVS::setFreeEntryWarning(size_t threshold)
+{
+    freeEntryWarning = threshold;
+    lowOnSpace = 0; // Let the next commit warn again against the new threshold
+}
+
+/* Private Member Functions */
+esp_err_t NVS::recoverNVS(const char *label)
+{
+    const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_NVS, label);
+
+    if ((partition == nullptr) || partition->encrypted)
+        return ESP_ERR_NOT_SUPPORTED;
+
+    uint8_t *page = (uint8_t *)malloc(PAGE_SIZE);
+
+    if (page == nullptr)
+        return ESP_ERR_NO_MEM;
+
+    std::vector<std::pair<uint32_t, uint32_t>> pages; // Sequence number and offset of every page holding entries
+
+    for (uint32_t offset = 0; offset + PAGE_SIZE <= partition->size; offset += PAGE_SIZE)
+    {
+        uint32_t header[3] = {}; // State, sequence number and the word holding the version
+
+        if (esp_partition_read(partition, offset, header, sizeof(header)) != ESP_OK)
+            continue;
+
+        uint8_t version = (uint8_t)header[2];
+
+        if (((header[0] == PAGE_ACTIVE) || (header[0] == PAGE_FULL) || (header[0] == PAGE_FREEING)) && ((version == PAGE_VERSION1) || (version == PAGE_VERSION2)))
+            pages.push_back({header[1], offset});
+    }
+
+    std::sort(pages.begin(), pages.end()); // Oldest first, so a newer copy of a key replaces an older one
+
+    std::vector<RECOVERED_ITEM> items;
+    size_t heldBytes = 0;
+    uint16_t dropped = 0;
+
+    for (const auto &[sequence, offset] : pages)
+    {
+        if (esp_partition_read(partition, offset, page, PAGE_SIZE) != ESP_OK)
+            continue;
+
+        const uint8_t *stateTable = &page[ENTRY_TABLE_OFFSET];
+        uint8_t index = 0;
+
+        while (index < ENTRY_COUNT)
+        {
+            uint8_t state = (stateTable[index / 4] >> ((index % 4) * 2)) & 0x03;
+
+            if (state != ENTRY_WRITTEN)
+            {
+                index++;
+                continue;
+            }
+
+            const RAW_ITEM *raw = (const RAW_ITEM *)&page[ENTRIES_OFFSET + index * ENTRY_SIZE];
+            uint8_t span = ((raw->span > 0) && (raw->span <= ENTRY_COUNT - index)) ? raw->span : 1;
+
+            if ((raw->crc32 != itemCRC(raw)) || (raw->nsIndex == NAMESPACE_ANY) || (raw->span != span))
+            {
+                dropped++;
+                index++; // The span can't be trusted either
+                continue;
+            }
+
+            RECOVERED_ITEM item = {};
+            item.nsIndex = raw->nsIndex;
+            item.type = raw->type;
+            item.chunkIndex = (raw->type == ITEM_BLOB_DATA) ? raw->chunkIndex : 0;
+            memcpy(item.key, raw->key, sizeof(item.key));
+            item.key[NVS_KEY_NAME_MAX_SIZE - 1] = 0;
+            memcpy(item.data, raw->data, sizeof(item.data));
+
+            bool valid = isInteger(raw->type) || (raw->type == ITEM_BLOB_IDX);
+
+            if ((raw->type == ITEM_STR) || (raw->type == ITEM_BLOB) || (raw->type == ITEM_BLOB_DATA))
+            {
+                uint16_t size = 0;
+                uint32_t dataCRC = 0;
+                memcpy(&size, &raw->data[0], sizeof(size));
+                memcpy(&dataCRC, &raw->data[4], sizeof(dataCRC));
+
+                const uint8_t *data = (const uint8_t *)raw + ENTRY_SIZE;
+                valid = (size <= (span - 1) * ENTRY_SIZE) && (esp_rom_crc32_le(0xFFFFFFFF, data, size) == dataCRC);
+
+                if (valid)
+                    item.payload.assign(data, data + size);
+            }
+
+            index += span;
+
+            if (!valid) // Also an item type we don't know
+            {
+                dropped++;
+                continue;
+            }
+
+            auto older = std::find_if(items.begin(), items.end(), [&item](const RECOVERED_ITEM &held) { return sameItem(held, item); });
+
+            if (older != items.end())
+            {
+                heldBytes -= older->payload.size() + sizeof(RECOVERED_ITEM);
+                items.erase(older);
+            }
+
+            if (heldBytes + item.payload.size() + sizeof(RECOVERED_ITEM) > NVS_RECOVERY_BUDGET)
+            {
+                routeLogByFormat<LOG_TYPE::WARN>("%s(): Over budget, dropping %s", __func__, item.key);
+                dropped++;
+                continue;
+            }
+
+            heldBytes += item.payload.size() + sizeof(RECOVERED_ITEM);
+            items.push_back(std::move(item));
+        }
+    }
+
+    free(page);
+
+    routeLogByFormat<LOG_TYPE::WARN>("%s(): ********** Erasing %s, %u entries held in RAM **********", __func__, label, (unsigned)items.size());
+    ESP_ERROR_CHECK(nvs_flash_erase_partition(label));
+    ESP_ERROR_CHECK(nvs_flash_init_partition(label));
+
+    uint16_t kept = 0;
+
+    for (const auto &item : items) // Entries whose namespace name was lost have nowhere to go
+    {
+        if ((item.nsIndex == NAMESPACE_INDEX) || (item.type == ITEM_BLOB_DATA))
+            continue;
+
+        if (std::none_of(items.begin(), items.end(), [&item](const RECOVERED_ITEM &name) { return (name.nsIndex == NAMESPACE_INDEX) && (name.data[0] == item.nsIndex); }))
+            dropped++;
+    }
+
+    for (const auto &name : items) // One pass per namespace so each gets a single commit
+    {
+        if ((name.nsIndex != NAMESPACE_INDEX) || (name.type != NVS_TYPE_U8))
+            continue;
+
+        nvs_handle_t handle = 0;
+        esp_err_t ret = nvs_open_from_partition(label, name.key, NVS_READWRITE, &handle);
+
+        for (const auto &item : items)
+        {
+            if ((item.nsIndex != name.data[0]) || (item.type == ITEM_BLOB_DATA))
+                continue;
+
+            if ((ret == ESP_OK) && (writeBack(handle, item, items) == ESP_OK))
+                kept++;
+            else
+            {
+                routeLogByFormat<LOG_TYPE::WARN>("%s(): Dropped %s:%s", __func__, name.key, item.key);
+                dropped++;
+            }
+        }
+
+        if (ret == ESP_OK)
+        {
+            nvs_commit(handle);
+            nvs_close(handle);
+        }
+    }
+
+    initReport.keptEntries += kept; // Totals across every partition we have recovered
+    initReport.droppedEntries += dropped;
+
+    routeLogByFormat<LOG_TYPE::WARN>("%s(): Recovered %u entries, dropped %u", __func__, (unsigned)kept, (unsigned)dropped);
+    return ESP_OK;
+}
+
+// Called after each commit with the partition committed to.  nvs_get_stats() only totals the page counters the IDF already holds in RAM,
+// so this reads no flash.  Each partition warns once on its own, so a full hot partition isn't hidden by a roomy default one.
+void NVS::checkFreeEntries(const char *partition)
+{
+    if (freeEntryWarning == 0)
+        return;
+
+    nvs_stats_t stats = {};
+
+    if (nvs_get_stats(partition, &stats) != ESP_OK)
+        return;
+
+    uint8_t slot = 0;
+    uint8_t count = partitionCount;
+
+    for (uint8_t i = 0; i < count; i++)
+        if (strcmp(partitions[i], partition) == 0)
+            slot = i + 1;
+
+    uint8_t bit = (uint8_t)(1 << slot);
+    bool low = (stats.free_entries < freeEntryWarning);
+
+    if (low && !(lowOnSpace.fetch_or(bit) & bit))
+        routeLogByFormat<LOG_TYPE::WARN>("%s(): Only %u free entries left on %s (warning below %u)", __func__, (unsigned)stats.free_entries, partition,
+                                         (unsigned)freeEntryWarning);
+    else if (!low)
+        lowOnSpace.fetch_and((uint8_t)~bit);
+}
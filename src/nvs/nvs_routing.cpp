@@ -0,0 +1,131 @@
+#include "nvs/nvs_.hpp"
+#include "system_.hpp"
+
+#include <string.h>
+
+extern SemaphoreHandle_t semNVSRoutes;
+//
+// Namespaces can be placed on partitions other than the default one.  Keys which are rewritten all the time go to a small "hot"
+// partition, and provisioning data which is written once goes to a "cold" one.  Garbage collection on the hot partition then never has to
+// copy the cold entries along with it, so there are fewer page erases and each one is shorter.
+//
+//     nvs->routeNamespace("dimmer", "nvs_hot");   // Mounts nvs_hot
+//     nvs->routeNamespace("factory", "nvs_cold");
+//
+// Every namespace we open goes through openNamespace().  Routes and mounted partitions are only ever added.  An entry is filled in before
+// its count is published, so lookups on the open path take no lock.  Only adding one takes semNVSRoutes.
+//
+/* Public Member Functions */
+esp_err_t NVS::mountPartition(const char *partition)
+{
+    waitForInit();
+
+    if (strcmp(partition, NVS_DEFAULT_PART_NAME) == 0)
+        return ESP_OK;
+
+    if (strlen(partition) > NVS_PART_NAME_MAX_SIZE)
+        return ESP_ERR_INVALID_ARG;
+
+    xSemaphoreTake(semNVSRoutes, portMAX_DELAY);
+
+    esp_err_t ret = ESP_OK;
+    uint8_t count = partitionCount;
+    bool mounted = false;
+
+    for (uint8_t i = 0; i < count; i++)
+        mounted |= (strcmp(partitions[i], partition) == 0);
+
+    if (!mounted && (count == NVS_MAX_PARTITIONS))
+        ret = ESP_ERR_NO_MEM;
+    else if (!mounted)
+    {
+        ret = initPartition(partition);
+
+        if (ret == ESP_OK)
+        {
+            strncpy(partitions[count], partition, NVS_PART_NAME_MAX_SIZE);
+            partitionCount = count + 1;
+        }
+        else
+            routeLogByFormat<LOG_TYPE::ERROR>("%s(): Unable to mount %s, code = %s", __func__, partition, esp_err_to_name(ret));
+    }
+
+    xSemaphoreGive(semNVSRoutes);
+    return ret;
+}
+
+esp_err_t NVS::routeNamespace(const char *name_space, const char *partition)
+{
+    if (strlen(name_space) >= NVS_KEY_NAME_MAX_SIZE)
+        return ESP_ERR_NVS_KEY_TOO_LONG;
+
+    ESP_RETURN_ON_ERROR(mountPartition(partition), TAG, "mountPartition() failed...");
+
+    xSemaphoreTake(semNVSRoutes, portMAX_DELAY);
+
+    esp_err_t ret = ESP_OK;
+    const char *current = getPartition(name_space);
+
+    if (strcmp(current, partition) == 0) // Already there
+        ret = ESP_OK;
+    else if (strcmp(current, NVS_DEFAULT_PART_NAME) != 0) // Moving it would strand whatever was written on the old partition
+        ret = ESP_ERR_INVALID_STATE;
+    else if (routeCount == NVS_MAX_ROUTES)
+        ret = ESP_ERR_NO_MEM;
+    else
+    {
+        uint8_t count = routeCount;
+        strncpy(routes[count].name_space, name_space, NVS_KEY_NAME_MAX_SIZE - 1);
+        strncpy(routes[count].partition, partition, NVS_PART_NAME_MAX_SIZE);
+        routeCount = count + 1;
+    }
+
+    xSemaphoreGive(semNVSRoutes);
+
+    if (ret == ESP_ERR_INVALID_STATE)
+        routeLogByFormat<LOG_TYPE::ERROR>("%s(): %s is already routed to %s", __func__, name_space, current);
+    return ret;
+}
+
+const char *NVS::getPartition(const char *name_space)
+{
+    uint8_t count = routeCount;
+
+    for (uint8_t i = 0; i < count; i++)
+        if (strncmp(routes[i].name_space, name_space, NVS_KEY_NAME_MAX_SIZE) == 0)
+            return routes[i].partition;
+
+    return NVS_DEFAULT_PART_NAME;
+}
+
+/* Private Member Functions */
+// The mount itself, with the same recovery as the default partition.  mount reports which way it went.
+esp_err_t NVS::initPartition(const char *partition, NVS_MOUNT *mount)
+{
+    NVS_MOUNT path = NVS_MOUNT::CLEAN;
+    esp_err_t ret = nvs_flash_init_partition(partition);
+
+    if ((ret == ESP_ERR_NVS_NO_FREE_PAGES) && (recoverNVS(partition) == ESP_OK))
+    {
+        path = NVS_MOUNT::RECOVERED;
+        ret = ESP_OK;
+    }
+    else if ((ret == ESP_ERR_NVS_NO_FREE_PAGES) || (ret == ESP_ERR_NVS_NEW_VERSION_FOUND))
+    {
+        routeLogByFormat<LOG_TYPE::WARN>("%s(): ********** Erasing %s for use. **********", __func__, partition);
+        path = NVS_MOUNT::ERASED;
+        ret = nvs_flash_erase_partition(partition);
+
+        if (ret == ESP_OK)
+            ret = nvs_flash_init_partition(partition);
+    }
+
+    if (mount != nullptr)
+        *mount = (ret == ESP_OK) ? path : NVS_MOUNT::FAILED;
+    return ret;
+}
+
+esp_err_t NVS::openNamespace(const char *name_space, nvs_handle_t *handle)
+{
+    return nvs_open_from_partition(getPartition(name_space), name_space, NVS_READWRITE, handle);
+}
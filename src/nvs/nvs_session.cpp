@@ -0,0 +1,156 @@
+#include "nvs/nvs_.hpp"
+#include "system_.hpp"
+
+extern SemaphoreHandle_t semNVSNamespace[NVS_NAMESPACE_LOCKS];
+//
+// A session replaces the semNVSEntry + openNVSStorage() + closeNVStorage() ritual.  A typical use looks like this:
+//
+//     {
+//         NVS_Session session = nvs->openSession("wifi");
+//         if (session.isOpen())
+//             session.readU8Integer("channel", &channel);
+//     } // Commit, close and unlock happen here
+//
+// Each namespace hashes onto one of NVS_NAMESPACE_LOCKS recursive mutexes.  Two tasks only wait on each other when their namespaces share
+// a lock.  Because the mutexes are recursive, a task may hold sessions on two namespaces which happen to share a lock.
+//
+/* NVS Member Functions */
+NVS_Session NVS::openSession(const char *name_space, TickType_t ticksToWait)
+{
+    NVS_OpTimer timer(NVS_OP::OPEN); // Includes any wait on the namespace lock
+
+    if (waitForInit(ticksToWait) != ESP_OK) // Only while a deferred mount is still running
+    {
+        routeLogByFormat<LOG_TYPE::WARN>("%s(): Timed out waiting on the mount for namespace %s", __func__, name_space);
+        return NVS_Session(ESP_ERR_TIMEOUT);
+    }
+
+    SemaphoreHandle_t lock = namespaceLock(name_space);
+
+    if (xSemaphoreTakeRecursive(lock, ticksToWait) != pdTRUE)
+    {
+        routeLogByFormat<LOG_TYPE::WARN>("%s(): Timed out waiting on namespace %s", __func__, name_space);
+        return NVS_Session(ESP_ERR_TIMEOUT);
+    }
+
+    nvs_handle_t handle = 0;
+    esp_err_t ret = openNamespace(name_space, &handle);
+
+    if (ret != ESP_OK)
+    {
+        xSemaphoreGiveRecursive(lock);
+        routeLogByFormat<LOG_TYPE::ERROR>("%s(): nvs_open() failed for namespace %s, code = %s", __func__, name_space, esp_err_to_name(ret));
+        return NVS_Session(ret);
+    }
+
+    NVS_Session session(this, lock, handle, attachShadow(name_space));
+    session.partition = getPartition(name_space); // Routes are only ever added, so the name stays put
+    return session;
+}
+
+SemaphoreHandle_t NVS::namespaceLock(const char *name_space)
+{
+    uint32_t hash = 2166136261; // FNV-1a
+
+    for (const char *c = name_space; *c != 0; c++)
+        hash = (hash ^ (uint8_t)*c) * 16777619;
+
+    return semNVSNamespace[hash % NVS_NAMESPACE_LOCKS];
+}
+
+/* Construction / Destruction */
+NVS_Session::NVS_Session(NVS *owner, SemaphoreHandle_t heldLock, nvs_handle_t openHandle, NVS_SHADOW *attachedShadow)
+    : nvs(owner), lock(heldLock), handle(openHandle), shadow(attachedShadow), status(ESP_OK)
+{
+}
+
+NVS_Session::~NVS_Session()
+{
+    close();
+}
+
+NVS_Session::NVS_Session(NVS_Session &&other) noexcept
+    : nvs(other.nvs), lock(other.lock), handle(other.handle), shadow(other.shadow), partition(other.partition), commitOnClose(other.commitOnClose),
+      status(other.status)
+{
+    other.lock = nullptr; // The moved-from session owns nothing and will not commit.
+    other.handle = 0;
+    other.shadow = nullptr;
+}
+
+NVS_Session &NVS_Session::operator=(NVS_Session &&other) noexcept
+{
+    if (this != &other)
+    {
+        close(); // Release whatever we held before taking over
+
+        nvs = other.nvs;
+        lock = other.lock;
+        handle = other.handle;
+        shadow = other.shadow;
+        partition = other.partition;
+        commitOnClose = other.commitOnClose;
+        status = other.status;
+
+        other.lock = nullptr;
+        other.handle = 0;
+        other.shadow = nullptr;
+    }
+    return *this;
+}
+
+/* Public Member Functions */
+esp_err_t NVS_Session::close()
+{
+    if (handle == 0)
+        return ESP_OK;
+
+    NVS_OpTimer timer(NVS_OP::CLOSE);
+    esp_err_t ret = ESP_OK;
+
+    if (commitOnClose)
+    {
+        NVS_OpTimer commitTimer(NVS_OP::COMMIT);
+
+        if ((shadow != nullptr) && !shadow->writeBehind) // Dirty shadow entries share the one commit below.
+            ret = nvs->shadowFlush(handle, shadow);
+
+        esp_err_t commitRet = nvs_commit(handle);
+
+        if (ret == ESP_OK)
+            ret = commitRet;
+
+        nvs->checkFreeEntries(partition);
+    }
+
+    nvs->writeBehindNotice(shadow); // A write-behind namespace leaves its dirty entries for the task
+    nvs_close(handle);
+    handle = 0;
+    nvs->detachShadow(shadow);
+    shadow = nullptr;
+
+    if (lock != nullptr)
+    {
+        xSemaphoreGiveRecursive(lock);
+        lock = nullptr;
+    }
+
+    return ret;
+}
+
+esp_err_t NVS_Session::readBoolean(const char *key, bool *value) { return read<bool>(key, value); }
+esp_err_t NVS_Session::writeBoolean(const char *key, bool newValue) { return write<bool>(key, newValue); }
+
+esp_err_t NVS_Session::readString(const char *key, std::string *strValue) { return (nvs == nullptr) ? ESP_ERR_NVS_INVALID_HANDLE : nvs->readStringFromNVS(handle, shadow, key, strValue); }
+esp_err_t NVS_Session::readString(const char *key, char *buffer, size_t bufferSize) { return (nvs == nullptr) ? ESP_ERR_NVS_INVALID_HANDLE : nvs->readStringFromNVS(handle, shadow, key, buffer, bufferSize); }
+esp_err_t NVS_Session::writeString(const char *key, std::string *newValue) { return (nvs == nullptr) ? ESP_ERR_NVS_INVALID_HANDLE : nvs->writeStringToNVS(handle, shadow, key, newValue->c_str()); }
+esp_err_t NVS_Session::writeString(const char *key, const char *newValue) { return (nvs == nullptr) ? ESP_ERR_NVS_INVALID_HANDLE : nvs->writeStringToNVS(handle, shadow, key, newValue); }
+
+esp_err_t NVS_Session::readU8Integer(const char *key, uint8_t *intValue) { return read<uint8_t>(key, intValue); }
+esp_err_t NVS_Session::writeU8Integer(const char *key, uint8_t newValue) { return write<uint8_t>(key, newValue); }
+
+esp_err_t NVS_Session::readI32Integer(const char *key, int32_t *intValue) { return read<int32_t>(key, intValue); }
+esp_err_t NVS_Session::writeI32Integer(const char *key, int32_t newValue) { return write<int32_t>(key, newValue); }
+
+esp_err_t NVS_Session::readU32Integer(const char *key, uint32_t *intValue) { return read<uint32_t>(key, intValue); }
+esp_err_t NVS_Session::writeU32Integer(const char *key, uint32_t newValue) { return write<uint32_t>(key, newValue); }
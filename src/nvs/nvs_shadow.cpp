@@ -0,0 +1,347 @@
+#include "nvs/nvs_.hpp"
+#include "system_.hpp"
+
+#include "esp_timer.h"
+
+#include <algorithm>
+#include <string.h>
+
+extern SemaphoreHandle_t semNVSShadowTable;
+//
+// A shadow is an optional RAM copy of a namespace.  Once a namespace has been enabled for shadowing, every openNVSStorage() of that
+// namespace attaches the shadow.  Reads are answered from RAM after the first load, and writes are compared against RAM.  A write that
+// changes a value only marks the entry as dirty.  Dirty entries are pushed out to flash with a single commit inside closeNVStorage()
+// or flushShadowCache().
+//
+// Each shadow has a byte budget.  When the budget is exhausted, clean entries are evicted first.  If there is still no room, the
+// operation bypasses the shadow and goes straight to flash as it always has.
+//
+// The slot table is guarded by semNVSShadowTable.  The entries of a shadow are guarded by the lock of its namespace, which is held by
+// openNVSStorage() and by every NVS_Session.
+//
+/* Public Member Functions */
+// A namespace already shadowed keeps its shadow.  A key directory, compression or a subscription shadow it with no budget, so a caller
+// asking for caching raises the budget to what it asked for.  Budgets only grow, so no entry is ever evicted by another caller's request.
+esp_err_t NVS::enableShadowCache(const char *name_space, size_t budgetBytes)
+{
+    SemaphoreHandle_t lock = namespaceLock(name_space); // shadowStore() reads the budget under this lock
+    xSemaphoreTakeRecursive(lock, portMAX_DELAY);
+    xSemaphoreTake(semNVSShadowTable, portMAX_DELAY); // One hold for the lookup and the insert, so two tasks can't both add one
+
+    NVS_SHADOW **empty = nullptr;
+    esp_err_t ret = ESP_ERR_NO_MEM;
+
+    for (auto &slot : shadows)
+    {
+        if ((slot != nullptr) && (strncmp(slot->name_space, name_space, NVS_KEY_NAME_MAX_SIZE) == 0))
+        {
+            if (budgetBytes > 0) // Asked for in its own right now, so it outlives its subscribers
+            {
+                slot->forNotify = false;
+                slot->stats.budgetBytes = std::max(slot->stats.budgetBytes, budgetBytes);
+            }
+
+            budgetBytes = slot->stats.budgetBytes;
+            empty = nullptr;
+            ret = ESP_OK;
+            break;
+        }
+
+        if ((slot == nullptr) && (empty == nullptr))
+            empty = &slot;
+    }
+
+    if ((ret != ESP_OK) && (empty != nullptr))
+    {
+        *empty = new NVS_SHADOW();
+        strncpy((*empty)->name_space, name_space, NVS_KEY_NAME_MAX_SIZE - 1);
+        (*empty)->name_space[NVS_KEY_NAME_MAX_SIZE - 1] = 0;
+        (*empty)->stats.budgetBytes = budgetBytes;
+        ret = ESP_OK;
+    }
+
+    xSemaphoreGive(semNVSShadowTable);
+    xSemaphoreGiveRecursive(lock);
+
+    if (ret != ESP_OK)
+        routeLogByFormat<LOG_TYPE::ERROR>("%s(): No free shadow slots for namespace %s", __func__, name_space);
+    else if (show & _showNVS)
+        routeLogByFormat<LOG_TYPE::INFO>("%s(): Shadowing namespace %s with a budget of %zu", __func__, name_space, budgetBytes);
+    return ret;
+}
+
+esp_err_t NVS::disableShadowCache(const char *name_space)
+{
+    esp_err_t ret = ESP_OK;
+
+    SemaphoreHandle_t lock = namespaceLock(name_space); // Wait until no session is working inside this shadow.
+    xSemaphoreTakeRecursive(lock, portMAX_DELAY);
+    xSemaphoreTake(semNVSShadowTable, portMAX_DELAY);
+
+    for (auto &slot : shadows)
+    {
+        if ((slot == nullptr) || (strncmp(slot->name_space, name_space, NVS_KEY_NAME_MAX_SIZE) != 0))
+            continue;
+
+        if (slot->attached > 0) // Our lock is recursive, so this task may still hold the namespace open.  We can't pull the shadow out from under it.
+        {
+            routeLogByFormat<LOG_TYPE::ERROR>("%s(): Namespace %s is still open", __func__, name_space);
+            ret = ESP_ERR_INVALID_STATE;
+            break;
+        }
+
+        nvs_handle_t handle = 0; // Any dirty entries must reach flash before we let go of them.  We use our own handle so nvsHandle is left untouched.
+
+        if (openNamespace(name_space, &handle) == ESP_OK)
+        {
+            NVS_OpTimer timer(NVS_OP::COMMIT);
+
+            if (shadowFlush(handle, slot, true) == ESP_OK) // Write policies can't hold anything back from a shadow which is going away
+                nvs_commit(handle);
+            nvs_close(handle);
+        }
+        else
+            routeLogByFormat<LOG_TYPE::ERROR>("%s(): Unable to flush namespace %s before release", __func__, name_space);
+
+        delete slot;
+        slot = nullptr;
+        break;
+    }
+
+    xSemaphoreGive(semNVSShadowTable);
+    xSemaphoreGiveRecursive(lock);
+    return ret;
+}
+
+esp_err_t NVS::flushShadowCache()
+{
+    if (nvsHandle == 0)
+    {
+        routeLogByFormat<LOG_TYPE::ERROR>("%s(): You must openNVSStorage() first!", __func__);
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    }
+
+    if (activeShadow == nullptr) // Nothing to do for a namespace which isn't shadowed
+        return ESP_OK;
+
+    NVS_OpTimer timer(NVS_OP::COMMIT);
+    ESP_RETURN_ON_ERROR(shadowFlush(nvsHandle, activeShadow, true), TAG, "shadowFlush() failed...");
+    return nvs_commit(nvsHandle);
+}
+
+esp_err_t NVS::getShadowCacheStats(const char *name_space, NVS_SHADOW_STATS *stats)
+{
+    NVS_SHADOW *shadow = findShadow(name_space);
+
+    if (shadow == nullptr)
+        return ESP_ERR_NOT_FOUND;
+
+    *stats = shadow->stats;
+    return ESP_OK;
+}
+
+/* Private Member Functions */
+NVS_SHADOW *NVS::findShadow(const char *name_space)
+{
+    NVS_SHADOW *found = nullptr;
+
+    xSemaphoreTake(semNVSShadowTable, portMAX_DELAY);
+
+    for (auto slot : shadows)
+    {
+        if ((slot != nullptr) && (strncmp(slot->name_space, name_space, NVS_KEY_NAME_MAX_SIZE) == 0))
+        {
+            found = slot;
+            break;
+        }
+    }
+
+    xSemaphoreGive(semNVSShadowTable);
+    return found;
+}
+
+NVS_SHADOW_ENTRY *NVS::shadowLookup(NVS_SHADOW *shadow, const char *key, nvs_type_t type)
+{
+    if (shadow == nullptr)
+        return nullptr;
+
+    for (auto &entry : shadow->entries)
+    {
+        if ((entry.type == type) && (strncmp(entry.key, key, NVS_KEY_NAME_MAX_SIZE) == 0))
+        {
+            shadow->stats.hits++;
+            return &entry;
+        }
+    }
+
+    shadow->stats.misses++;
+    return nullptr;
+}
+
+// Called with the namespace lock held.  The count keeps disableShadowCache() from freeing a shadow which is still in use.
+NVS_SHADOW *NVS::attachShadow(const char *name_space)
+{
+    NVS_SHADOW *shadow = findShadow(name_space);
+
+    if (shadow != nullptr)
+    {
+        shadow->attached++;
+
+        if (shadow->directory.enabled && !shadow->directory.built)
+            directoryBuild(shadow);
+    }
+    return shadow;
+}
+
+void NVS::detachShadow(NVS_SHADOW *shadow)
+{
+    if ((shadow != nullptr) && (shadow->attached > 0))
+        shadow->attached--;
+}
+
+// Returns false when the value could not be held in RAM.  The caller must then go to flash directly.
+// Any pointer previously returned by shadowLookup() is invalid after this call.
+bool NVS::shadowStore(NVS_SHADOW *shadow, const char *key, nvs_type_t type, uint64_t value, const char *text, bool dirty)
+{
+    if (shadow == nullptr)
+        return false;
+
+    if (dirty) // On its way to flash either here or through the caller
+        directoryNote(shadow, key, type, (text == nullptr) ? (type & 0x0F) : strlen(text) + 1);
+
+    if (shadow->stats.budgetBytes == 0) // Held only for its key directory
+        return false;
+
+    auto &entries = shadow->entries;
+    size_t cost = sizeof(NVS_SHADOW_ENTRY) + ((text == nullptr) ? 0 : strlen(text));
+
+    for (auto it = entries.begin(); it != entries.end(); ++it) // Drop any existing entry for this key.  It is replaced below or it would become stale.
+    {
+        if (strncmp(it->key, key, NVS_KEY_NAME_MAX_SIZE) == 0)
+        {
+            shadow->stats.usedBytes -= sizeof(NVS_SHADOW_ENTRY) + it->text.length();
+            entries.erase(it);
+            break;
+        }
+    }
+
+    for (auto it = entries.begin(); (it != entries.end()) && (shadow->stats.usedBytes + cost > shadow->stats.budgetBytes);) // Evict clean entries until we fit
+    {
+        if (it->dirty)
+        {
+            ++it;
+            continue;
+        }
+
+        shadow->stats.usedBytes -= sizeof(NVS_SHADOW_ENTRY) + it->text.length();
+        it = entries.erase(it);
+    }
+
+    if ((shadow->stats.usedBytes + cost > shadow->stats.budgetBytes) && !(dirty && shadow->flushing)) // A batch in flight could land over a direct write
+    {
+        shadow->stats.bypassed++;
+        return false;
+    }
+
+    NVS_SHADOW_ENTRY entry = {};
+    strncpy(entry.key, key, NVS_KEY_NAME_MAX_SIZE - 1);
+    entry.type = type;
+    entry.value = value;
+    if (text != nullptr)
+        entry.text = text;
+    entry.dirty = dirty;
+
+    entries.push_back(std::move(entry));
+    shadow->stats.usedBytes += cost;
+
+    if (dirty)
+    {
+        shadow->stats.dirtyWrites++;
+
+        NVS_KEY_POLICY *record = keyRecord(shadow, key);
+        record->stats.changes++;
+        record->lastChange = esp_timer_get_time(); // The settle time runs from the latest change
+    }
+    return true;
+}
+
+void NVS::shadowClear(NVS_SHADOW *shadow)
+{
+    shadow->entries.clear();
+    shadow->stats.usedBytes = 0;
+    shadow->directory.entries.clear(); // Walked again on the next attach
+    shadow->directory.built = false;
+}
+
+// Pushes every dirty entry out through the given handle.  The caller is responsible for the commit.
+esp_err_t NVS::shadowFlush(nvs_handle_t handle, NVS_SHADOW *shadow, bool force)
+{
+    esp_err_t firstError = ESP_OK;
+    int64_t now = shadow->policies.empty() ? 0 : esp_timer_get_time();
+
+    for (auto &entry : shadow->entries)
+    {
+        if (!entry.dirty || !shadowDue(shadow, entry, force, now))
+            continue;
+
+        esp_err_t ret = shadowWriteEntry(handle, shadow, entry);
+
+        if (ret == ESP_OK)
+            shadowMarkFlushed(shadow, entry, now);
+        else
+        {
+            routeLogByFormat<LOG_TYPE::ERROR>("%s(): Flush of key %s failed, code = %s", __func__, entry.key, esp_err_to_name(ret));
+
+            if (firstError == ESP_OK) // Keep going so one bad key doesn't hold back the others.  The entry stays dirty for the next flush.
+                firstError = ret;
+        }
+    }
+
+    return firstError;
+}
+
+// False when the key's write policy holds a dirty entry back.  The entry stays dirty for a later flush.
+bool NVS::shadowDue(NVS_SHADOW *shadow, const NVS_SHADOW_ENTRY &entry, bool force, int64_t now)
+{
+    NVS_KEY_POLICY *policy = findPolicy(shadow, entry.key);
+
+    if (force || (policy == nullptr) || policyAllows(policy, now))
+        return true;
+
+    policy->stats.deferred++;
+    return false;
+}
+
+// Writes one entry through the given handle.  Without a shadow a string is always stored as plain text, so only pass nullptr for keys
+// which are not compressed.
+esp_err_t NVS::shadowWriteEntry(nvs_handle_t handle, NVS_SHADOW *shadow, const NVS_SHADOW_ENTRY &entry)
+{
+    switch (entry.type)
+    {
+    case NVS_TYPE_STR:
+        return (shadow != nullptr) ? storeString(handle, shadow, entry.key, entry.text.c_str()) : nvs_set_str(handle, entry.key, entry.text.c_str());
+    default:
+        return nvsSetInteger(handle, entry.key, entry.type, entry.value);
+    }
+}
+
+// Counts a flash write of the entry against the shadow and the key's policy, and marks the entry clean
+void NVS::shadowMarkFlushed(NVS_SHADOW *shadow, NVS_SHADOW_ENTRY &entry, int64_t now)
+{
+    entry.dirty = false;
+    shadow->stats.flushedWrites++;
+    NVS_OpTimer::countWrite((entry.type == NVS_TYPE_STR) ? entry.text.length() + 1 : (entry.type & 0x0F)); // The low nibble of an integer type is its width
+
+    NVS_KEY_POLICY *record = keyRecord(shadow, entry.key);
+    record->stats.flashWrites++;
+    record->writesThisHour++;
+    record->lastWrite = now;
+}
+
+// Called with the namespace lock held before anything erases or rewrites keys behind the shadow's back.  The write-behind task writes a
+// batch without the lock, and clears the flag once the batch is on flash, so this never waits on the lock we hold.
+void NVS::shadowAwaitFlush(NVS_SHADOW *shadow)
+{
+    while ((shadow != nullptr) && shadow->flushing)
+        vTaskDelay(1);
+}
@@ -0,0 +1,515 @@
+#include "nvs/nvs_.hpp"
+#include "system_.hpp"
+
+#include "esp_rom_crc.h"
+
+#include <algorithm>
+#include <string.h>
+//
+// Namespace images.  See nvs_snapshot.hpp for the layout.
+//
+// Export reads through the IDF only, one entry at a time, with one value buffer which grows to the largest string or blob.  Shadowed
+// namespaces have their dirty entries flushed first so the image holds what readers of the namespace would see.
+//
+// Import checks each section's CRC before it touches flash, then writes the whole section under the namespace lock with one commit.  A
+// shadow of that namespace is flushed first and emptied afterwards so it reloads the imported values.  A section whose shadow can't be
+// flushed, or whose namespace can't be erased, is skipped with its shadow untouched, so nothing waiting in RAM is lost.
+//
+// The stream helpers below only hand back error codes.  The member functions which call them log the failure.
+//
+constexpr uint8_t TAG_SECTION = 'S';
+constexpr uint8_t TAG_ENTRY = 'E';
+constexpr uint8_t TAG_SECTION_END = 'C';
+constexpr uint8_t TAG_IMAGE_END = 'Z';
+
+struct NVS_IMAGE_ENTRY
+{
+    nvs_type_t type;
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    std::vector<uint8_t> data;
+};
+
+struct NVS_IMAGE_SECTION
+{
+    char name_space[NVS_KEY_NAME_MAX_SIZE];
+    std::vector<NVS_IMAGE_ENTRY> entries;
+};
+
+class CRCSink : public NVS_BlobSink // Passes everything on and keeps a CRC of it
+{
+public:
+    explicit CRCSink(NVS_BlobSink &target) : next(target) {}
+    CRCSink(const CRCSink &) = delete; // Wrapping another CRCSink must chain to it, not copy it
+
+    esp_err_t write(const void *data, size_t length) override
+    {
+        crc = esp_rom_crc32_le(crc, (const uint8_t *)data, length);
+        return next.write(data, length);
+    }
+
+    NVS_BlobSink &next;
+    uint32_t crc = 0;
+};
+
+class CRCSource : public NVS_BlobSource // Reads exactly what is asked for and keeps a CRC of it
+{
+public:
+    explicit CRCSource(NVS_BlobSource &origin) : next(origin) {}
+    CRCSource(const CRCSource &) = delete; // Wrapping another CRCSource must chain to it, not copy it
+
+    esp_err_t read(void *buffer, size_t length, size_t *bytesRead) override
+    {
+        uint8_t *bytes = (uint8_t *)buffer;
+        *bytesRead = 0;
+
+        while (*bytesRead < length)
+        {
+            size_t count = 0;
+            esp_err_t ret = next.read(bytes + *bytesRead, length - *bytesRead, &count);
+
+            if (ret != ESP_OK)
+                return ret;
+
+            if (count == 0)
+                return ESP_ERR_INVALID_SIZE; // The image ends early
+
+            *bytesRead += count;
+        }
+
+        crc = esp_rom_crc32_le(crc, bytes, length);
+        return ESP_OK;
+    }
+
+    NVS_BlobSource &next;
+    uint32_t crc = 0;
+};
+
+static esp_err_t put(NVS_BlobSink &sink, uint64_t value, uint8_t width) // Little endian whatever the host is
+{
+    uint8_t bytes[8];
+
+    for (uint8_t i = 0; i < width; i++)
+        bytes[i] = (uint8_t)(value >> (8 * i));
+    return sink.write(bytes, width);
+}
+
+static esp_err_t get(NVS_BlobSource &source, uint64_t *value, uint8_t width)
+{
+    uint8_t bytes[8];
+    size_t count = 0;
+
+    esp_err_t ret = source.read(bytes, width, &count);
+
+    if (ret != ESP_OK)
+        return ret;
+
+    *value = 0;
+
+    for (uint8_t i = 0; i < width; i++)
+        *value |= (uint64_t)bytes[i] << (8 * i);
+    return ESP_OK;
+}
+
+static esp_err_t putText(NVS_BlobSink &sink, const char *text)
+{
+    uint8_t length = (uint8_t)strlen(text);
+    esp_err_t ret = put(sink, length, 1);
+    return (ret == ESP_OK) ? sink.write(text, length) : ret;
+}
+
+static esp_err_t getText(NVS_BlobSource &source, char *text) // Namespace or key
+{
+    uint64_t length = 0;
+    size_t count = 0;
+    esp_err_t ret = get(source, &length, 1);
+
+    if (ret != ESP_OK)
+        return ret;
+
+    if ((length == 0) || (length >= NVS_KEY_NAME_MAX_SIZE))
+        return ESP_ERR_NVS_KEY_TOO_LONG;
+
+    ret = source.read(text, length, &count);
+
+    if (ret == ESP_OK)
+        text[length] = 0;
+    return ret;
+}
+
+static esp_err_t writeEntry(nvs_handle_t handle, const NVS_IMAGE_ENTRY &entry)
+{
+    uint64_t value = 0;
+
+    for (uint8_t i = 0; (i < entry.data.size()) && (i < 8); i++)
+        value |= (uint64_t)entry.data[i] << (8 * i);
+
+    switch (entry.type)
+    {
+    case NVS_TYPE_STR:
+        return nvs_set_str(handle, entry.key, (const char *)entry.data.data());
+    case NVS_TYPE_BLOB:
+        return nvs_set_blob(handle, entry.key, entry.data.data(), entry.data.size());
+    default:
+        return nvsSetInteger(handle, entry.key, entry.type, value);
+    }
+}
+
+static esp_err_t readSection(CRCSource &image, NVS_IMAGE_SECTION *section) // The 'S' tag has already been read
+{
+    CRCSource source(static_cast<NVS_BlobSource &>(image));
+    source.crc = esp_rom_crc32_le(0, &TAG_SECTION, 1);
+    size_t held = 0;
+    esp_err_t ret = getText(source, section->name_space);
+
+    while (ret == ESP_OK)
+    {
+        uint64_t tag = 0;
+        ret = get(source, &tag, 1);
+
+        if ((ret != ESP_OK) || (tag == TAG_SECTION_END))
+            break;
+
+        if (tag != TAG_ENTRY)
+            return ESP_ERR_INVALID_VERSION;
+
+        NVS_IMAGE_ENTRY entry = {};
+        uint64_t type = 0;
+        uint64_t length = 0;
+        size_t count = 0;
+
+        ret = get(source, &type, 1);
+
+        if (ret == ESP_OK)
+            ret = getText(source, entry.key);
+        if (ret == ESP_OK)
+            ret = get(source, &length, 4);
+        if (ret != ESP_OK)
+            break;
+
+        held += length + sizeof(NVS_IMAGE_ENTRY);
+
+        if (held > NVS_IMAGE_SECTION_BUDGET)
+            return ESP_ERR_NO_MEM;
+
+        bool integer = (type != NVS_TYPE_STR) && (type != NVS_TYPE_BLOB);
+
+        if ((integer && (length != (type & 0x0F))) || ((type == NVS_TYPE_STR) && (length == 0)))
+            return ESP_ERR_INVALID_SIZE;
+
+        entry.type = (nvs_type_t)type;
+        entry.data.resize(length);
+        ret = source.read(entry.data.data(), length, &count);
+
+        if (ret != ESP_OK)
+            break;
+
+        if ((type == NVS_TYPE_STR) && (entry.data.back() != 0))
+            return ESP_ERR_INVALID_SIZE;
+
+        section->entries.push_back(std::move(entry));
+    }
+
+    uint64_t entryCount = 0;
+    uint64_t crc = 0;
+
+    if (ret == ESP_OK)
+        ret = get(source, &entryCount, 2);
+
+    uint32_t expected = source.crc;
+
+    if (ret == ESP_OK)
+        ret = get(image, &crc, 4); // Part of the image CRC but not of its own
+
+    if ((ret == ESP_OK) && ((crc != expected) || (entryCount != section->entries.size())))
+        ret = ESP_ERR_INVALID_CRC;
+    return ret;
+}
+
+/* Public Member Functions */
+esp_err_t NVS::exportNamespace(const char *name_space, NVS_BlobSink &sink)
+{
+    waitForInit();
+
+    CRCSink image(sink);
+    esp_err_t ret = put(image, NVS_IMAGE_MAGIC, 4);
+
+    if (ret == ESP_OK)
+        ret = put(image, NVS_IMAGE_VERSION, 4); // Version and three reserved bytes
+    if (ret == ESP_OK)
+        ret = exportSection(getPartition(name_space), name_space, image);
+    if (ret == ESP_OK)
+        ret = put(image, TAG_IMAGE_END, 1);
+    if (ret == ESP_OK)
+        ret = put(image, 1, 2);
+    if (ret == ESP_OK)
+        ret = put(sink, image.crc, 4);
+
+    if (ret != ESP_OK)
+        routeLogByFormat<LOG_TYPE::ERROR>("%s(): Export of %s failed, code = %s", __func__, name_space, esp_err_to_name(ret));
+    return ret;
+}
+
+esp_err_t NVS::exportPartition(NVS_BlobSink &sink, const char *partition)
+{
+    waitForInit();
+
+    std::vector<std::string> names; // Entries of one namespace may be spread across pages, so find every name first
+
+    {
+        NVS_Iterator it(partition);
+        NVS_ENTRY entry;
+
+        while (it.next(&entry))
+            if (std::find(names.begin(), names.end(), entry.name_space) == names.end())
+                names.push_back(entry.name_space);
+
+        if (it.getStatus() != ESP_ERR_NVS_NOT_FOUND)
+            return it.getStatus();
+    }
+
+    CRCSink image(sink);
+    esp_err_t ret = put(image, NVS_IMAGE_MAGIC, 4);
+
+    if (ret == ESP_OK)
+        ret = put(image, NVS_IMAGE_VERSION, 4);
+
+    for (const auto &name : names)
+    {
+        if (ret != ESP_OK)
+            break;
+
+        ret = exportSection(partition, name.c_str(), image);
+
+        if (ret != ESP_OK)
+            routeLogByFormat<LOG_TYPE::ERROR>("%s(): Export of %s failed, code = %s", __func__, name.c_str(), esp_err_to_name(ret));
+    }
+
+    if (ret == ESP_OK)
+        ret = put(image, TAG_IMAGE_END, 1);
+    if (ret == ESP_OK)
+        ret = put(image, names.size(), 2);
+    if (ret == ESP_OK)
+        ret = put(sink, image.crc, 4);
+
+    if (ret != ESP_OK)
+        routeLogByFormat<LOG_TYPE::ERROR>("%s(): Partition export stopped, code = %s", __func__, esp_err_to_name(ret));
+    return ret;
+}
+
+esp_err_t NVS::importImage(NVS_BlobSource &source, bool eraseFirst, NVS_IMPORT_REPORT *report)
+{
+    waitForInit();
+
+    NVS_IMPORT_REPORT counts = {};
+    CRCSource image(source);
+    uint64_t magic = 0;
+    uint64_t version = 0;
+
+    esp_err_t ret = get(image, &magic, 4);
+
+    if (ret == ESP_OK)
+        ret = get(image, &version, 4);
+
+    if ((ret == ESP_OK) && ((magic != NVS_IMAGE_MAGIC) || ((version & 0xFF) != NVS_IMAGE_VERSION)))
+        ret = ESP_ERR_INVALID_VERSION;
+
+    if (ret != ESP_OK)
+    {
+        routeLogByFormat<LOG_TYPE::ERROR>("%s(): Not a readable image, code = %s", __func__, esp_err_to_name(ret));
+        return ret;
+    }
+
+    esp_err_t skipRet = ESP_OK; // The first reason a section was skipped.  The rest of the image is still applied.
+
+    while (ret == ESP_OK)
+    {
+        uint64_t tag = 0;
+        ret = get(image, &tag, 1);
+
+        if (ret != ESP_OK)
+            break;
+
+        if (tag == TAG_IMAGE_END)
+        {
+            uint64_t sections = 0;
+            uint64_t crc = 0;
+            ret = get(image, &sections, 2);
+            uint32_t expected = image.crc;
+
+            if (ret == ESP_OK)
+                ret = get(image, &crc, 4);
+
+            if ((ret == ESP_OK) && (crc != expected))
+                ret = ESP_ERR_INVALID_CRC;
+            break;
+        }
+
+        if (tag != TAG_SECTION)
+        {
+            ret = ESP_ERR_INVALID_VERSION;
+            break;
+        }
+
+        NVS_IMAGE_SECTION section = {};
+        ret = readSection(image, &section);
+
+        if (ret != ESP_OK)
+            break;
+
+        SemaphoreHandle_t lock = namespaceLock(section.name_space);
+        xSemaphoreTakeRecursive(lock, portMAX_DELAY);
+
+        nvs_handle_t handle = 0;
+        ret = openNamespace(section.name_space, &handle);
+
+        if (ret == ESP_OK)
+        {
+            NVS_SHADOW *shadow = attachShadow(section.name_space);
+            shadowAwaitFlush(shadow);
+            esp_err_t prepared = ESP_OK;
+
+            if ((shadow != nullptr) && !eraseFirst) // Pending writes the image doesn't cover must not be lost
+                prepared = shadowFlush(handle, shadow, true);
+
+            if (eraseFirst)
+                prepared = nvs_erase_all(handle);
+
+            if (prepared != ESP_OK) // Nothing of the section is written, and the shadow keeps what flash never got
+            {
+                routeLogByFormat<LOG_TYPE::ERROR>("%s(): Skipped namespace %s, unable to %s it, code = %s", __func__, section.name_space,
+                                                  eraseFirst ? "erase" : "flush", esp_err_to_name(prepared));
+                nvs_close(handle);
+                detachShadow(shadow);
+                counts.skipped++;
+
+                if (skipRet == ESP_OK)
+                    skipRet = prepared;
+
+                xSemaphoreGiveRecursive(lock);
+                continue;
+            }
+
+            for (const auto &entry : section.entries)
+            {
+                if (writeEntry(handle, entry) == ESP_OK)
+                {
+                    NVS_OpTimer::countWrite(entry.data.size());
+                    counts.entries++;
+                }
+                else
+                {
+                    routeLogByFormat<LOG_TYPE::WARN>("%s(): Unable to write %s:%s", __func__, section.name_space, entry.key);
+                    counts.failed++;
+                }
+            }
+
+            ret = nvs_commit(handle);
+            nvs_close(handle);
+
+            if (shadow != nullptr) // Reloads from flash on the next read.  The IDF wrote each entry as it was set, commit or not.
+                shadowClear(shadow);
+            detachShadow(shadow);
+
+            if (ret == ESP_OK)
+                counts.namespaces++;
+        }
+
+        xSemaphoreGiveRecursive(lock);
+    }
+
+    if (report != nullptr)
+        *report = counts;
+
+    if (ret != ESP_OK)
+        routeLogByFormat<LOG_TYPE::ERROR>("%s(): Import stopped after %u namespaces, code = %s", __func__, (unsigned)counts.namespaces, esp_err_to_name(ret));
+    return (ret == ESP_OK) ? skipRet : ret;
+}
+
+/* Private Member Functions */
+esp_err_t NVS::exportSection(const char *partition, const char *name_space, NVS_BlobSink &image)
+{
+    SemaphoreHandle_t lock = namespaceLock(name_space);
+    xSemaphoreTakeRecursive(lock, portMAX_DELAY);
+
+    NVS_SHADOW *shadow = (strcmp(getPartition(name_space), partition) == 0) ? attachShadow(name_space) : nullptr;
+    nvs_handle_t handle = 0;
+    esp_err_t ret = ESP_OK;
+
+    if (shadow != nullptr) // Dirty entries go out first so the image matches what readers see
+    {
+        ret = openNamespace(name_space, &handle);
+
+        if (ret == ESP_OK)
+        {
+            ret = shadowFlush(handle, shadow, true);
+            nvs_commit(handle);
+            nvs_close(handle);
+        }
+
+        detachShadow(shadow);
+    }
+
+    if (ret == ESP_OK)
+        ret = nvs_open_from_partition(partition, name_space, NVS_READONLY, &handle);
+
+    if (ret != ESP_OK)
+    {
+        xSemaphoreGiveRecursive(lock);
+        return ret;
+    }
+
+    CRCSink section(image);
+    std::vector<uint8_t> value; // Reused for every string and blob
+    uint16_t count = 0;
+
+    ret = put(section, TAG_SECTION, 1);
+
+    if (ret == ESP_OK)
+        ret = putText(section, name_space);
+
+    NVS_Iterator it(partition, name_space);
+    NVS_ENTRY entry;
+
+    while ((ret == ESP_OK) && it.next(&entry))
+    {
+        NVS_OpTimer timer(NVS_OP::READ);
+        uint64_t integer = 0;
+        size_t length = entry.size;
+
+        if ((entry.type == NVS_TYPE_STR) || (entry.type == NVS_TYPE_BLOB))
+        {
+            value.resize(length);
+            ret = (entry.type == NVS_TYPE_STR) ? nvs_get_str(handle, entry.key, (char *)value.data(), &length) : nvs_get_blob(handle, entry.key, value.data(), &length);
+        }
+        else
+            ret = nvsGetInteger(handle, entry.key, entry.type, &integer);
+
+        if (ret == ESP_OK)
+            ret = put(section, TAG_ENTRY, 1);
+        if (ret == ESP_OK)
+            ret = put(section, entry.type, 1);
+        if (ret == ESP_OK)
+            ret = putText(section, entry.key);
+        if (ret == ESP_OK)
+            ret = put(section, length, 4);
+
+        if (ret == ESP_OK)
+            ret = ((entry.type == NVS_TYPE_STR) || (entry.type == NVS_TYPE_BLOB)) ? section.write(value.data(), length) : put(section, integer, length);
+
+        count++;
+    }
+
+    if ((ret == ESP_OK) && (it.getStatus() != ESP_ERR_NVS_NOT_FOUND))
+        ret = it.getStatus();
+
+    if (ret == ESP_OK)
+        ret = put(section, TAG_SECTION_END, 1);
+    if (ret == ESP_OK)
+        ret = put(section, count, 2);
+    if (ret == ESP_OK)
+        ret = put(image, section.crc, 4); // Counted in the image CRC but not in its own
+
+    nvs_close(handle);
+    xSemaphoreGiveRecursive(lock);
+    return ret;
+}
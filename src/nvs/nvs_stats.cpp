@@ -0,0 +1,73 @@
+#include "nvs/nvs_.hpp"
+#include "system_.hpp"
+
+#include <string.h>
+//
+// Operation counters and latency histograms.  Everything here is compiled only when NVS_INSTRUMENTATION is set.  Otherwise NVS_OpTimer is
+// an empty inline class and getStats() reports ESP_ERR_NOT_SUPPORTED.
+//
+// Tasks working on different namespaces record at the same time, so updates are made inside a short critical section rather than behind a
+// semaphore.  A write times its leading read as well, and that read is also counted under NVS_OP::READ.  A close includes its commit.
+//
+#if NVS_INSTRUMENTATION
+#include "esp_timer.h"
+
+static NVS_STATS nvsStats = {};
+static portMUX_TYPE nvsStatsMux = portMUX_INITIALIZER_UNLOCKED;
+
+NVS_OpTimer::NVS_OpTimer(NVS_OP timedOp) : op(timedOp), start(esp_timer_get_time())
+{
+}
+
+NVS_OpTimer::~NVS_OpTimer()
+{
+    uint32_t micros = (uint32_t)(esp_timer_get_time() - start);
+    uint8_t bucket = 0;
+
+    while ((bucket < NVS_LATENCY_BUCKETS - 1) && (micros > NVS_LATENCY_BUCKET_LIMITS[bucket]))
+        bucket++;
+
+    portENTER_CRITICAL(&nvsStatsMux);
+    NVS_OP_STATS &stats = nvsStats.ops[(uint8_t)op];
+    stats.count++;
+    stats.totalMicros += micros;
+    stats.buckets[bucket]++;
+
+    if (micros > stats.maxMicros)
+        stats.maxMicros = micros;
+    portEXIT_CRITICAL(&nvsStatsMux);
+}
+
+void NVS_OpTimer::countWrite(size_t bytes)
+{
+    portENTER_CRITICAL(&nvsStatsMux);
+    nvsStats.flashWrites++;
+    nvsStats.bytesWritten += bytes;
+    portEXIT_CRITICAL(&nvsStatsMux);
+}
+
+esp_err_t NVS::getStats(NVS_STATS *stats)
+{
+    portENTER_CRITICAL(&nvsStatsMux);
+    memcpy(stats, &nvsStats, sizeof(NVS_STATS));
+    portEXIT_CRITICAL(&nvsStatsMux);
+    return ESP_OK;
+}
+
+void NVS::resetStats()
+{
+    portENTER_CRITICAL(&nvsStatsMux);
+    memset(&nvsStats, 0, sizeof(NVS_STATS));
+    portEXIT_CRITICAL(&nvsStatsMux);
+}
+#else
+esp_err_t NVS::getStats(NVS_STATS *stats)
+{
+    memset(stats, 0, sizeof(NVS_STATS));
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+void NVS::resetStats()
+{
+}
+#endif
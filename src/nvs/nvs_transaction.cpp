@@ -0,0 +1,336 @@
+#include "nvs/nvs_.hpp"
+#include "system_.hpp"
+
+#include "esp_rom_crc.h"
+
+#include <stdio.h>
+#include <string.h>
+//
+// Atomic groups.  See nvs_transaction.hpp for the record layout.
+//
+// The IDF already writes a single blob atomically.  We keep two copies anyway, so that the copy readers depend on is never the one
+// being rewritten.  If a copy is torn, or an entry is lost to a page which fails its CRC, the other copy still holds the previous
+// generation.
+//
+// Generations count up from 1 and are compared with wrap-around, so a counter which overflows after years of commits still orders the
+// two copies correctly.
+//
+static void makeSlotKey(char *slotKey, const char *group, uint8_t slot)
+{
+    snprintf(slotKey, NVS_KEY_NAME_MAX_SIZE, "%s:%u", group, slot);
+}
+
+static void put(std::vector<uint8_t> &record, uint64_t value, uint8_t width) // Little endian whatever the host is
+{
+    for (uint8_t i = 0; i < width; i++)
+        record.push_back((uint8_t)(value >> (8 * i)));
+}
+
+static uint64_t get(const uint8_t *bytes, uint8_t width)
+{
+    uint64_t value = 0;
+
+    for (uint8_t i = 0; i < width; i++)
+        value |= (uint64_t)bytes[i] << (8 * i);
+    return value;
+}
+
+static uint64_t maskToWidth(uint64_t value, nvs_type_t type) // Signed values are held without their sign extension
+{
+    uint8_t width = type & 0x0F;
+    return (width >= 8) ? value : (value & ((1ULL << (8 * width)) - 1));
+}
+
+// Checks a stored copy and unpacks its entries.  Anything which doesn't add up rejects the whole copy.
+static bool parseRecord(const std::vector<uint8_t> &record, uint32_t *generation, std::vector<NVS_SHADOW_ENTRY> *entries)
+{
+    if ((record.size() < NVS_TRANSACTION_HEADER_SIZE) || (get(&record[0], 4) != NVS_TRANSACTION_MAGIC) || (record[4] != NVS_TRANSACTION_VERSION))
+        return false;
+
+    uint8_t entryCount = record[5];
+    *generation = (uint32_t)get(&record[8], 4);
+
+    if ((uint32_t)get(&record[12], 4) != esp_rom_crc32_le(0, &record[NVS_TRANSACTION_HEADER_SIZE], record.size() - NVS_TRANSACTION_HEADER_SIZE))
+        return false;
+
+    entries->clear();
+    size_t position = NVS_TRANSACTION_HEADER_SIZE;
+
+    for (uint8_t i = 0; i < entryCount; i++)
+    {
+        if (position + 2 > record.size())
+            return false;
+
+        NVS_SHADOW_ENTRY entry = {};
+        entry.type = (nvs_type_t)record[position];
+        uint8_t keyLength = record[position + 1];
+        position += 2;
+
+        if ((keyLength == 0) || (keyLength >= NVS_KEY_NAME_MAX_SIZE) || (position + keyLength + 2 > record.size()))
+            return false;
+
+        memcpy(entry.key, &record[position], keyLength);
+        position += keyLength;
+
+        uint16_t length = (uint16_t)get(&record[position], 2);
+        position += 2;
+
+        if (position + length > record.size())
+            return false;
+
+        if (entry.type == NVS_TYPE_STR)
+        {
+            if ((length == 0) || (record[position + length - 1] != 0))
+                return false;
+            entry.text.assign((const char *)&record[position], length - 1);
+        }
+        else if ((entry.type != NVS_TYPE_BLOB) && (entry.type != NVS_TYPE_ANY) && (length == (entry.type & 0x0F)))
+            entry.value = get(&record[position], length);
+        else
+            return false;
+
+        position += length;
+        entries->push_back(std::move(entry));
+    }
+
+    return position == record.size();
+}
+
+/* Construction */
+NVS_Transaction::NVS_Transaction(NVS_Session &session, const char *groupName) : handle(session.getHandle()), shadow(session.shadow)
+{
+    if (handle == 0)
+        status = ESP_ERR_NVS_INVALID_HANDLE;
+    else if (strlen(groupName) > NVS_TRANSACTION_GROUP_MAX_LENGTH)
+        status = ESP_ERR_NVS_KEY_TOO_LONG;
+    else
+    {
+        strncpy(group, groupName, sizeof(group) - 1);
+        status = load();
+    }
+}
+
+/* Public Member Functions */
+esp_err_t NVS_Transaction::readString(const char *key, std::string *strValue)
+{
+    if (status != ESP_OK)
+        return status;
+
+    NVS_SHADOW_ENTRY *entry = find(key, NVS_TYPE_STR);
+
+    if (entry == nullptr)
+        return ESP_ERR_NVS_NOT_FOUND;
+
+    *strValue = entry->text;
+    return ESP_OK;
+}
+
+esp_err_t NVS_Transaction::writeString(const char *key, const char *newValue)
+{
+    return stage(key, NVS_TYPE_STR, 0, newValue);
+}
+
+esp_err_t NVS_Transaction::commit()
+{
+    if (status != ESP_OK)
+        return status;
+
+    if (!pending) // Every staged value matched what is stored
+        return ESP_OK;
+
+    NVS_OpTimer timer(NVS_OP::COMMIT);
+    std::vector<uint8_t> record;
+    record.reserve(NVS_TRANSACTION_MAX_LENGTH);
+
+    uint32_t newGeneration = (generation == UINT32_MAX) ? 1 : generation + 1;
+    uint8_t newSlot = (generation == 0) ? 0 : slot ^ 1; // Never the copy holding the current generation
+
+    put(record, NVS_TRANSACTION_MAGIC, 4);
+    put(record, NVS_TRANSACTION_VERSION, 1);
+    put(record, entries.size(), 1);
+    put(record, 0, 2);
+    put(record, newGeneration, 4);
+    put(record, 0, 4); // CRC is filled in below
+
+    for (const auto &entry : entries)
+    {
+        uint8_t keyLength = (uint8_t)strnlen(entry.key, NVS_KEY_NAME_MAX_SIZE - 1);
+        put(record, entry.type, 1);
+        put(record, keyLength, 1);
+        record.insert(record.end(), entry.key, entry.key + keyLength);
+
+        if (entry.type == NVS_TYPE_STR)
+        {
+            put(record, entry.text.length() + 1, 2);
+            record.insert(record.end(), entry.text.c_str(), entry.text.c_str() + entry.text.length() + 1);
+        }
+        else
+        {
+            put(record, entry.type & 0x0F, 2);
+            put(record, entry.value, entry.type & 0x0F);
+        }
+    }
+
+    if (record.size() > NVS_TRANSACTION_MAX_LENGTH)
+    {
+        NVS::getInstance()->routeLogByFormat<LOG_TYPE::ERROR>("%s(): %s needs %u bytes, more than %u", __func__, group, (unsigned)record.size(),
+                                                              (unsigned)NVS_TRANSACTION_MAX_LENGTH);
+        return ESP_ERR_NVS_VALUE_TOO_LONG;
+    }
+
+    uint32_t crc = esp_rom_crc32_le(0, &record[NVS_TRANSACTION_HEADER_SIZE], record.size() - NVS_TRANSACTION_HEADER_SIZE);
+
+    for (uint8_t i = 0; i < 4; i++)
+        record[12 + i] = (uint8_t)(crc >> (8 * i));
+
+    char slotKey[NVS_KEY_NAME_MAX_SIZE];
+    makeSlotKey(slotKey, group, newSlot);
+
+    esp_err_t ret = nvs_set_blob(handle, slotKey, record.data(), record.size());
+
+    if (ret == ESP_OK)
+    {
+        NVS_OpTimer::countWrite(record.size());
+        NVS::getInstance()->directoryNote(shadow, slotKey, NVS_TYPE_BLOB, record.size());
+        ret = nvs_commit(handle); // The one commit for the whole group
+    }
+
+    if (ret != ESP_OK)
+    {
+        NVS::getInstance()->routeLogByFormat<LOG_TYPE::ERROR>("%s(): Commit of %s failed, code = %s", __func__, group, esp_err_to_name(ret));
+        return ret; // The staged values are kept so the caller may try again
+    }
+
+    generation = newGeneration;
+    slot = newSlot;
+    pending = false;
+
+    for (auto &entry : entries)
+        entry.dirty = false;
+    return ESP_OK;
+}
+
+esp_err_t NVS_Transaction::discard()
+{
+    if (handle == 0)
+        return status;
+
+    status = load();
+    return status;
+}
+
+/* Private Member Functions */
+NVS_SHADOW_ENTRY *NVS_Transaction::find(const char *key, nvs_type_t type)
+{
+    for (auto &entry : entries)
+        if ((entry.type == type) && (strncmp(entry.key, key, NVS_KEY_NAME_MAX_SIZE) == 0))
+            return &entry;
+    return nullptr;
+}
+
+esp_err_t NVS_Transaction::stage(const char *key, nvs_type_t type, uint64_t value, const char *text)
+{
+    if (status != ESP_OK)
+        return status;
+
+    if ((key == nullptr) || (key[0] == 0) || (strlen(key) >= NVS_KEY_NAME_MAX_SIZE))
+        return ESP_ERR_NVS_KEY_TOO_LONG;
+
+    value = maskToWidth(value, type);
+    NVS_SHADOW_ENTRY *entry = find(key, type);
+
+    if (entry != nullptr)
+    {
+        if ((text == nullptr) ? (entry->value == value) : (entry->text == text)) // Unchanged.  Nothing to stage.
+            return ESP_OK;
+    }
+    else
+    {
+        for (auto it = entries.begin(); it != entries.end(); ++it) // A key holds one type at a time, as it does in the IDF
+        {
+            if (strncmp(it->key, key, NVS_KEY_NAME_MAX_SIZE) == 0)
+            {
+                entries.erase(it);
+                break;
+            }
+        }
+
+        entries.push_back({});
+        entry = &entries.back();
+        strncpy(entry->key, key, sizeof(entry->key) - 1);
+        entry->type = type;
+    }
+
+    entry->value = value;
+
+    if (text != nullptr)
+        entry->text = text;
+
+    entry->dirty = true;
+    pending = true;
+    return ESP_OK;
+}
+
+// Reads both copies and keeps the newest one which checks out.  Neither copy being present is not an error.  It is an empty group.
+esp_err_t NVS_Transaction::load()
+{
+    NVS_OpTimer timer(NVS_OP::READ);
+    NVS *nvs = NVS::getInstance();
+    std::vector<uint8_t> record;
+    std::vector<NVS_SHADOW_ENTRY> candidate;
+    bool found = false;
+
+    entries.clear();
+    generation = 0;
+    slot = 0;
+    pending = false;
+
+    for (uint8_t copy = 0; copy < 2; copy++)
+    {
+        char slotKey[NVS_KEY_NAME_MAX_SIZE];
+        makeSlotKey(slotKey, group, copy);
+
+        size_t length = 0;
+
+        if (!nvs->directoryMayHold(shadow, slotKey, NVS_TYPE_BLOB, &length)) // No lookup at all for a group never committed
+            continue;
+
+        esp_err_t ret = (length != 0) ? ESP_OK : nvs_get_blob(handle, slotKey, nullptr, &length);
+
+        if (ret == ESP_ERR_NVS_NOT_FOUND)
+            continue;
+
+        if (ret != ESP_OK)
+            return ret;
+
+        if (length > NVS_TRANSACTION_MAX_LENGTH)
+        {
+            NVS::getInstance()->routeLogByFormat<LOG_TYPE::WARN>("%s(): Copy %s is %u bytes, ignored", __func__, slotKey, (unsigned)length);
+            continue;
+        }
+
+        record.resize(length);
+        ret = nvs_get_blob(handle, slotKey, record.data(), &length);
+
+        if (ret != ESP_OK)
+            return ret;
+
+        uint32_t copyGeneration = 0;
+
+        if (!parseRecord(record, &copyGeneration, &candidate))
+        {
+            NVS::getInstance()->routeLogByFormat<LOG_TYPE::WARN>("%s(): Copy %s is damaged, ignored", __func__, slotKey);
+            continue;
+        }
+
+        if (!found || ((int32_t)(copyGeneration - generation) > 0))
+        {
+            entries.swap(candidate);
+            generation = copyGeneration;
+            slot = copy;
+            found = true;
+        }
+    }
+
+    return ESP_OK;
+}
@@ -0,0 +1,299 @@
+#include "nvs/nvs_.hpp"
+#include "system_.hpp"
+
+#include "esp_timer.h"
+
+#include <string.h>
+
+extern SemaphoreHandle_t semNVSShadowTable;
+extern SemaphoreHandle_t semNVSFlush;
+extern SemaphoreHandle_t semNVSFlushDone;
+//
+// Write-behind moves the flash work of a namespace off the caller's task.  It is built on the shadow cache.  Writes to a write-behind
+// namespace only update its RAM shadow, so repeated writes to one key collapse into a single dirty entry and reads still see the newest
+// value.  Closing the namespace no longer flushes.  It tells our task instead, and the task writes everything out with one commit per
+// namespace once NVS_WRITE_BEHIND_INTERVAL_MS has passed or as soon as NVS_WRITE_BEHIND_THRESHOLD entries are dirty.
+//
+// The caller never waits on nvs_set_* or on the page erase it may trigger.  The task copies the dirty entries under the namespace lock,
+// lets go of the lock while it writes the copies, then takes it again and marks clean only the entries which still hold the value it
+// wrote.  A key changed in the meantime stays dirty for the next pass.  While a batch is in flight, writes which don't fit the shadow
+// budget are held over budget rather than going straight to flash, and anything which erases keys behind the shadow waits for the batch,
+// so an older value can never land on top of a newer one.  Strings on compressed keys also maintain the key directory, so they are
+// written once the lock is back.
+//
+// The price is that a reset loses whatever is still pending, so shutdown paths should call flush() first.  Outside a batch, writes which
+// don't fit the shadow budget still go straight to flash as they always have.
+//
+static NVS_SHADOW_ENTRY *findEntry(NVS_SHADOW *shadow, const NVS_SHADOW_ENTRY &copy) // Unlike shadowLookup() this isn't a read, so it isn't counted
+{
+    for (auto &entry : shadow->entries)
+        if ((entry.type == copy.type) && (strncmp(entry.key, copy.key, NVS_KEY_NAME_MAX_SIZE) == 0))
+            return &entry;
+    return nullptr;
+}
+
+/* Public Member Functions */
+esp_err_t NVS::enableWriteBehind(const char *name_space, size_t budgetBytes)
+{
+    if (taskHandleWriteBehind == nullptr)
+    {
+        queueWriteBehind = xQueueCreate(NVS_WRITE_BEHIND_QUEUE_LENGTH, sizeof(NVS_WB_CMD));
+
+        if (queueWriteBehind == nullptr)
+            return ESP_ERR_NO_MEM;
+
+        if (xTaskCreate(runMarshaller, "nvs_wb", NVS_WRITE_BEHIND_STACK_SIZE, this, tskIDLE_PRIORITY + 1, &taskHandleWriteBehind) != pdPASS)
+        {
+            vQueueDelete(queueWriteBehind);
+            queueWriteBehind = nullptr;
+            taskHandleWriteBehind = nullptr;
+            routeLogByFormat<LOG_TYPE::ERROR>("%s(): Unable to start the write-behind task", __func__);
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    ESP_RETURN_ON_ERROR(enableShadowCache(name_space, budgetBytes), TAG, "enableShadowCache() failed...");
+
+    SemaphoreHandle_t lock = namespaceLock(name_space); // Sessions on this namespace must not see the flag change under them
+    xSemaphoreTakeRecursive(lock, portMAX_DELAY);
+
+    esp_err_t ret = ESP_OK;
+    NVS_SHADOW *shadow = findShadow(name_space);
+
+    if (shadow == nullptr)
+        ret = ESP_ERR_NOT_FOUND;
+    else if (shadow->stats.budgetBytes == 0) // Every write would bypass the shadow and go straight to flash anyway
+        ret = ESP_ERR_INVALID_ARG;
+    else
+        shadow->writeBehind = true;
+
+    xSemaphoreGiveRecursive(lock);
+
+    if (ret == ESP_ERR_INVALID_ARG)
+        routeLogByFormat<LOG_TYPE::ERROR>("%s(): Namespace %s has no shadow budget to hold writes in", __func__, name_space);
+    return ret;
+}
+
+void NVS::setWriteBehindPolicy(uint32_t intervalMs, uint16_t dirtyThreshold)
+{
+    writeBehindInterval = intervalMs;
+    writeBehindThreshold = (dirtyThreshold > 0) ? dirtyThreshold : 1;
+}
+
+esp_err_t NVS::flush(TickType_t ticksToWait)
+{
+    esp_err_t ret = flushHeldBack(); // Entries a write policy kept back at close, in namespaces without write-behind
+
+    if (taskHandleWriteBehind == nullptr)
+        return ret;
+
+    if (xSemaphoreTake(semNVSFlush, ticksToWait) != pdTRUE)
+        return ESP_ERR_TIMEOUT;
+
+    xSemaphoreTake(semNVSFlushDone, 0); // Clear a completion left over from an earlier flush() which timed out
+
+    NVS_WB_CMD cmd = NVS_WB_CMD::FLUSH;
+    esp_err_t taskRet = ESP_ERR_TIMEOUT;
+
+    if ((xQueueSend(queueWriteBehind, &cmd, ticksToWait) == pdTRUE) && (xSemaphoreTake(semNVSFlushDone, ticksToWait) == pdTRUE))
+        taskRet = ESP_OK;
+
+    xSemaphoreGive(semNVSFlush);
+    return (ret == ESP_OK) ? taskRet : ret;
+}
+
+/* Private Member Functions */
+void NVS::runMarshaller(void *arg)
+{
+    ((NVS *)arg)->runWriteBehind();
+    vTaskDelete(NULL);
+}
+
+void NVS::runWriteBehind()
+{
+    NVS_WB_CMD cmd;
+    bool pending = false;
+    TickType_t deadline = 0;
+
+    while (true)
+    {
+        TickType_t wait = portMAX_DELAY; // Sleep until someone leaves work for us
+
+        if (pending)
+        {
+            TickType_t now = xTaskGetTickCount();
+            wait = ((int32_t)(deadline - now) > 0) ? (deadline - now) : 0;
+        }
+
+        if (xQueueReceive(queueWriteBehind, &cmd, wait) != pdTRUE) // The interval ran out
+            cmd = NVS_WB_CMD::THRESHOLD;
+
+        switch (cmd)
+        {
+        case NVS_WB_CMD::DIRTY:
+        {
+            if (!pending) // The interval runs from the oldest unwritten change
+            {
+                pending = true;
+                deadline = xTaskGetTickCount() + pdMS_TO_TICKS(writeBehindInterval);
+            }
+            break;
+        }
+
+        case NVS_WB_CMD::THRESHOLD:
+        {
+            pending = writeBehindFlush(false); // Keys held back by their write policy are tried again after another interval
+
+            if (pending)
+                deadline = xTaskGetTickCount() + pdMS_TO_TICKS(writeBehindInterval);
+            break;
+        }
+
+        case NVS_WB_CMD::FLUSH:
+        {
+            writeBehindFlush(true);
+            pending = false;
+            xSemaphoreGive(semNVSFlushDone);
+            break;
+        }
+        }
+    }
+}
+
+bool NVS::writeBehindFlush(bool force)
+{
+    char names[NVS_SHADOW_MAX_NAMESPACES][NVS_KEY_NAME_MAX_SIZE] = {};
+    uint8_t count = 0;
+    bool stillDirty = false;
+
+    xSemaphoreTake(semNVSShadowTable, portMAX_DELAY); // Copy the names.  We can't hold the table while we wait on namespace locks.
+
+    for (auto slot : shadows)
+        if ((slot != nullptr) && slot->writeBehind)
+            memcpy(names[count++], slot->name_space, NVS_KEY_NAME_MAX_SIZE);
+
+    xSemaphoreGive(semNVSShadowTable);
+
+    for (uint8_t i = 0; i < count; i++)
+    {
+        SemaphoreHandle_t lock = namespaceLock(names[i]);
+        xSemaphoreTakeRecursive(lock, portMAX_DELAY);
+
+        NVS_SHADOW *shadow = attachShadow(names[i]); // The shadow may have been disabled since we copied its name.  Attached, it can't be now.
+
+        if (shadow == nullptr)
+        {
+            xSemaphoreGiveRecursive(lock);
+            continue;
+        }
+
+        std::vector<NVS_SHADOW_ENTRY> batch;       // Written without the lock
+        std::vector<NVS_SHADOW_ENTRY> lockedBatch; // Compressed strings, written with it
+        int64_t now = shadow->policies.empty() ? 0 : esp_timer_get_time();
+
+        for (const auto &entry : shadow->entries)
+        {
+            if (!entry.dirty || !shadowDue(shadow, entry, force, now))
+                continue;
+
+            if ((entry.type == NVS_TYPE_STR) && isCompressed(shadow, entry.key))
+                lockedBatch.push_back(entry);
+            else
+                batch.push_back(entry);
+        }
+
+        if (batch.empty() && lockedBatch.empty())
+        {
+            for (const auto &entry : shadow->entries) // Held back by a write policy
+                stillDirty |= entry.dirty;
+
+            detachShadow(shadow);
+            xSemaphoreGiveRecursive(lock);
+            continue;
+        }
+
+        NVS_OpTimer timer(NVS_OP::COMMIT);
+        std::vector<esp_err_t> results(batch.size(), ESP_FAIL);
+        nvs_handle_t handle = 0;
+
+        shadow->flushing = true;
+        xSemaphoreGiveRecursive(lock);
+
+        esp_err_t ret = openNamespace(names[i], &handle);
+
+        for (size_t e = 0; (ret == ESP_OK) && (e < batch.size()); e++)
+            results[e] = shadowWriteEntry(handle, nullptr, batch[e]);
+
+        shadow->flushing = false; // Everything we copied is on flash.  Anyone in shadowAwaitFlush() may go ahead.
+        xSemaphoreTakeRecursive(lock, portMAX_DELAY);
+
+        for (const auto &copy : lockedBatch) // Rare, and short enough to write under the lock
+        {
+            NVS_SHADOW_ENTRY *entry = findEntry(shadow, copy);
+
+            if ((ret == ESP_OK) && (entry != nullptr) && entry->dirty)
+            {
+                batch.push_back(*entry);
+                results.push_back(shadowWriteEntry(handle, shadow, *entry));
+            }
+        }
+
+        for (size_t e = 0; (ret == ESP_OK) && (e < batch.size()); e++)
+        {
+            if (results[e] != ESP_OK) // The entry stays dirty and is tried again next time
+            {
+                routeLogByFormat<LOG_TYPE::ERROR>("%s(): Flush of key %s failed, code = %s", __func__, batch[e].key, esp_err_to_name(results[e]));
+                continue;
+            }
+
+            NVS_SHADOW_ENTRY *entry = findEntry(shadow, batch[e]);
+
+            if ((entry != nullptr) && entry->dirty && (entry->value == batch[e].value) && (entry->text == batch[e].text)) // Unchanged while we wrote
+                shadowMarkFlushed(shadow, *entry, now);
+        }
+
+        for (const auto &entry : shadow->entries)
+            stillDirty |= entry.dirty;
+
+        detachShadow(shadow);
+        xSemaphoreGiveRecursive(lock);
+
+        if (ret == ESP_OK)
+        {
+            for (auto result : results) // Reported above, key by key
+                if ((result != ESP_OK) && (ret == ESP_OK))
+                    ret = result;
+
+            esp_err_t commitRet = nvs_commit(handle);
+
+            if (ret == ESP_OK)
+                ret = commitRet;
+            nvs_close(handle);
+            checkFreeEntries(getPartition(names[i]));
+        }
+
+        if (ret != ESP_OK)
+            routeLogByFormat<LOG_TYPE::ERROR>("%s(): Write-behind of namespace %s failed, code = %s", __func__, names[i], esp_err_to_name(ret));
+    }
+
+    return stillDirty;
+}
+
+// Called with the namespace lock held as a handle on a write-behind namespace closes.  Never blocks: a full queue already holds a wake-up.
+void NVS::writeBehindNotice(NVS_SHADOW *shadow)
+{
+    if ((shadow == nullptr) || !shadow->writeBehind || (queueWriteBehind == nullptr))
+        return;
+
+    uint16_t dirty = 0;
+
+    for (const auto &entry : shadow->entries)
+        if (entry.dirty)
+            dirty++;
+
+    if (dirty == 0)
+        return;
+
+    NVS_WB_CMD cmd = (dirty >= writeBehindThreshold) ? NVS_WB_CMD::THRESHOLD : NVS_WB_CMD::DIRTY;
+    xQueueSend(queueWriteBehind, &cmd, 0);
+}
@@ -0,0 +1,25 @@
+#include "nvs/nvs_.hpp"
+#include "system_.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+//
+// Runs the NVS benchmark once and exits, so a build server can capture stdout as CSV and fail the job on a non-zero exit code.
+//
+class StdoutSink : public NVS_BlobSink // CSV straight to stdout
+{
+public:
+    esp_err_t write(const void *data, size_t length) override
+    {
+        return (fwrite(data, 1, length, stdout) == length) ? ESP_OK : ESP_FAIL;
+    }
+};
+
+extern "C" void app_main(void)
+{
+    StdoutSink sink;
+    esp_err_t ret = NVS::getInstance()->runBenchmark(sink); // The partition is a file on the host, so nothing real is worn
+
+    fflush(stdout);
+    exit((ret == ESP_OK) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
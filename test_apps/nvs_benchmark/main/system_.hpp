@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdint.h> // Standard Libraries
+//
+// Stand-in for the application's system_.hpp.  The NVS component only needs the log types and the show flags from it.
+//
+enum class LOG_TYPE : uint8_t
+{
+    ERROR = 0,
+    WARN,
+    INFO,
+};
+
+constexpr uint8_t _showNVS = 0x01;
+constexpr uint8_t _showRun = 0x02;
+constexpr uint8_t _showEvents = 0x04;
+constexpr uint8_t _showJSONProcessing = 0x08;
+constexpr uint8_t _showDebugging = 0x10;
+constexpr uint8_t _showProcess = 0x20;
+constexpr uint8_t _showPayload = 0x40;